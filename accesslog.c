@@ -0,0 +1,327 @@
+/*
+ * accesslog.c - one line per request, written by a background thread
+ *
+ * The fields come from the request's trace record: trace_end passes
+ * every finished record to accesslog_add, which copies it into the
+ * calling thread's ring and returns. Each ring has a single producer,
+ * its thread, and a single consumer, the writer thread, so head and
+ * tail are plain release/acquire counters on their own cache lines.
+ *
+ * The writer wakes every ACCESSLOG_FLUSH_MS, or early once a ring is
+ * half full, so a ring only needs to hold what one thread finishes in
+ * about that long; a few hundred records keep every logging thread's
+ * share small even with thousands of connection threads. It formats
+ * everything pending into one buffer and writes it with as few write
+ * calls as fit ACCESSLOG_BATCH. Requests never touch stdio or the log
+ * file. Every request must be logged, so a record that finds its ring
+ * full goes on a shared overflow list under its own lock instead, and
+ * is counted in proxy_accesslog_overflow_total; the writer empties
+ * that list after the rings.
+ *
+ * Each line is:
+ *   time client status bytes cache read parse lookup dns connect
+ *   first_byte last_byte uri
+ * with time in seconds since the epoch, cache one of HIT, MISS, STALE
+ * or -, and each phase in microseconds since the request started, or
+ * - if the request never reached it.
+ */
+#include "accesslog.h"
+#include "metrics.h"
+#include <time.h>
+
+/* Longest formatted line */
+#define LINE_LEN (256 + TRACE_URI_LEN)
+
+typedef struct log_ring_t log_ring_t;
+struct log_ring_t {
+	uint64_t head;              /* records added, by the owner */
+	char pad1[56];
+	uint64_t tail;              /* records written out, by the writer */
+	char pad2[56];
+	log_ring_t *next;           /* registry of every ring */
+	log_ring_t *free_next;
+	trace_rec_t recs[ACCESSLOG_RING];
+} __attribute__((aligned(64)));
+
+int accesslog_enabled;
+
+static __thread log_ring_t *log_self;
+static log_ring_t *registry;
+static log_ring_t *free_rings;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+
+/* Records that found their ring full, oldest first */
+typedef struct overflow_t overflow_t;
+struct overflow_t {
+	trace_rec_t rec;
+	overflow_t *next;
+};
+
+static overflow_t *overflow_head, *overflow_tail;
+static pthread_mutex_t overflow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Writer state, guarded by lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static char *log_path;
+static int log_fd = -1;
+static int write_failed;
+static char batch[ACCESSLOG_BATCH];
+
+static const char *cache_names[] = { "-", "HIT", "MISS", "STALE" };
+
+static void ring_release(void *arg)
+{
+	log_ring_t *r = (log_ring_t *)arg;
+
+	pthread_mutex_lock(&ring_lock);
+	r->free_next = free_rings;
+	free_rings = r;
+	pthread_mutex_unlock(&ring_lock);
+}
+
+static log_ring_t *ring_claim()
+{
+	log_ring_t *r;
+
+	pthread_mutex_lock(&ring_lock);
+	if ((r = free_rings) != NULL) {
+		free_rings = r->free_next;
+	}
+	else {
+		if (posix_memalign((void **)&r, 64, sizeof(*r)) != 0)
+			unix_error("posix_memalign error");
+		memset(r, 0, sizeof(*r));
+		r->next = registry;
+		__atomic_store_n(&registry, r, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&ring_lock);
+	pthread_setspecific(ring_key, r);
+	log_self = r;
+	return r;
+}
+
+/*
+ * accesslog_add - queue a finished request for the log
+ */
+void accesslog_add(trace_rec_t *rec)
+{
+	log_ring_t *r = log_self ? log_self : ring_claim();
+	uint64_t pending = r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	overflow_t *o;
+
+	if (pending == ACCESSLOG_RING) {
+		o = (overflow_t *)Malloc(sizeof(*o));
+		o->rec = *rec;
+		o->next = NULL;
+		pthread_mutex_lock(&overflow_lock);
+		if (overflow_tail)
+			overflow_tail->next = o;
+		else
+			overflow_head = o;
+		overflow_tail = o;
+		pthread_mutex_unlock(&overflow_lock);
+		metrics_inc(M_ACCESSLOG_OVERFLOW);
+		pthread_cond_signal(&wake);
+		return;
+	}
+	r->recs[r->head % ACCESSLOG_RING] = *rec;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+	if (pending + 1 == ACCESSLOG_RING / 2)
+		pthread_cond_signal(&wake);
+}
+
+/*
+ * Write v in decimal at p, at least width digits; return the end
+ */
+static char *put_num(char *p, uint64_t v, int width)
+{
+	char digits[20];
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v || n < width);
+	while (n > 0)
+		*p++ = digits[--n];
+	return p;
+}
+
+static char *put_str(char *p, const char *s)
+{
+	while (*s)
+		*p++ = *s++;
+	return p;
+}
+
+/*
+ * Format one record into out, return its length. By hand: the writer
+ * formats every request, and printf would cost it several times more.
+ */
+static size_t format(char *out, trace_rec_t *rec, uint64_t wall_offset)
+{
+	uint64_t start = rec->t[TR_START], wall = start + wall_offset;
+	unsigned char *ip = (unsigned char *)&rec->client;
+	char *p = out;
+	int i;
+
+	p = put_num(p, wall / 1000000000, 1);
+	*p++ = '.';
+	p = put_num(p, wall / 1000000 % 1000, 3);
+	for (i = 0; i < 4; i++) {
+		*p++ = i ? '.' : ' ';
+		p = put_num(p, ip[i], 1);
+	}
+	*p++ = ' ';
+	p = put_num(p, rec->status, 1);
+	*p++ = ' ';
+	p = put_num(p, rec->bytes, 1);
+	*p++ = ' ';
+	p = put_str(p, cache_names[rec->cache <= TR_STALE ? rec->cache : TR_NOCACHE]);
+	for (i = TR_READ; i < TR_NPHASES; i++) {
+		*p++ = ' ';
+		if (rec->t[i])
+			p = put_num(p, (rec->t[i] - start) / 1000, 1);
+		else
+			*p++ = '-';
+	}
+	*p++ = ' ';
+	p = put_str(p, rec->uri);
+	*p++ = '\n';
+	return p - out;
+}
+
+/*
+ * Write len bytes of batch; caller holds lock
+ */
+static void emit(size_t len)
+{
+	if (len == 0 || log_fd < 0)
+		return;
+	if (rio_writen(log_fd, batch, len) < 0 && !write_failed) {
+		fprintf(stderr, "access log %s: %s\n", log_path, strerror(errno));
+		write_failed = 1;
+	}
+}
+
+/*
+ * Write out every pending record; caller holds lock
+ */
+static void drain()
+{
+	struct timespec ts;
+	uint64_t wall_offset, head, tail;
+	log_ring_t *r;
+	overflow_t *o, *next;
+	size_t n = 0;
+
+	/* Record times are monotonic; the log wants wall-clock times */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	wall_offset = ts.tv_sec * 1000000000ull + ts.tv_nsec - metrics_now();
+	for (r = __atomic_load_n(&registry, __ATOMIC_ACQUIRE); r; r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (tail = r->tail; tail < head; tail++) {
+			if (n > sizeof(batch) - LINE_LEN) {
+				emit(n);
+				n = 0;
+			}
+			n += format(batch + n, &r->recs[tail % ACCESSLOG_RING],
+				wall_offset);
+		}
+		/* Slots are only reused once they are formatted */
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	/* Then whatever overflowed, newer than what its ring held */
+	pthread_mutex_lock(&overflow_lock);
+	o = overflow_head;
+	overflow_head = overflow_tail = NULL;
+	pthread_mutex_unlock(&overflow_lock);
+	for (; o; o = next) {
+		if (n > sizeof(batch) - LINE_LEN) {
+			emit(n);
+			n = 0;
+		}
+		n += format(batch + n, &o->rec, wall_offset);
+		next = o->next;
+		Free(o);
+	}
+	emit(n);
+}
+
+static void *writer(void *vargp)
+{
+	struct timespec ts;
+
+	Pthread_detach(pthread_self());
+	pthread_mutex_lock(&lock);
+	while (1) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += ACCESSLOG_FLUSH_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&wake, &lock, &ts);
+		drain();
+	}
+	return NULL;
+}
+
+/*
+ * accesslog_open - append the access log to path and start its writer;
+ * 		0 on success, -1 if path cannot be opened
+ */
+int accesslog_open(char *path)
+{
+	pthread_t tid;
+	int rc;
+
+	if ((log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+		return -1;
+	if ((rc = pthread_key_create(&ring_key, ring_release)) != 0)
+		posix_error(rc, "pthread_key_create error");
+	log_path = strdup(path);
+	Pthread_create(&tid, NULL, writer, NULL);
+	accesslog_enabled = 1;
+	return 0;
+}
+
+/*
+ * accesslog_reopen - start a new file at the same path, after the old
+ * 		one was rotated away; keeps the old file on error
+ */
+void accesslog_reopen()
+{
+	int fd;
+
+	if (!accesslog_enabled)
+		return;
+	pthread_mutex_lock(&lock);
+	drain();
+	if ((fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+		fprintf(stderr, "cannot reopen access log %s: %s\n", log_path,
+			strerror(errno));
+	}
+	else {
+		close(log_fd);
+		log_fd = fd;
+		write_failed = 0;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * accesslog_flush - write out everything logged so far, before exiting
+ */
+void accesslog_flush()
+{
+	if (!accesslog_enabled)
+		return;
+	pthread_mutex_lock(&lock);
+	drain();
+	pthread_mutex_unlock(&lock);
+}
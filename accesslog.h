@@ -0,0 +1,19 @@
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+#include "csapp.h"
+#include "trace.h"
+
+/* Access log (-l): per-thread rings drained by one writer thread */
+#define ACCESSLOG_RING 256          /* records a thread can have pending */
+#define ACCESSLOG_FLUSH_MS 100      /* the writer wakes at least this often */
+#define ACCESSLOG_BATCH (256 << 10) /* formatted bytes per write */
+
+extern int accesslog_enabled;
+
+int accesslog_open(char *path);
+void accesslog_add(trace_rec_t *rec);
+void accesslog_reopen();
+void accesslog_flush();
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * admit.c - keep one-hit wonders out of the cache
+ *
+ * With -A a response is only stored the second time its key misses
+ * within a window, so URIs fetched once do not evict entries that get
+ * hits, nor cost a Calloc and a copy. Sightings are kept in two Bloom
+ * filter generations of ADMIT_WINDOW URIs each: a key seen in either is
+ * admitted, otherwise it is added to the current one and rejected. When
+ * the current generation has taken ADMIT_WINDOW keys the older one is
+ * cleared and becomes current, so a sighting is remembered for between
+ * one and two windows.
+ *
+ * The filters are blocked: a key's ADMIT_PROBES bits all lie in one
+ * 64-byte block picked by its hash, so a check touches one cache line
+ * per generation. At ADMIT_BITS bits per URI that costs a few percent
+ * false admissions, which only means an occasional one-hit wonder is
+ * stored anyway. Bits are set with atomic ORs and read without locks;
+ * a check racing the clear of the old generation can at worst reject a
+ * key one extra time.
+ */
+#include "admit.h"
+
+#define BLOCK_WORDS 8               /* 64-bit words per 64-byte block */
+#define NBLOCKS (ADMIT_WINDOW * ADMIT_BITS / 512)
+
+static uint64_t (*gens[2])[BLOCK_WORDS];
+static int cur;                     /* generation taking new keys */
+static uint64_t inserts;
+static uint64_t admitted, rejected;
+static int enabled;
+
+/*
+ * admit_init - allocate the filters; with enabled 0 everything is
+ * 		admitted
+ */
+void admit_init(int on)
+{
+	int i;
+
+	if (!(enabled = on))
+		return;
+	for (i = 0; i < 2; i++) {
+		if (posix_memalign((void **)&gens[i], 64,
+				NBLOCKS * sizeof(*gens[i])) != 0)
+			unix_error("posix_memalign error");
+		memset(gens[i], 0, NBLOCKS * sizeof(*gens[i]));
+	}
+}
+
+int admit_enabled()
+{
+	return enabled;
+}
+
+/*
+ * 64-bit FNV-1a with a final mix, so every bit depends on every byte
+ */
+static uint64_t hash(char *s)
+{
+	uint64_t h = 14695981039346656037ull;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 1099511628211ull;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * Are all of the key's bits set in block b?
+ */
+static int block_has(uint64_t *b, uint64_t h)
+{
+	int i, bit;
+
+	for (i = 0; i < ADMIT_PROBES; i++) {
+		bit = (h >> (9 * i)) & 511;
+		if (!(__atomic_load_n(&b[bit >> 6], __ATOMIC_RELAXED) &
+				(1ull << (bit & 63))))
+			return 0;
+	}
+	return 1;
+}
+
+static void block_add(uint64_t *b, uint64_t h)
+{
+	int i, bit;
+
+	for (i = 0; i < ADMIT_PROBES; i++) {
+		bit = (h >> (9 * i)) & 511;
+		__atomic_fetch_or(&b[bit >> 6], 1ull << (bit & 63), __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * admit_check - should the response for key be cached? Records the
+ * 		sighting either way
+ */
+int admit_check(char *key)
+{
+	uint64_t h, block;
+	int c;
+
+	if (!enabled)
+		return 1;
+	h = hash(key);
+	/* Block from the high bits, probes from the low 36 */
+	block = (h >> 40) % NBLOCKS;
+	c = __atomic_load_n(&cur, __ATOMIC_ACQUIRE);
+	if (block_has(gens[c][block], h) || block_has(gens[c ^ 1][block], h)) {
+		__atomic_fetch_add(&admitted, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	block_add(gens[c][block], h);
+	/* Whoever takes the last slot of the window starts the next one */
+	if (__atomic_add_fetch(&inserts, 1, __ATOMIC_RELAXED) % ADMIT_WINDOW == 0) {
+		memset(gens[c ^ 1], 0, NBLOCKS * sizeof(*gens[c ^ 1]));
+		__atomic_store_n(&cur, c ^ 1, __ATOMIC_RELEASE);
+	}
+	__atomic_fetch_add(&rejected, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * admit_footprint - bytes used by the filters
+ */
+size_t admit_footprint()
+{
+	return enabled ? 2 * NBLOCKS * sizeof(*gens[0]) : 0;
+}
+
+void admit_stats(uint64_t *a, uint64_t *r)
+{
+	*a = __atomic_load_n(&admitted, __ATOMIC_RELAXED);
+	*r = __atomic_load_n(&rejected, __ATOMIC_RELAXED);
+}
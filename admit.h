@@ -0,0 +1,18 @@
+#ifndef __ADMIT_H__
+#define __ADMIT_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+/* Second-sighting admission for cache_store (-A) */
+#define ADMIT_WINDOW (1 << 16)      /* URIs per filter generation */
+#define ADMIT_BITS 8                /* filter bits per URI */
+#define ADMIT_PROBES 4              /* bits set per URI, in one block */
+
+void admit_init(int enabled);
+int admit_enabled();
+int admit_check(char *key);
+size_t admit_footprint();
+void admit_stats(uint64_t *admitted, uint64_t *rejected);
+
+#endif
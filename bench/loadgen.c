@@ -0,0 +1,470 @@
+/*
+ * loadgen.c - multi-threaded HTTP/1.0 load generator for the proxy
+ *
+ * Closed loop (default): each of -c workers sends a request, waits for
+ * the whole response, and immediately sends the next one.
+ * Open loop (-r rate): requests are issued on a fixed schedule split
+ * across the workers; latency is measured from the scheduled start, so
+ * a stalled proxy is not hidden by coordinated omission.
+ *
+ * URI mixes (-m):
+ *   hit    uniform over -n objects that all fit in the cache
+ *   miss   every request is a distinct URI
+ *   zipf   Zipfian over -n objects with skew -z
+ *   page   a distinct HTML page, then the -l images it links, one after
+ *          another like a first visitor; latency covers the whole page
+ *
+ * -B binds the client side to a local address (any 127.x works on
+ * loopback), so several loadgens look like distinct clients to the
+ * proxy's per-client limits. 429 answers are counted as "limited".
+ *
+ * -k pct:query appends query to that percentage of requests only, for
+ * a skewed mix such as a few slow origins among fast ones
+ * (-k 10:&delay=200).
+ *
+ * When the proxy exposes /__proxy/metrics, the cache hit ratio,
+ * cross-node (NUMA) hits and replications during the run and the
+ * proxy's cache lookup p99 are reported as well.
+ *
+ * With -P the proxy's CPU time per request and per Gbit delivered is
+ * reported, and so are its read/write system calls per request
+ * (rw_syscalls_per_req): the read- and write-family calls counted in
+ * /proc/<pid>/io plus, for the io_uring engine, its io_uring_enter
+ * calls from the metrics. accept, connect, socket, close and the other
+ * calls /proc does not count are left out, and those are among the
+ * ones io_uring replaces, so the figure understates the blocking
+ * engine's system calls more than the io_uring engine's.
+ *
+ * usage: loadgen -p proxyport -o originport [-c conns] [-d secs]
+ *                [-r rate] [-m hit|miss|zipf|page] [-n objects] [-s size]
+ *                [-z skew] [-P proxypid] [-q query] [-B bindaddr]
+ *                [-k pct:query] [-l links]
+ */
+#include "csapp.h"
+#include <getopt.h>
+#include <time.h>
+
+enum { MIX_HIT, MIX_MISS, MIX_ZIPF, MIX_PAGE };
+
+typedef struct {
+	int id;
+	unsigned int seed;
+	double *lat;        /* latencies in microseconds */
+	size_t nlat, cap;
+	unsigned long errors, limited;
+	unsigned long long bytes;
+} worker_t;
+
+static int proxy_port, origin_port = 18000;
+static int conns = 8, duration = 5, mix = MIX_HIT, objects = 32, links = 8;
+static long size = 1024;
+static double rate, skew = 0.99;
+static char *extra_query = "";
+static char *skew_query = "";
+static double skew_pct;
+static char *bind_addr;
+static double *zipf_cdf;
+static unsigned long miss_seq;
+static unsigned int run_nonce;
+static double deadline;
+
+static double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Read utime+stime of pid in seconds, -1 if unavailable
+ */
+static double proc_cpu(int pid)
+{
+	char path[64], buf[MAXLINE], *p;
+	unsigned long ut, st;
+	FILE *f;
+	int i;
+
+	sprintf(path, "/proc/%d/stat", pid);
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	if (fgets(buf, sizeof(buf), f) == NULL) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	/* Fields after the parenthesised command; utime is the 14th */
+	if ((p = strrchr(buf, ')')) == NULL)
+		return -1;
+	for (i = 0; i < 11 && p; i++)
+		p = strchr(p + 1, ' ');
+	if (p == NULL || sscanf(p, " %lu %lu", &ut, &st) != 2)
+		return -1;
+	return (double)(ut + st) / sysconf(_SC_CLK_TCK);
+}
+
+/*
+ * Read and write system calls made by pid so far, -1 if unavailable
+ */
+static double proc_syscalls(int pid)
+{
+	char path[64], line[MAXLINE];
+	unsigned long long n;
+	double total = -1;
+	FILE *f;
+
+	sprintf(path, "/proc/%d/io", pid);
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "syscr: %llu", &n) == 1 ||
+			sscanf(line, "syscw: %llu", &n) == 1)
+			total = (total < 0 ? 0 : total) + n;
+	}
+	fclose(f);
+	return total;
+}
+
+/*
+ * Connect to the proxy, from bind_addr if one was given
+ */
+static int connect_proxy()
+{
+	struct sockaddr_in sa;
+	int fd;
+
+	if (bind_addr == NULL)
+		return open_clientfd_r("127.0.0.1", proxy_port);
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	if (inet_pton(AF_INET, bind_addr, &sa.sin_addr) != 1 ||
+		bind(fd, (SA *)&sa, sizeof(sa)) < 0)
+		goto fail;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(proxy_port);
+	if (connect(fd, (SA *)&sa, sizeof(sa)) < 0)
+		goto fail;
+	return fd;
+fail:
+	close(fd);
+	return -1;
+}
+
+/*
+ * Fetch the proxy's metrics page; returns a Malloc'd string or NULL
+ */
+static char *scrape()
+{
+	char *page = NULL, buf[MAXBUF];
+	size_t len = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open_clientfd_r("127.0.0.1", proxy_port)) < 0)
+		return NULL;
+	strcpy(buf, "GET /__proxy/metrics HTTP/1.0\r\n\r\n");
+	if (rio_writen(fd, buf, strlen(buf)) < 0) {
+		close(fd);
+		return NULL;
+	}
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		page = (char *)Realloc(page, len + n + 1);
+		memcpy(page + len, buf, n);
+		len += n;
+		page[len] = '\0';
+	}
+	close(fd);
+	return page;
+}
+
+/*
+ * Value of the sample line starting with name, or -1
+ */
+static double metric(char *page, char *name)
+{
+	char *p = page;
+	size_t len = strlen(name);
+
+	while (p && (p = strstr(p, name)) != NULL) {
+		if ((p == page || p[-1] == '\n') && p[len] == ' ')
+			return atof(p + len + 1);
+		p += len;
+	}
+	return -1;
+}
+
+static void build_zipf()
+{
+	double sum = 0;
+	int i;
+
+	zipf_cdf = (double *)Malloc(objects * sizeof(double));
+	for (i = 0; i < objects; i++)
+		sum += 1.0 / pow(i + 1, skew);
+	zipf_cdf[0] = 1.0 / sum;
+	for (i = 1; i < objects; i++)
+		zipf_cdf[i] = zipf_cdf[i - 1] + 1.0 / pow(i + 1, skew) / sum;
+}
+
+static long pick_object(worker_t *w)
+{
+	double u;
+	int lo = 0, hi = objects - 1, mid;
+
+	switch (mix) {
+	case MIX_MISS:
+	case MIX_PAGE:
+		return __atomic_fetch_add(&miss_seq, 1, __ATOMIC_RELAXED);
+	case MIX_ZIPF:
+		u = (double)rand_r(&w->seed) / RAND_MAX;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (zipf_cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo;
+	default:
+		return rand_r(&w->seed) % objects;
+	}
+}
+
+/*
+ * GET path from the origin through the proxy; body+header bytes or -1
+ */
+static long get(worker_t *w, char *path)
+{
+	char buf[MAXBUF];
+	long total = 0;
+	ssize_t n;
+	int fd, status = 0;
+
+	if ((fd = connect_proxy()) < 0)
+		return -1;
+	sprintf(buf, "GET http://127.0.0.1:%d%s HTTP/1.0\r\n"
+		"Host: 127.0.0.1:%d\r\n\r\n", origin_port, path, origin_port);
+	if (rio_writen(fd, buf, strlen(buf)) < 0) {
+		close(fd);
+		return -1;
+	}
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		if (total == 0 && sscanf(buf, "HTTP/%*s %d", &status) != 1)
+			status = 0;
+		total += n;
+	}
+	close(fd);
+	/* Proxy-generated or origin 5xx responses count as errors */
+	if (n < 0 || status == 0 || status >= 500)
+		return -1;
+	if (status == 429)
+		w->limited++;
+	return total;
+}
+
+/*
+ * One request (or a page and its images) through the proxy; returns
+ * bytes received or -1
+ */
+static long do_request(worker_t *w)
+{
+	char path[MAXLINE], query[MAXLINE / 2];
+	long id = pick_object(w), total, n;
+	int i;
+
+	snprintf(query, sizeof(query), "size=%ld%s%s", size, extra_query,
+		rand_r(&w->seed) % 10000 < skew_pct * 100 ? skew_query : "");
+	if (mix != MIX_PAGE) {
+		snprintf(path, sizeof(path), "/obj/%u-%ld?%s", run_nonce, id, query);
+		return get(w, path);
+	}
+	snprintf(path, sizeof(path), "/page/%u-%ld.html?links=%d&%s", run_nonce,
+		id, links, query);
+	if ((total = get(w, path)) < 0)
+		return -1;
+	for (i = 0; i < links; i++) {
+		snprintf(path, sizeof(path), "/page/%u-%ld-%d?links=%d&%s", run_nonce,
+			id, i, links, query);
+		if ((n = get(w, path)) < 0)
+			return -1;
+		total += n;
+	}
+	return total;
+}
+
+static void add_latency(worker_t *w, double usec)
+{
+	if (w->nlat == w->cap) {
+		w->cap = w->cap ? w->cap * 2 : 4096;
+		w->lat = (double *)Realloc(w->lat, w->cap * sizeof(double));
+	}
+	w->lat[w->nlat++] = usec;
+}
+
+void *worker(void *vargp)
+{
+	worker_t *w = (worker_t *)vargp;
+	double start, next = now_sec(), gap = 0;
+	long n;
+
+	if (rate > 0) {
+		gap = conns / rate;
+		next += gap * w->id / conns;
+	}
+	while ((start = now_sec()) < deadline) {
+		if (rate > 0) {
+			if (next > start) {
+				usleep((useconds_t)((next - start) * 1e6));
+				continue;
+			}
+			start = next;
+			next += gap;
+		}
+		if ((n = do_request(w)) < 0)
+			w->errors++;
+		else
+			w->bytes += n;
+		add_latency(w, (now_sec() - start) * 1e6);
+	}
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+	worker_t *workers;
+	pthread_t *tids;
+	double *all, t0, elapsed, cpu0 = -1, cpu1 = -1, hits, misses;
+	double sys0 = -1, sys1 = -1, enters;
+	char *before, *after;
+	size_t total = 0, k;
+	unsigned long errors = 0, limited = 0;
+	unsigned long long bytes = 0;
+	int c, i, pid = 0;
+
+	while ((c = getopt(argc, argv, "p:o:c:d:r:m:n:s:z:P:q:B:k:l:")) != -1) {
+		switch (c) {
+		case 'p': proxy_port = atoi(optarg); break;
+		case 'o': origin_port = atoi(optarg); break;
+		case 'c': conns = atoi(optarg); break;
+		case 'd': duration = atoi(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 'n': objects = atoi(optarg); break;
+		case 's': size = atol(optarg); break;
+		case 'z': skew = atof(optarg); break;
+		case 'P': pid = atoi(optarg); break;
+		case 'q': extra_query = optarg; break;
+		case 'B': bind_addr = optarg; break;
+		case 'l': links = atoi(optarg); break;
+		case 'k':
+			skew_pct = atof(optarg);
+			if ((skew_query = strchr(optarg, ':')) == NULL)
+				skew_query = "";
+			else
+				skew_query++;
+			break;
+		case 'm':
+			if (!strcmp(optarg, "miss"))
+				mix = MIX_MISS;
+			else if (!strcmp(optarg, "zipf"))
+				mix = MIX_ZIPF;
+			else if (!strcmp(optarg, "page"))
+				mix = MIX_PAGE;
+			else
+				mix = MIX_HIT;
+			break;
+		default:
+			fprintf(stderr, "usage: %s -p proxyport -o originport [-c conns] "
+				"[-d secs] [-r rate] [-m hit|miss|zipf|page] [-n objects] "
+				"[-s size] [-z skew] [-P proxypid] [-q query] [-B bindaddr] "
+				"[-k pct:query] [-l links]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (proxy_port == 0 || conns < 1 || objects < 1) {
+		fprintf(stderr, "%s: -p is required\n", argv[0]);
+		exit(1);
+	}
+	Signal(SIGPIPE, SIG_IGN);
+	run_nonce = (unsigned int)time(NULL) ^ getpid();
+	if (mix == MIX_ZIPF)
+		build_zipf();
+
+	workers = (worker_t *)Calloc(conns, sizeof(worker_t));
+	tids = (pthread_t *)Malloc(conns * sizeof(pthread_t));
+	before = scrape();
+	if (pid) {
+		cpu0 = proc_cpu(pid);
+		sys0 = proc_syscalls(pid);
+	}
+	t0 = now_sec();
+	deadline = t0 + duration;
+	for (i = 0; i < conns; i++) {
+		workers[i].id = i;
+		workers[i].seed = run_nonce + i;
+		Pthread_create(&tids[i], NULL, worker, &workers[i]);
+	}
+	for (i = 0; i < conns; i++) {
+		Pthread_join(tids[i], NULL);
+		total += workers[i].nlat;
+		errors += workers[i].errors;
+		limited += workers[i].limited;
+		bytes += workers[i].bytes;
+	}
+	elapsed = now_sec() - t0;
+	if (pid) {
+		cpu1 = proc_cpu(pid);
+		sys1 = proc_syscalls(pid);
+	}
+	after = scrape();
+
+	all = (double *)Malloc((total ? total : 1) * sizeof(double));
+	for (i = 0, k = 0; i < conns; i++) {
+		memcpy(all + k, workers[i].lat, workers[i].nlat * sizeof(double));
+		k += workers[i].nlat;
+	}
+	qsort(all, total, sizeof(double), cmp_double);
+
+	printf("requests=%zu errors=%lu rps=%.1f MBps=%.2f",
+		total, errors, total / elapsed, bytes / elapsed / 1e6);
+	if (total > 0)
+		printf(" p50_us=%.0f p99_us=%.0f p999_us=%.0f",
+			all[(size_t)(total * 0.5)], all[(size_t)(total * 0.99)],
+			all[(size_t)(total * 0.999)]);
+	if (limited > 0)
+		printf(" limited=%lu", limited);
+	if (cpu0 >= 0 && cpu1 >= 0 && total > 0)
+		printf(" cpu_us_per_req=%.1f", (cpu1 - cpu0) * 1e6 / total);
+	if (cpu0 >= 0 && cpu1 >= 0 && bytes > 0)
+		printf(" cpu_s_per_gbit=%.3f", (cpu1 - cpu0) / (bytes * 8 / 1e9));
+	if (sys0 >= 0 && sys1 >= 0 && total > 0) {
+		enters = 0;
+		if (before && after && metric(after, "proxy_uring_enters_total") >= 0)
+			enters = metric(after, "proxy_uring_enters_total") -
+				metric(before, "proxy_uring_enters_total");
+		printf(" rw_syscalls_per_req=%.2f", (sys1 - sys0 + enters) / total);
+	}
+	if (before && after && metric(after, "proxy_cache_hits_total") >= 0) {
+		hits = metric(after, "proxy_cache_hits_total") -
+			metric(before, "proxy_cache_hits_total");
+		misses = metric(after, "proxy_cache_misses_total") -
+			metric(before, "proxy_cache_misses_total");
+		if (hits + misses > 0)
+			printf(" hit_ratio=%.3f", hits / (hits + misses));
+		printf(" remote_hits=%.0f replications=%.0f lookup_p99_us=%.1f",
+			metric(after, "proxy_cache_remote_hits_total") -
+				metric(before, "proxy_cache_remote_hits_total"),
+			metric(after, "proxy_cache_replications_total") -
+				metric(before, "proxy_cache_replications_total"),
+			metric(after, "proxy_phase_quantile_seconds{phase=\"cache_lookup\",quantile=\"0.99\"}") * 1e6);
+	}
+	printf("\n");
+	return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * origin.c - synthetic origin server for the proxy benchmarks
+ *
+ * Serves generated bodies so no files are needed. The request path is
+ * ignored except for its query string:
+ *   size=N    body length in bytes (default 1024)
+ *   delay=MS  sleep before answering
+ *   status=S  status code to answer with (default 200)
+ *   links=N   if the path ends in .html, answer an HTML page that links
+ *             N images: the same path without .html plus -0 .. -(N-1),
+ *             each with the page's query string
+ *
+ * usage: origin <port>
+ */
+#include "csapp.h"
+
+static char pattern[MAXBUF];
+
+void *serve(void *vargp);
+static long query_param(char *uri, char *name, long dflt);
+
+int main(int argc, char **argv)
+{
+	int listenfd, *connfdp, i;
+	pthread_t tid;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <port>\n", argv[0]);
+		exit(1);
+	}
+	Signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < MAXBUF; i++)
+		pattern[i] = 'a' + i % 26;
+
+	listenfd = Open_listenfd(atoi(argv[1]));
+	while (1) {
+		connfdp = (int *)Malloc(sizeof(int));
+		if ((*connfdp = accept(listenfd, NULL, NULL)) < 0) {
+			Free(connfdp);
+			continue;
+		}
+		Pthread_create(&tid, NULL, serve, connfdp);
+	}
+	return 0;
+}
+
+/*
+ * Find name=value in the query string of uri
+ */
+static long query_param(char *uri, char *name, long dflt)
+{
+	char *q = strchr(uri, '?'), *p;
+	size_t len = strlen(name);
+
+	for (p = q; p != NULL; p = strchr(p + 1, '&')) {
+		if (!strncmp(p + 1, name, len) && p[len + 1] == '=')
+			return atol(p + len + 2);
+	}
+	return dflt;
+}
+
+/*
+ * serve - answer one HTTP/1.0 request
+ */
+void *serve(void *vargp)
+{
+	int fd = *(int *)vargp;
+	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+	char page[4 * MAXBUF], *query, *dot;
+	long size, delay, status, links, n, i;
+	rio_t rio;
+
+	Pthread_detach(pthread_self());
+	Free(vargp);
+
+	rio_readinitb(&rio, fd);
+	if (rio_readlineb(&rio, buf, MAXLINE) <= 0) {
+		close(fd);
+		return NULL;
+	}
+	sscanf(buf, "%s %s %s", method, uri, version);
+	while (rio_readlineb(&rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n"))
+		;
+
+	size = query_param(uri, "size", 1024);
+	delay = query_param(uri, "delay", 0);
+	status = query_param(uri, "status", 200);
+	links = query_param(uri, "links", 0);
+	if (delay > 0)
+		usleep(delay * 1000);
+
+	/* An HTML page: links reuse the query, with & escaped as &amp; */
+	query = strchr(uri, '?');
+	if (query)
+		*query++ = '\0';
+	if (links > 0 && (dot = strstr(uri, ".html")) != NULL && dot[5] == '\0') {
+		*dot = '\0';
+		strcpy(page, "<html><body>\n");
+		for (i = 0; i < links && strlen(page) + 2 * MAXLINE < sizeof(page); i++) {
+			n = strlen(page);
+			n += snprintf(page + n, MAXLINE, "<img src=\"%s-%ld?", uri, i);
+			for (dot = query; dot && *dot; dot++) {
+				if (*dot == '&')
+					n += sprintf(page + n, "&amp;");
+				else
+					page[n++] = *dot;
+			}
+			strcpy(page + n, "\">\n");
+		}
+		strcat(page, "</body></html>\n");
+		sprintf(buf, "HTTP/1.0 %ld Synthetic\r\n"
+			"Content-Type: text/html\r\n"
+			"Content-Length: %zu\r\n\r\n", status, strlen(page));
+		if (rio_writen(fd, buf, strlen(buf)) >= 0)
+			rio_writen(fd, page, strlen(page));
+		close(fd);
+		return NULL;
+	}
+
+	sprintf(buf, "HTTP/1.0 %ld Synthetic\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"Content-Length: %ld\r\n\r\n", status, size);
+	if (rio_writen(fd, buf, strlen(buf)) < 0) {
+		close(fd);
+		return NULL;
+	}
+	while (size > 0) {
+		n = size < MAXBUF ? size : MAXBUF;
+		if (rio_writen(fd, pattern, n) < 0)
+			break;
+		size -= n;
+	}
+	close(fd);
+	return NULL;
+}
@@ -0,0 +1,210 @@
+/*
+ * replay.c - replay a request log against a simulated cache, once
+ * admitting every miss and once through the admission filter (-A)
+ *
+ * Each line is one request. In a Common Log Format line the quoted
+ * request gives the URI and the status and byte count after it give
+ * the response; any other line is "uri [size]". Misses on 200 (or
+ * status-less) responses up to MAX_OBJECT_SIZE are stored. The cache
+ * is simulated like cache.c: one byte budget and CLOCK eviction.
+ *
+ * For each run the hit ratio is reported, along with the stores (a
+ * Calloc and a copy each in the proxy), the bytes copied and the
+ * evictions, plus the filter's footprint.
+ *
+ * usage: replay [-m cachebytes] [-s defaultsize] < log
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "admit.h"
+#include <getopt.h>
+
+#define SIM_BUCKETS (1 << 16)
+
+typedef struct entry_t entry_t;
+struct entry_t {
+	char *uri;
+	size_t size;
+	int visited;
+	entry_t *hnext, *next, *prev;
+};
+
+typedef struct {
+	entry_t *buckets[SIM_BUCKETS];
+	entry_t *head, *tail;
+	size_t size, max;
+	unsigned long hits, stores, evictions;
+	unsigned long long copied;
+} sim_t;
+
+typedef struct {
+	char *uri;
+	size_t size;
+	int cacheable;
+} req_t;
+
+static unsigned int hash(char *s)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	return h;
+}
+
+static entry_t *lookup(sim_t *s, char *uri)
+{
+	entry_t *e;
+
+	for (e = s->buckets[hash(uri) % SIM_BUCKETS]; e; e = e->hnext)
+		if (!strcmp(e->uri, uri))
+			return e;
+	return NULL;
+}
+
+static void unlink_age(sim_t *s, entry_t *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		s->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		s->tail = e->prev;
+}
+
+static void push_head(sim_t *s, entry_t *e)
+{
+	e->prev = NULL;
+	e->next = s->head;
+	if (s->head)
+		s->head->prev = e;
+	else
+		s->tail = e;
+	s->head = e;
+}
+
+/*
+ * Evict one entry with CLOCK, as cache.c does
+ */
+static void evict(sim_t *s)
+{
+	entry_t *e, **pp;
+
+	while ((e = s->tail) != NULL && e->visited) {
+		e->visited = 0;
+		unlink_age(s, e);
+		push_head(s, e);
+	}
+	if (e == NULL)
+		return;
+	unlink_age(s, e);
+	for (pp = &s->buckets[hash(e->uri) % SIM_BUCKETS]; *pp != e; pp = &(*pp)->hnext)
+		;
+	*pp = e->hnext;
+	s->size -= e->size;
+	s->evictions++;
+	Free(e);
+}
+
+static void store(sim_t *s, char *uri, size_t size)
+{
+	entry_t *e = (entry_t *)Calloc(1, sizeof(*e));
+	unsigned int b = hash(uri) % SIM_BUCKETS;
+
+	while (s->size + size > s->max && s->tail)
+		evict(s);
+	e->uri = uri;
+	e->size = size;
+	e->hnext = s->buckets[b];
+	s->buckets[b] = e;
+	push_head(s, e);
+	s->size += size;
+	s->stores++;
+	s->copied += size;
+}
+
+static void run(char *name, req_t *reqs, size_t n, size_t max, int filter)
+{
+	sim_t *s = (sim_t *)Calloc(1, sizeof(*s));
+	entry_t *e;
+	size_t i;
+
+	s->max = max;
+	for (i = 0; i < n; i++) {
+		if ((e = lookup(s, reqs[i].uri)) != NULL) {
+			s->hits++;
+			e->visited = 1;
+			continue;
+		}
+		if (!reqs[i].cacheable || reqs[i].size > MAX_OBJECT_SIZE ||
+			reqs[i].size > max)
+			continue;
+		if (filter && !admit_check(reqs[i].uri))
+			continue;
+		store(s, reqs[i].uri, reqs[i].size);
+	}
+	printf("%-8s requests=%lu hit_ratio=%.4f stores=%lu stored_bytes=%llu "
+		"evictions=%lu\n", name, (unsigned long)n,
+		n ? (double)s->hits / n : 0, s->stores, s->copied, s->evictions);
+	while (s->tail)
+		evict(s);
+	Free(s);
+}
+
+/*
+ * Fill r from one log line; 0 if it has no URI
+ */
+static int parse(char *line, size_t dflt, req_t *r)
+{
+	char uri[MAXLINE], *q;
+	long status = 200, size = -1;
+
+	if ((q = strchr(line, '"')) != NULL) {
+		if (sscanf(q + 1, "%*s %8191s", uri) != 1)
+			return 0;
+		if ((q = strchr(q + 1, '"')) != NULL)
+			sscanf(q + 1, "%ld %ld", &status, &size);
+	}
+	else if (sscanf(line, "%8191s %ld", uri, &size) < 1)
+		return 0;
+	r->uri = strdup(uri);
+	r->size = size > 0 ? (size_t)size : dflt;
+	r->cacheable = status == 200;
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	char line[MAXLINE];
+	req_t *reqs = NULL;
+	size_t n = 0, cap = 0, max = MAX_CACHE_SIZE, dflt = 4096;
+	int c;
+
+	while ((c = getopt(argc, argv, "m:s:")) != -1) {
+		switch (c) {
+		case 'm': max = atol(optarg); break;
+		case 's': dflt = atol(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-m cachebytes] [-s defaultsize] < log\n",
+				argv[0]);
+			exit(1);
+		}
+	}
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		if (n == cap) {
+			cap = cap ? cap * 2 : 4096;
+			reqs = (req_t *)Realloc(reqs, cap * sizeof(*reqs));
+		}
+		if (parse(line, dflt, &reqs[n]))
+			n++;
+	}
+
+	run("all", reqs, n, max, 0);
+	admit_init(1);
+	run("admit", reqs, n, max, 1);
+	printf("filter_bytes=%lu window=%d bits_per_uri=%d\n",
+		(unsigned long)admit_footprint(), ADMIT_WINDOW, ADMIT_BITS);
+	return 0;
+}
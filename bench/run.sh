@@ -0,0 +1,81 @@
+#!/bin/sh
+#
+# run.sh - start an origin and a proxy, then run every benchmark scenario
+#
+# Environment: BENCH_SECS (per scenario, default 5), PROXY_PORT,
+# ORIGIN_PORT, PROXY_ARGS (extra proxy options).
+#
+cd "$(dirname "$0")/.."
+
+SECS=${BENCH_SECS:-5}
+PPORT=${PROXY_PORT:-18213}
+OPORT=${ORIGIN_PORT:-18000}
+
+./bench/origin $OPORT &
+ORIGIN=$!
+./proxy $PROXY_ARGS $PPORT &
+PROXY=$!
+trap 'kill $ORIGIN $PROXY 2>/dev/null' EXIT INT TERM
+sleep 1
+
+LG="./bench/loadgen -p $PPORT -o $OPORT -d $SECS -P $PROXY"
+
+scenario() {
+	name=$1
+	shift
+	printf '%-16s ' "$name"
+	$LG "$@"
+}
+
+scenario hit-heavy    -c 8   -m hit  -n 32   -s 1024
+scenario miss-heavy   -c 8   -m miss         -s 1024
+scenario large-object -c 4   -m hit  -n 4    -s 1048576
+scenario many-conns   -c 256 -m hit  -n 32   -s 1024
+scenario zipf         -c 8   -m zipf -n 10000 -s 4096 -z 0.99
+scenario page-load    -c 4   -m page -l 8    -s 8192 -q '&delay=20'
+scenario open-loop    -c 32  -m zipf -n 10000 -s 4096 -r 2000
+
+# One abusive client (127.0.0.2) flooding slow misses while a polite one
+# (127.0.0.3) measures its latency; add -r/-b to PROXY_ARGS to limit it
+./bench/loadgen -p $PPORT -o $OPORT -d $SECS -B 127.0.0.2 -c 192 -m miss \
+	-q '&delay=50' >/dev/null &
+NOISY=$!
+scenario noisy-neighbor -B 127.0.0.3 -c 8 -m miss -s 1024 -r 100
+wait $NOISY
+
+# The same proxy on the io_uring engine (-U), for read/write syscalls and
+# CPU/Gbit
+kill $PROXY 2>/dev/null
+wait $PROXY 2>/dev/null
+./proxy -U $PROXY_ARGS $PPORT &
+PROXY=$!
+sleep 1
+LG="./bench/loadgen -p $PPORT -o $OPORT -d $SECS -P $PROXY"
+scenario uring-hit    -c 8   -m hit  -n 32   -s 1024
+scenario uring-miss   -c 8   -m miss         -s 1024
+scenario uring-conns  -c 256 -m hit  -n 32   -s 1024
+
+# Coroutine mode (-C): same scenarios with thousands of open connections
+kill $PROXY 2>/dev/null
+wait $PROXY 2>/dev/null
+ulimit -n 16384 2>/dev/null
+./proxy -C $PROXY_ARGS $PPORT &
+PROXY=$!
+sleep 1
+LG="./bench/loadgen -p $PPORT -o $OPORT -d $SECS -P $PROXY"
+scenario co-hit       -c 8    -m hit  -n 32   -s 1024
+scenario co-miss      -c 64   -m miss -s 1024 -q '&delay=50'
+scenario co-conns     -c 2048 -m hit  -n 32   -s 1024
+
+# Skewed origin latency: one miss in ten waits 100 ms at the origin, so
+# schedulers drift out of balance and idle ones steal queued fetches
+scenario co-skew      -c 128  -m miss -s 16384 -k '10:&delay=100'
+
+# First-visitor page loads with subresource prefetching (-p)
+kill $PROXY 2>/dev/null
+wait $PROXY 2>/dev/null
+./proxy -p 4 $PROXY_ARGS $PPORT &
+PROXY=$!
+sleep 1
+LG="./bench/loadgen -p $PPORT -o $OPORT -d $SECS -P $PROXY"
+scenario prefetch-page -c 4  -m page -l 8    -s 8192 -q '&delay=20'
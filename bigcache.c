@@ -0,0 +1,453 @@
+/*
+ * bigcache.c - chunked store for large objects, filled while they are
+ * 		being served
+ *
+ * Objects over MAX_OBJECT_SIZE never go into the main cache. When a
+ * miss turns out to be one, the miss path opens an entry here with
+ * bigcache_begin and appends the response as it streams it to its own
+ * client. The entry is in the table from the start, so a request for
+ * the same key arriving meanwhile finds it, is sent each chunk as soon
+ * as it is filled and waits (parked, under -C) at the fill's edge,
+ * instead of going to the origin too. Later requests read it whole,
+ * or just the slice a Range asks for.
+ *
+ * Chunks are allocated one at a time against a single byte budget,
+ * which also covers fills in progress and entries that were unlinked
+ * but are still being sent. To make room a fill evicts the least
+ * recently used complete entries; if that is not enough, or the
+ * response does not end exactly at its Content-Length, the fill is
+ * aborted: the entry leaves the table, its readers stop where the
+ * fill stopped, and its chunks are freed when the last one lets go.
+ *
+ * One mutex guards the table, the LRU list and each entry's state and
+ * fill level. Bytes are copied in and out without it: the filler only
+ * writes past the fill level, and readers only read below it.
+ */
+#define _GNU_SOURCE
+#include "bigcache.h"
+#include "metrics.h"
+#include "range.h"
+#include "co.h"
+
+enum { FILLING, DONE, ABORTED };
+
+typedef struct waiter_t waiter_t;
+struct waiter_t {
+	co_task_t *task;
+	waiter_t *next;
+};
+
+struct bigcache_t {
+	char *key;
+	uint32_t hash;
+	int state;
+	int refs;               /* the table's, the fill's and each reader's */
+	int linked;             /* in the table, and in the LRU list once DONE */
+	size_t expected;        /* full response size, headers included */
+	time_t expires;         /* 0 = fresh forever, else a miss after this */
+	size_t size;            /* bytes filled so far */
+	unsigned char **chunks;
+	size_t nchunks;
+	waiter_t *waiters;      /* parked coroutines */
+	bigcache_t *hnext, *next, *prev;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t filled = PTHREAD_COND_INITIALIZER;
+static int thread_waiters;
+static bigcache_t *buckets[BIGCACHE_BUCKETS];
+static bigcache_t *lru_head, *lru_tail;
+static size_t used, max_size;
+static int enabled;
+
+static uint32_t hash_key(char *key)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *key; key++)
+		h = (h ^ (unsigned char)*key) * 16777619u;
+	return h;
+}
+
+/*
+ * Drop a reference, freeing the entry with the last one; caller holds
+ * lock
+ */
+static void entry_put(bigcache_t *b)
+{
+	size_t i;
+
+	if (--b->refs > 0)
+		return;
+	for (i = 0; i < b->nchunks; i++)
+		Free(b->chunks[i]);
+	used -= b->nchunks * BIGCACHE_CHUNK;
+	Free(b->chunks);
+	Free(b->key);
+	Free(b);
+}
+
+static void lru_remove(bigcache_t *b)
+{
+	if (b->prev)
+		b->prev->next = b->next;
+	else
+		lru_head = b->next;
+	if (b->next)
+		b->next->prev = b->prev;
+	else
+		lru_tail = b->prev;
+}
+
+static void lru_push(bigcache_t *b)
+{
+	b->prev = NULL;
+	b->next = lru_head;
+	if (lru_head)
+		lru_head->prev = b;
+	else
+		lru_tail = b;
+	lru_head = b;
+}
+
+/*
+ * Take an entry out of the table; caller holds lock
+ */
+static void entry_unlink(bigcache_t *b)
+{
+	bigcache_t **pp = &buckets[b->hash % BIGCACHE_BUCKETS];
+
+	while (*pp != b)
+		pp = &(*pp)->hnext;
+	*pp = b->hnext;
+	if (b->state == DONE)
+		lru_remove(b);
+	b->linked = 0;
+	entry_put(b);
+}
+
+/*
+ * Let every reader waiting on b look again; caller holds lock
+ */
+static void wake(bigcache_t *b)
+{
+	waiter_t *w;
+
+	if (thread_waiters)
+		pthread_cond_broadcast(&filled);
+	for (w = b->waiters; w; w = w->next)
+		co_wake(w->task);
+	b->waiters = NULL;
+}
+
+/*
+ * Wait for b to be filled further or finished; caller holds lock
+ */
+static void fill_wait(bigcache_t *b)
+{
+	waiter_t w;
+
+	/* A coroutine must not block its scheduler thread on the cond */
+	if ((w.task = co_self()) == NULL) {
+		thread_waiters++;
+		pthread_cond_wait(&filled, &lock);
+		thread_waiters--;
+		return;
+	}
+	w.next = b->waiters;
+	b->waiters = &w;
+	pthread_mutex_unlock(&lock);
+	co_park();
+	pthread_mutex_lock(&lock);
+}
+
+static void fill_abort(bigcache_t *b)
+{
+	b->state = ABORTED;
+	if (b->linked)
+		entry_unlink(b);
+	wake(b);
+	metrics_inc(M_LARGE_ABORTS);
+}
+
+/*
+ * Add a chunk to a fill, evicting for room; 0 if the budget is spent.
+ * Caller holds lock.
+ */
+static int grow(bigcache_t *b)
+{
+	while (used + BIGCACHE_CHUNK > max_size && lru_tail != NULL)
+		entry_unlink(lru_tail);
+	if (used + BIGCACHE_CHUNK > max_size)
+		return 0;
+	used += BIGCACHE_CHUNK;
+	b->chunks[b->nchunks++] = (unsigned char *)Malloc(BIGCACHE_CHUNK);
+	return 1;
+}
+
+/*
+ * bigcache_configure - set the byte budget, evicting down to it; 0
+ * 		turns the store off
+ */
+void bigcache_configure(size_t max)
+{
+	pthread_mutex_lock(&lock);
+	max_size = max;
+	while (used > max_size && lru_tail != NULL)
+		entry_unlink(lru_tail);
+	__atomic_store_n(&enabled, max > 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&lock);
+}
+
+int bigcache_enabled()
+{
+	return __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+}
+
+/*
+ * bigcache_used - bytes of chunks allocated, never over the budget
+ */
+size_t bigcache_used()
+{
+	size_t n;
+
+	pthread_mutex_lock(&lock);
+	n = used;
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+/*
+ * bigcache_begin - start filling an entry for key with a response of
+ * 		size bytes that is fresh until expires (as cache_store
+ * 		takes it); NULL if the store is off, the object would take
+ * 		over half of it, or key is already being filled
+ */
+bigcache_t *bigcache_begin(char *key, size_t size, time_t expires)
+{
+	uint32_t h = hash_key(key);
+	bigcache_t *b, *old;
+
+	if (!bigcache_enabled() || size > max_size / 2)
+		return NULL;
+	pthread_mutex_lock(&lock);
+	for (old = buckets[h % BIGCACHE_BUCKETS]; old; old = old->hnext) {
+		if (old->hash == h && !strcmp(old->key, key)) {
+			if (old->state == FILLING) {
+				pthread_mutex_unlock(&lock);
+				return NULL;
+			}
+			entry_unlink(old);
+			break;
+		}
+	}
+	b = (bigcache_t *)Calloc(1, sizeof(*b));
+	b->key = strdup(key);
+	b->hash = h;
+	b->state = FILLING;
+	b->refs = 2;
+	b->linked = 1;
+	b->expected = size;
+	b->expires = expires;
+	b->chunks = (unsigned char **)Calloc(size / BIGCACHE_CHUNK + 1,
+		sizeof(*b->chunks));
+	b->hnext = buckets[h % BIGCACHE_BUCKETS];
+	buckets[h % BIGCACHE_BUCKETS] = b;
+	pthread_mutex_unlock(&lock);
+	return b;
+}
+
+/*
+ * bigcache_append - add the next n bytes of the response; -1 if the
+ * 		fill was aborted (over budget or over size), after which
+ * 		only bigcache_finish may be called
+ */
+int bigcache_append(bigcache_t *b, void *data, size_t n)
+{
+	unsigned char *p = (unsigned char *)data;
+	size_t at, len;
+
+	while (n > 0) {
+		pthread_mutex_lock(&lock);
+		if (b->state != FILLING || b->size + n > b->expected ||
+			(b->size == b->nchunks * BIGCACHE_CHUNK && !grow(b))) {
+			if (b->state == FILLING)
+				fill_abort(b);
+			pthread_mutex_unlock(&lock);
+			return -1;
+		}
+		pthread_mutex_unlock(&lock);
+
+		at = b->size % BIGCACHE_CHUNK;
+		len = n < BIGCACHE_CHUNK - at ? n : BIGCACHE_CHUNK - at;
+		memcpy(b->chunks[b->size / BIGCACHE_CHUNK] + at, p, len);
+
+		pthread_mutex_lock(&lock);
+		b->size += len;
+		wake(b);
+		pthread_mutex_unlock(&lock);
+		p += len;
+		n -= len;
+	}
+	return 0;
+}
+
+/*
+ * bigcache_finish - end a fill: the entry is complete if it got all
+ * 		the bytes promised to bigcache_begin, aborted otherwise
+ */
+void bigcache_finish(bigcache_t *b)
+{
+	pthread_mutex_lock(&lock);
+	if (b->state == FILLING && b->size == b->expected) {
+		b->state = DONE;
+		if (b->linked)
+			lru_push(b);
+		wake(b);
+		metrics_inc(M_LARGE_FILLS);
+	}
+	else if (b->state == FILLING) {
+		fill_abort(b);
+	}
+	entry_put(b);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * bigcache_find - entry for key, complete or still filling, or NULL if
+ * 		there is none or it has expired. Pass a non-NULL result to
+ * 		bigcache_release.
+ */
+bigcache_t *bigcache_find(char *key)
+{
+	uint32_t h;
+	bigcache_t *b;
+
+	if (!bigcache_enabled())
+		return NULL;
+	h = hash_key(key);
+	pthread_mutex_lock(&lock);
+	for (b = buckets[h % BIGCACHE_BUCKETS]; b; b = b->hnext)
+		if (b->hash == h && !strcmp(b->key, key))
+			break;
+	/* Stale: the next fill for key replaces it */
+	if (b != NULL && b->expires && b->expires <= time(NULL))
+		b = NULL;
+	if (b != NULL) {
+		b->refs++;
+		if (b->state == DONE) {
+			lru_remove(b);
+			lru_push(b);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return b;
+}
+
+/*
+ * Write bytes off..end of the response to fd as they are filled; the
+ * bytes sent, or -1 if the fill was aborted short of end or the client
+ * went away part way
+ */
+static ssize_t send_span(bigcache_t *b, int fd, size_t off, size_t end)
+{
+	unsigned char *chunk;
+	size_t start = off, len;
+
+	pthread_mutex_lock(&lock);
+	while (off < end) {
+		while (off >= b->size && b->state == FILLING)
+			fill_wait(b);
+		if (off >= b->size)
+			break;
+		chunk = b->chunks[off / BIGCACHE_CHUNK];
+		len = (off / BIGCACHE_CHUNK + 1) * BIGCACHE_CHUNK;
+		len = len < b->size ? len : b->size;
+		len = (len < end ? len : end) - off;
+		pthread_mutex_unlock(&lock);
+		if (rio_writen(fd, chunk + off % BIGCACHE_CHUNK, len) < 0)
+			return -1;
+		off += len;
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+	return off == end ? (ssize_t)(off - start) : -1;
+}
+
+/*
+ * bigcache_send - write the whole response to fd, chunk by chunk as it
+ * 		is filled; returns the bytes sent, or -1 if the fill was
+ * 		aborted or the client went away part way
+ */
+ssize_t bigcache_send(bigcache_t *b, int fd)
+{
+	return send_span(b, fd, 0, b->expected);
+}
+
+/*
+ * bigcache_send_range - answer bytes first..last of the body as
+ * 		range_send does, following the fill; returns the bytes
+ * 		sent, 0 if the response cannot be sliced and should be sent
+ * 		whole, or -1 as bigcache_send does
+ */
+ssize_t bigcache_send_range(bigcache_t *b, int fd, long first, long last)
+{
+	unsigned char *end = NULL;
+	size_t hlen, n;
+	ssize_t len, sent;
+	int state;
+
+	/* The header block opens the first chunk; wait until it is there */
+	pthread_mutex_lock(&lock);
+	while (1) {
+		n = b->size < BIGCACHE_CHUNK ? b->size : BIGCACHE_CHUNK;
+		if (n > 0 && (end = memmem(b->chunks[0], n, "\r\n\r\n", 4)) != NULL)
+			break;
+		if (b->state != FILLING || n == BIGCACHE_CHUNK)
+			break;
+		fill_wait(b);
+	}
+	state = b->state;
+	pthread_mutex_unlock(&lock);
+	if (end == NULL)
+		return state == ABORTED ? -1 : 0;
+
+	hlen = end + 4 - b->chunks[0];
+	len = range_header(fd, b->chunks[0], hlen, b->expected - hlen,
+		&first, &last);
+	if (len <= 0 || first > last)
+		return len;
+	sent = send_span(b, fd, hlen + first, hlen + last + 1);
+	return sent < 0 ? -1 : len + sent;
+}
+
+/*
+ * bigcache_release - done with an entry from bigcache_find
+ */
+void bigcache_release(bigcache_t *b)
+{
+	pthread_mutex_lock(&lock);
+	entry_put(b);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * bigcache_remove - drop the entry for key, if any; readers already
+ * 		sending it finish first
+ */
+void bigcache_remove(char *key)
+{
+	uint32_t h;
+	bigcache_t *b;
+
+	if (!bigcache_enabled())
+		return;
+	h = hash_key(key);
+	pthread_mutex_lock(&lock);
+	for (b = buckets[h % BIGCACHE_BUCKETS]; b; b = b->hnext)
+		if (b->hash == h && !strcmp(b->key, key))
+			break;
+	if (b != NULL)
+		entry_unlink(b);
+	pthread_mutex_unlock(&lock);
+}
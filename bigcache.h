@@ -0,0 +1,24 @@
+#ifndef __BIGCACHE_H__
+#define __BIGCACHE_H__
+
+#include "csapp.h"
+
+/* Chunked store for objects over MAX_OBJECT_SIZE (-L) */
+#define BIGCACHE_CHUNK (256 << 10)  /* bytes per chunk */
+#define BIGCACHE_BUCKETS 1024
+
+typedef struct bigcache_t bigcache_t;
+
+void bigcache_configure(size_t max_size);
+int bigcache_enabled();
+size_t bigcache_used();
+bigcache_t *bigcache_begin(char *key, size_t size, time_t expires);
+int bigcache_append(bigcache_t *b, void *data, size_t n);
+void bigcache_finish(bigcache_t *b);
+bigcache_t *bigcache_find(char *key);
+ssize_t bigcache_send(bigcache_t *b, int fd);
+ssize_t bigcache_send_range(bigcache_t *b, int fd, long first, long last);
+void bigcache_release(bigcache_t *b);
+void bigcache_remove(char *key);
+
+#endif
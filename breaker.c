@@ -0,0 +1,181 @@
+/*
+ * breaker.c - per-origin health tracking and fast-fail
+ *
+ * Each origin (host:port) keeps success/failure counts in a ring of
+ * one-second buckets. Once enough attempts in the window fail the
+ * breaker opens and requests fail fast without touching the network.
+ * After BREAKER_OPEN_MS one request is let through as a probe
+ * (half-open): success closes the breaker, failure reopens it.
+ */
+#include "breaker.h"
+#include <time.h>
+
+#define BREAKER_KEYLEN 256
+#define BREAKER_LOCKS 64
+
+typedef struct {
+	char key[BREAKER_KEYLEN];   /* "host:port", empty if unused */
+	int state;
+	int probing;                /* half-open probe in flight */
+	long opened_ms;
+	long last_ms;               /* last activity, for slot reuse */
+	long bucket_sec[BREAKER_BUCKETS];
+	unsigned int ok[BREAKER_BUCKETS];
+	unsigned int fail[BREAKER_BUCKETS];
+} origin_t;
+
+static origin_t origins[BREAKER_SLOTS];
+static pthread_mutex_t locks[BREAKER_LOCKS];
+
+static long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Initialize the striped locks
+ */
+void breaker_init()
+{
+	int i;
+
+	for (i = 0; i < BREAKER_LOCKS; i++)
+		pthread_mutex_init(&locks[i], NULL);
+}
+
+static unsigned int hash(char *s)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)tolower(*s)) * 16777619u;
+	return h;
+}
+
+/*
+ * Find or claim the slot for key; called with its stripe held.
+ * Probing stays inside one stripe so one lock covers the whole search.
+ */
+static origin_t *lookup(char *key, unsigned int h)
+{
+	unsigned int base = h % BREAKER_SLOTS, i, idx;
+	origin_t *o, *victim = NULL;
+
+	base -= base % BREAKER_PROBE;
+	for (i = 0; i < BREAKER_PROBE; i++) {
+		idx = base + (h + i) % BREAKER_PROBE;
+		o = &origins[idx];
+		if (!strcasecmp(o->key, key))
+			return o;
+		if (victim == NULL || o->key[0] == '\0' ||
+			(victim->key[0] != '\0' && o->last_ms < victim->last_ms))
+			victim = o;
+	}
+	/* Reuse an empty or the least recently used slot */
+	memset(victim, 0, sizeof(*victim));
+	strncpy(victim->key, key, BREAKER_KEYLEN - 1);
+	return victim;
+}
+
+static pthread_mutex_t *stripe(unsigned int h)
+{
+	return &locks[(h % BREAKER_SLOTS) / BREAKER_PROBE % BREAKER_LOCKS];
+}
+
+/*
+ * Bucket for the current second, cleared if it holds an old second
+ */
+static int bucket(origin_t *o, long sec)
+{
+	int b = sec % BREAKER_BUCKETS;
+
+	if (o->bucket_sec[b] != sec) {
+		o->bucket_sec[b] = sec;
+		o->ok[b] = o->fail[b] = 0;
+	}
+	return b;
+}
+
+/*
+ * breaker_allow - 1 if a request to the origin may proceed, 0 to fail fast
+ */
+int breaker_allow(char *hostname, char *port)
+{
+	char key[BREAKER_KEYLEN];
+	unsigned int h;
+	pthread_mutex_t *l;
+	origin_t *o;
+	long now = now_ms();
+	int allow = 1;
+
+	snprintf(key, sizeof(key), "%s:%s", hostname, port);
+	h = hash(key);
+	l = stripe(h);
+	pthread_mutex_lock(l);
+	o = lookup(key, h);
+	o->last_ms = now;
+	if (o->state == BREAKER_OPEN && now - o->opened_ms >= BREAKER_OPEN_MS)
+		o->state = BREAKER_HALF_OPEN;
+	if (o->state == BREAKER_OPEN)
+		allow = 0;
+	else if (o->state == BREAKER_HALF_OPEN) {
+		/* Only one probe at a time */
+		allow = !o->probing;
+		o->probing = 1;
+	}
+	pthread_mutex_unlock(l);
+	return allow;
+}
+
+/*
+ * breaker_report - record the outcome of a request that was allowed
+ */
+void breaker_report(char *hostname, char *port, int ok)
+{
+	char key[BREAKER_KEYLEN];
+	unsigned int h, total = 0, failed = 0;
+	pthread_mutex_t *l;
+	origin_t *o;
+	long now = now_ms(), sec = now / 1000;
+	int b;
+
+	snprintf(key, sizeof(key), "%s:%s", hostname, port);
+	h = hash(key);
+	l = stripe(h);
+	pthread_mutex_lock(l);
+	o = lookup(key, h);
+	o->last_ms = now;
+	b = bucket(o, sec);
+	if (ok)
+		o->ok[b]++;
+	else
+		o->fail[b]++;
+
+	if (o->state == BREAKER_HALF_OPEN) {
+		o->probing = 0;
+		if (ok) {
+			o->state = BREAKER_CLOSED;
+			memset(o->bucket_sec, 0, sizeof(o->bucket_sec));
+		}
+		else {
+			o->state = BREAKER_OPEN;
+			o->opened_ms = now;
+		}
+	}
+	else if (o->state == BREAKER_CLOSED && !ok) {
+		for (b = 0; b < BREAKER_BUCKETS; b++) {
+			if (sec - o->bucket_sec[b] < BREAKER_BUCKETS) {
+				total += o->ok[b] + o->fail[b];
+				failed += o->fail[b];
+			}
+		}
+		if (total >= BREAKER_MIN_ATTEMPTS &&
+			failed * 100 >= total * BREAKER_FAILURE_PCT) {
+			o->state = BREAKER_OPEN;
+			o->opened_ms = now;
+		}
+	}
+	pthread_mutex_unlock(l);
+}
@@ -0,0 +1,20 @@
+#ifndef __BREAKER_H__
+#define __BREAKER_H__
+
+#include "csapp.h"
+
+/* Per-origin circuit breaker parameters */
+#define BREAKER_SLOTS 1024       /* origins tracked at once */
+#define BREAKER_PROBE 8          /* open-addressing probe length */
+#define BREAKER_BUCKETS 10       /* one-second buckets in the window */
+#define BREAKER_MIN_ATTEMPTS 5   /* attempts before the rate counts */
+#define BREAKER_FAILURE_PCT 50   /* failure rate that opens the breaker */
+#define BREAKER_OPEN_MS 5000     /* time open before a half-open probe */
+
+enum { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN };
+
+void breaker_init();
+int breaker_allow(char *hostname, char *port);
+void breaker_report(char *hostname, char *port, int ok);
+
+#endif
@@ -1,148 +1,679 @@
+#define _GNU_SOURCE
 #include "cache.h"
+#include "metrics.h"
+#include "shmcache.h"
+#include "bigcache.h"
 
-static cache_t *cache_head;
-static size_t cache_size;
-static sem_t mutex, w;
-static int readcnt;
+/*
+ * The cache is split into one partition per NUMA node. Workers store
+ * into and look up in their own node's partition first; a hit in
+ * another node's partition is served from there, and small objects
+ * that keep getting remote hits are copied into the local partition
+ * by the local worker, so their pages are allocated on its node.
+ * Without node-aware mode there is a single partition.
+ *
+ * Lookups take no locks. Writers publish entries into hash chains with
+ * release stores and unlink them the same way; an unlinked entry is
+ * only freed once every reader that could still see it has left its
+ * read section (epoch-based reclamation). A reader announces itself
+ * by writing the global epoch into its own cache-line sized slot, and
+ * marks entries it hits as visited only when the bit is clear, so a
+ * hit on a hot entry writes no shared cache line at all. Eviction is
+ * CLOCK: the writer walks the age list from the tail, giving visited
+ * entries a second chance.
+ *
+ * Other responses stay fresh for the lifetime they give themselves in
+ * Cache-Control (s-maxage, then max-age) or Expires, or until evicted
+ * if they give none. Once expired they are only served while their
+ * origin cannot be reached (serve_stale). 404/410 and 5xx
+ * responses are cached too, so repeated requests for a dead link or a
+ * failing origin are answered from memory, but only for a short TTL.
+ * Each TTL is cut by a random jitter so errors cached together do not
+ * all go back to the origin in the same second. Other 4xx responses
+ * depend on the client and are never cached.
+ *
+ * With cache_share the partitions are unused and every call goes to
+ * the shared-memory cache in shmcache.c instead.
+ */
+static cache_part_t parts[CACHE_MAX_NODES];
+static int nparts;
+static int shared;
+
+/* Error lifetimes, seconds, set by cache_configure_ttl */
+static double negative_ttl = CACHE_NEGATIVE_TTL;
+static double error_ttl = CACHE_ERROR_TTL;
+static double ttl_jitter = CACHE_TTL_JITTER;
+
+__thread int cache_node;
+
+/* Per-thread reader slot: 0 when outside a read section */
+typedef struct reader_t reader_t;
+struct reader_t {
+	uint64_t epoch;
+	int depth;
+	reader_t *next;         /* registry of every slot */
+	reader_t *free_next;
+} __attribute__((aligned(64)));
+
+static uint64_t global_epoch = 1;
+static reader_t *readers;
+static reader_t *free_readers;
+static pthread_mutex_t reader_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t reader_key;
+static __thread reader_t *reader_self;
+
+static cache_t *cache_lookup(char *uri, int stale);
+
+static void reader_release(void *arg)
+{
+	reader_t *r = (reader_t *)arg;
+
+	pthread_mutex_lock(&reader_lock);
+	r->free_next = free_readers;
+	free_readers = r;
+	pthread_mutex_unlock(&reader_lock);
+}
+
+static reader_t *reader_claim()
+{
+	reader_t *r;
+
+	pthread_mutex_lock(&reader_lock);
+	if ((r = free_readers) != NULL) {
+		free_readers = r->free_next;
+	}
+	else {
+		if (posix_memalign((void **)&r, 64, sizeof(*r)) != 0)
+			unix_error("posix_memalign error");
+		memset(r, 0, sizeof(*r));
+		r->next = readers;
+		__atomic_store_n(&readers, r, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&reader_lock);
+	pthread_setspecific(reader_key, r);
+	reader_self = r;
+	return r;
+}
 
 /*
- * Initialize cache
+ * Enter a read section; entries seen inside stay allocated until exit
  */
-void cache_init()
+static void read_enter()
 {
-	cache_head = NULL;
-	cache_size = 0;
-	readcnt = 0;
-	Sem_init(&mutex, 0, 1);
-	Sem_init(&w, 0, 1);
-	cache_mark_clear();
+	reader_t *r = reader_self ? reader_self : reader_claim();
+
+	if (r->depth++ == 0) {
+		/* Must be visible before any chain is read */
+		__atomic_store_n(&r->epoch,
+			__atomic_load_n(&global_epoch, __ATOMIC_RELAXED),
+			__ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+static void read_exit()
+{
+	reader_t *r = reader_self;
+
+	if (--r->depth == 0)
+		__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
 }
 
 /*
- * Store cache information in a pointer
- * Add the cache pointer to cache list
+ * Oldest epoch any reader is still in, or UINT64_MAX if none
  */
-void cache_store(size_t filesize, char *uri, unsigned char *response)
+static uint64_t oldest_reader()
 {
-	P(&w);
-	cache_t *ptr = (cache_t *)Calloc(1, sizeof(*ptr));
-	ptr->size = filesize;
-	strcpy(ptr->uri, uri);
-	ptr->content = (unsigned char*)Calloc(1, filesize);
-	size_t i;
-	for (i = 0; i < filesize; i++) {
-		ptr->content[i] = response[i];
+	uint64_t min = UINT64_MAX, e;
+	reader_t *r;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+		e = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+		if (e != 0 && e < min)
+			min = e;
 	}
-	cache_add(ptr);
-	V(&w);
+	return min;
 }
 
 /*
- * Add cache into a linked list
+ * cache_new - allocate an entry for uri (uri_len bytes) with a size
+ * 		byte body to fill in, or with its body at mapped if that
+ * 		is not NULL
  */
-void cache_add(cache_t *ptr)
+cache_t *cache_new(char *uri, size_t uri_len, size_t size,
+	unsigned char *mapped)
+{
+	int inlined = mapped == NULL && size <= CACHE_INLINE_MAX;
+	cache_t *ptr;
+
+	ptr = (cache_t *)Malloc(sizeof(*ptr) + uri_len + 1 + (inlined ? size : 0));
+	memset(ptr, 0, sizeof(*ptr));
+	ptr->uri = (char *)(ptr + 1);
+	memcpy(ptr->uri, uri, uri_len);
+	ptr->uri[uri_len] = '\0';
+	ptr->uri_len = uri_len;
+	ptr->size = size;
+	ptr->inlined = inlined;
+	ptr->mapped = mapped != NULL;
+	if (mapped)
+		ptr->content = mapped;
+	else if (inlined)
+		ptr->content = (unsigned char *)ptr->uri + uri_len + 1;
+	else
+		ptr->content = (unsigned char *)Malloc(size);
+	return ptr;
+}
+
+/*
+ * cache_free - free an entry no reader can reach
+ */
+void cache_free(cache_t *ptr)
+{
+	if (!ptr->mapped && !ptr->inlined)
+		Free(ptr->content);
+	Free(ptr);
+}
+
+/*
+ * Free retired entries no reader can reach any more; caller holds w
+ */
+static void reclaim(cache_part_t *part)
 {
-	/* Add item into cache if it can fit */
-	if (cache_size + ptr->size <= MAX_CACHE_SIZE) {
-		if (cache_head != NULL) {
-			ptr->next = cache_head;
+	uint64_t min = oldest_reader();
+	cache_t **pp = &part->retired, *ptr;
+
+	while ((ptr = *pp) != NULL) {
+		if (ptr->retired < min) {
+			*pp = ptr->next;
+			cache_free(ptr);
+		}
+		else {
+			pp = &ptr->next;
 		}
-		cache_head = ptr;
-		cache_size += ptr->size;
 	}
-	else {
-		/* Delete the last cache item */
-		cache_delete();
-		/* Continue to add this item */
-		cache_add(ptr);
+}
+
+static uint32_t hash_uri(char *uri)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *uri; uri++)
+		h = (h ^ (unsigned char)*uri) * 16777619u;
+	return h;
+}
+
+/*
+ * Initialize cache, splitting the size budget between nodes
+ */
+void cache_init(int nodes)
+{
+	int i, rc;
+
+	if ((rc = pthread_key_create(&reader_key, reader_release)) != 0)
+		posix_error(rc, "pthread_key_create error");
+	nparts = nodes < 1 ? 1 : nodes > CACHE_MAX_NODES ? CACHE_MAX_NODES : nodes;
+	for (i = 0; i < nparts; i++) {
+		memset(&parts[i], 0, sizeof(parts[i]));
+		parts[i].max_size = MAX_CACHE_SIZE / nparts;
+		Sem_init(&parts[i].w, 0, 1);
 	}
 }
 
 /*
- * Delete a cache item in the list
+ * cache_share - keep the cache in the shared-memory segment name
+ * 		(created with a size byte ring if missing) from now on;
+ * 		0 on success, -1 on error. Call once, after cache_init.
+ */
+int cache_share(char *name, size_t size)
+{
+	if (shmcache_open(name, size) < 0)
+		return -1;
+	shared = 1;
+	return 0;
+}
+
+/*
+ * Is the cache in shared memory?
+ */
+int cache_shared()
+{
+	return shared;
+}
+
+/*
+ * Lookups made on the shared cache by all processes; 0 if not shared
+ */
+int cache_shared_stats(uint64_t *hits, uint64_t *misses)
+{
+	if (!shared)
+		return 0;
+	shmcache_stats(hits, misses);
+	return 1;
+}
+
+static cache_part_t *local_part()
+{
+	return &parts[cache_node < nparts ? cache_node : 0];
+}
+
+/*
+ * Unlink an entry from its chain and the age list, then retire it;
+ * caller holds w
  */
-void cache_delete()
+static void part_unlink(cache_part_t *part, cache_t *ptr)
 {
-	cache_t *ptr = cache_head;
-	cache_t *prev = NULL;
-	while (ptr != NULL && ptr->next != NULL) {
-		prev = ptr;
-		ptr = ptr->next;
+	cache_t **pp = &part->buckets[ptr->hash % CACHE_BUCKETS];
+
+	while (*pp != ptr)
+		pp = &(*pp)->hnext;
+	__atomic_store_n(pp, ptr->hnext, __ATOMIC_RELEASE);
+
+	if (ptr->prev)
+		ptr->prev->next = ptr->next;
+	else
+		part->head = ptr->next;
+	if (ptr->next)
+		ptr->next->prev = ptr->prev;
+	else
+		part->tail = ptr->prev;
+	part->size -= ptr->size;
+	part->count--;
+
+	/* Readers that entered before the bump may still hold ptr */
+	ptr->retired = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+	ptr->next = part->retired;
+	part->retired = ptr;
+}
+
+/*
+ * Publish an entry, replacing any older one under the same uri;
+ * caller holds w
+ */
+static void part_add(cache_part_t *part, cache_t *ptr)
+{
+	cache_t **bucket, *old;
+
+	ptr->hash = hash_uri(ptr->uri);
+	bucket = &part->buckets[ptr->hash % CACHE_BUCKETS];
+	for (old = *bucket; old; old = old->hnext) {
+		if (old->hash == ptr->hash && old->uri_len == ptr->uri_len &&
+			!memcmp(old->uri, ptr->uri, ptr->uri_len)) {
+			part_unlink(part, old);
+			break;
+		}
 	}
-	if (prev != NULL) {
-		prev->next = NULL;
+	/* Make room */
+	while (part->size + ptr->size > part->max_size && part->tail != NULL)
+		cache_delete(part);
+
+	ptr->visited = 0;
+	ptr->prev = NULL;
+	ptr->next = part->head;
+	if (part->head)
+		part->head->prev = ptr;
+	else
+		part->tail = ptr;
+	part->head = ptr;
+	part->size += ptr->size;
+	part->count++;
+
+	ptr->hnext = *bucket;
+	__atomic_store_n(bucket, ptr, __ATOMIC_RELEASE);
+	reclaim(part);
+}
+
+/*
+ * Store cache information in a pointer
+ * Add the cache pointer to the local partition
+ */
+void cache_store(size_t filesize, char *uri, unsigned char *response,
+	time_t expires)
+{
+	cache_part_t *part = local_part();
+	cache_t *ptr;
+
+	if (shared) {
+		shmcache_store(filesize, uri, response, expires);
+		return;
 	}
-	else {
-		cache_head = NULL;
+	ptr = cache_new(uri, strlen(uri), filesize, NULL);
+	ptr->expires = expires;
+	memcpy(ptr->content, response, filesize);
+	P(&part->w);
+	part_add(part, ptr);
+	V(&part->w);
+}
+
+/*
+ * Add a prepared item to the local partition
+ */
+void cache_add(cache_t *ptr)
+{
+	cache_part_t *part = local_part();
+
+	if (shared) {
+		/* The segment keeps its own copy */
+		shmcache_store(ptr->size, ptr->uri, ptr->content, ptr->expires);
+		cache_free(ptr);
+		return;
 	}
-	cache_size -= ptr->size;
-	Free(ptr);
+	P(&part->w);
+	part_add(part, ptr);
+	V(&part->w);
 }
 
 /*
- * Find if the item is in the cache
+ * Evict one item with the CLOCK policy; caller holds w
  */
-cache_t *cache_find(char *uri)
+void cache_delete(cache_part_t *part)
 {
-	P(&mutex);
-	readcnt++;
-	if (readcnt == 1)
-		P(&w);
-	V(&mutex);
-	cache_t *ptr = cache_head;
-	cache_t *result = NULL;
-	/* Linearly look through the list */
-	while (ptr != NULL) {
-		/* When item is found */
-		if (!strcmp(uri, ptr->uri)) {
-			result = ptr;
-			ptr->visited = 1;
+	cache_t *ptr;
+	size_t passes = 0, limit = part->count;
+
+	/* Recently visited tail entries go back to the head, once each */
+	while ((ptr = part->tail) != NULL && passes++ < limit &&
+		__atomic_load_n(&ptr->visited, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&ptr->visited, 0, __ATOMIC_RELAXED);
+		if (ptr->prev == NULL)
 			break;
-		}
-		ptr = ptr->next;
+		part->tail = ptr->prev;
+		part->tail->next = NULL;
+		ptr->prev = NULL;
+		ptr->next = part->head;
+		part->head->prev = ptr;
+		part->head = ptr;
 	}
-	P(&mutex);
-	readcnt--;
-	if (readcnt == 0) {
-		/* Only update cache sequence before last write lock */
-		cache_update();
-		V(&w);
+	if (part->tail)
+		part_unlink(part, part->tail);
+}
+
+/*
+ * Change the total size budget, evicting down to it at once
+ */
+void cache_resize(size_t max_size)
+{
+	int i;
+
+	/* The segment size is fixed when it is created */
+	if (shared)
+		return;
+	for (i = 0; i < nparts; i++) {
+		cache_part_t *part = &parts[i];
+		P(&part->w);
+		part->max_size = max_size / nparts;
+		while (part->size > part->max_size && part->tail != NULL)
+			cache_delete(part);
+		reclaim(part);
+		V(&part->w);
 	}
-	V(&mutex);
-	return result;
 }
 
-/* 
- * Update cache sequence based on recently used policy
+/*
+ * cache_configure_ttl - set how long 404/410 and 5xx responses stay
+ * 		fresh (0 stops caching them) and the jitter fraction
+ */
+void cache_configure_ttl(double negative, double error, double jitter)
+{
+	negative_ttl = negative;
+	error_ttl = error;
+	ttl_jitter = jitter;
+}
+
+/*
+ * Value of header name in the header block of response, copied to out
+ * without its line end; NULL if there is none
+ */
+static char *response_header(unsigned char *response, size_t size,
+	char *name, char *out, size_t outlen)
+{
+	char *p = (char *)response, *end, *eol;
+	size_t len = strlen(name), n;
+
+	end = memmem(p, size, "\r\n\r\n", 4);
+	if (end == NULL)
+		return NULL;
+	for (; p < end; p = eol + 2) {
+		if ((eol = memmem(p, end + 2 - p, "\r\n", 2)) == NULL)
+			break;
+		if (eol - p <= len || p[len] != ':' || strncasecmp(p, name, len))
+			continue;
+		for (p += len + 1; *p == ' '; p++)
+			;
+		n = eol - p < outlen - 1 ? eol - p : outlen - 1;
+		memcpy(out, p, n);
+		out[n] = '\0';
+		return out;
+	}
+	return NULL;
+}
+
+/*
+ * Parse an HTTP date; -1 if it is not one
+ */
+static time_t http_date(char *value)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+		return -1;
+	return timegm(&tm);
+}
+
+/*
+ * Freshness lifetime a response gives itself, in seconds: s-maxage or
+ * max-age from Cache-Control, else Expires less Date; -1 if none
+ */
+static long response_lifetime(unsigned char *response, size_t size)
+{
+	char value[MAXLINE], *p;
+	time_t expires, date;
+
+	if (response_header(response, size, "Cache-Control", value,
+		sizeof(value)) != NULL) {
+		if ((p = strcasestr(value, "s-maxage=")) != NULL)
+			return atol(p + 9);
+		if ((p = strcasestr(value, "max-age=")) != NULL)
+			return atol(p + 8);
+	}
+	if (response_header(response, size, "Expires", value,
+		sizeof(value)) == NULL)
+		return -1;
+	/* An invalid date, such as 0, means already expired */
+	if ((expires = http_date(value)) < 0)
+		return 0;
+	if (response_header(response, size, "Date", value, sizeof(value)) == NULL ||
+		(date = http_date(value)) < 0)
+		date = time(NULL);
+	return expires > date ? expires - date : 0;
+}
+
+/*
+ * cache_expiry - expiry time for a response with this status, 0 to keep
+ * 		it fresh forever, or -1 if it must not be cached
+ */
+time_t cache_expiry(int status, unsigned char *response, size_t size)
+{
+	static __thread unsigned int seed;
+	double ttl;
+	long lifetime;
+
+	if (status == 404 || status == 410)
+		ttl = negative_ttl;
+	else if (status >= 500 && status <= 599)
+		ttl = error_ttl;
+	else if (status >= 400 && status <= 499)
+		return -1;
+	else if ((lifetime = response_lifetime(response, size)) < 0)
+		return 0;
+	else
+		return time(NULL) + lifetime;
+	if (ttl <= 0)
+		return -1;
+	if (seed == 0)
+		seed = (unsigned int)metrics_now() | 1;
+	ttl -= ttl * ttl_jitter * rand_r(&seed) / RAND_MAX;
+	return time(NULL) + (ttl < 1 ? 1 : (time_t)ttl);
+}
+
+/*
+ * Drop every item stored under uri, in every partition and in the
+ * large-object store
  */
-void cache_update()
+void cache_remove(char *uri)
 {
-	cache_t *curr = cache_head;
-	cache_t *prev = NULL;
-	while (curr != NULL) {
-		if (curr->visited == 1 && prev != NULL) {
-			prev->next = curr->next;
-			curr->next = cache_head;
-			cache_head = curr;
-			curr = prev->next;
+	uint32_t h = hash_uri(uri), len = strlen(uri);
+	cache_t *ptr, *next;
+	int i;
 
+	bigcache_remove(uri);
+	if (shared) {
+		shmcache_remove(uri);
+		return;
+	}
+	for (i = 0; i < nparts; i++) {
+		cache_part_t *part = &parts[i];
+		P(&part->w);
+		for (ptr = part->buckets[h % CACHE_BUCKETS]; ptr; ptr = next) {
+			next = ptr->hnext;
+			if (ptr->hash == h && ptr->uri_len == len &&
+				!memcmp(uri, ptr->uri, len))
+				part_unlink(part, ptr);
 		}
-		else {
-			prev = curr;
-			curr = curr->next;
+		reclaim(part);
+		V(&part->w);
+	}
+}
+
+/*
+ * Find if a fresh item is in the cache. A non-NULL result stays valid
+ * until the caller passes it to cache_release, which should come before
+ * anything that can block: until then nothing unlinked since the lookup
+ * can be freed.
+ */
+cache_t *cache_find(char *uri)
+{
+	return cache_lookup(uri, 0);
+}
+
+/*
+ * Find the item even if it has expired, for serving while the origin
+ * is unavailable. Release the result with cache_release.
+ */
+cache_t *cache_find_stale(char *uri)
+{
+	return cache_lookup(uri, 1);
+}
+
+/*
+ * Done with an item returned by cache_find or cache_find_stale
+ */
+void cache_release(cache_t *ptr)
+{
+	if (shared)
+		shmcache_release(ptr);
+	else
+		read_exit();
+}
+
+/*
+ * Search one partition's chain; caller is inside a read section
+ */
+static cache_t *part_lookup(cache_part_t *part, char *uri, uint32_t h,
+	uint32_t len, int stale)
+{
+	cache_t *ptr;
+	time_t now;
+
+	ptr = __atomic_load_n(&part->buckets[h % CACHE_BUCKETS], __ATOMIC_ACQUIRE);
+	for (; ptr; ptr = __atomic_load_n(&ptr->hnext, __ATOMIC_ACQUIRE)) {
+		if (ptr->hash != h || ptr->uri_len != len ||
+			memcmp(uri, ptr->uri, len))
+			continue;
+		if (!stale && ptr->expires) {
+			now = time(NULL);
+			if (ptr->expires <= now)
+				return NULL;
 		}
+		/* Sampled access bit: only write when it is clear */
+		if (!__atomic_load_n(&ptr->visited, __ATOMIC_RELAXED))
+			__atomic_store_n(&ptr->visited, 1, __ATOMIC_RELAXED);
+		return ptr;
 	}
-	cache_mark_clear();
+	return NULL;
+}
+
+/*
+ * Copy a remotely cached item for the local partition
+ */
+static cache_t *replicate(cache_t *ptr)
+{
+	cache_t *copy = cache_new(ptr->uri, ptr->uri_len, ptr->size, NULL);
+
+	copy->expires = ptr->expires;
+	memcpy(copy->content, ptr->content, ptr->size);
+	return copy;
 }
 
 /*
- * Initialize cache visit status
+ * Look up uri, local partition first, skipping expired items unless
+ * stale ones are acceptable. Leaves the read section open on a hit.
  */
-void cache_mark_clear()
+static cache_t *cache_lookup(char *uri, int stale)
 {
-	cache_t *ptr = cache_head;
-	while (ptr != NULL) {
-		ptr->visited = 0;
-		ptr = ptr->next;
+	cache_part_t *local = local_part();
+	cache_t *result, *replica = NULL;
+	uint32_t h = hash_uri(uri), len;
+	int i;
+
+	if (shared)
+		return shmcache_find(uri, stale);
+	len = strlen(uri);
+	read_enter();
+	if ((result = part_lookup(local, uri, h, len, stale)) != NULL || nparts == 1) {
+		if (result == NULL)
+			read_exit();
+		return result;
+	}
+	for (i = 0; i < nparts && result == NULL; i++) {
+		if (&parts[i] != local)
+			result = part_lookup(&parts[i], uri, h, len, stale);
+	}
+	if (result == NULL) {
+		read_exit();
+		return NULL;
+	}
+	metrics_inc(M_CACHE_REMOTE_HITS);
+	if (result->size <= CACHE_REPLICA_MAX &&
+		__atomic_add_fetch(&result->hits, 1, __ATOMIC_RELAXED) ==
+			CACHE_REPLICA_HITS) {
+		replica = replicate(result);
+		metrics_inc(M_CACHE_REPLICATIONS);
+		P(&local->w);
+		part_add(local, replica);
+		V(&local->w);
 	}
-}
\ No newline at end of file
+	return result;
+}
+
+/*
+ * Call fn on every item, most recently used first
+ */
+void cache_walk(void (*fn)(cache_t *, void *), void *arg)
+{
+	cache_t *ptr;
+	int i;
+
+	if (shared) {
+		shmcache_walk(fn, arg);
+		return;
+	}
+	for (i = 0; i < nparts; i++) {
+		P(&parts[i].w);
+		for (ptr = parts[i].head; ptr != NULL; ptr = ptr->next) {
+			fn(ptr, arg);
+		}
+		V(&parts[i].w);
+	}
+}
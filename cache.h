@@ -1,27 +1,87 @@
 #ifndef __CACHE_H__
 #define __CACHE_H__
 
+#include <stdint.h>
+#include <time.h>
 #include "csapp.h"
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* Partitions, one per NUMA node when node-aware mode is on */
+#define CACHE_MAX_NODES 8
+/* Objects up to this size are copied to a node after this many remote hits */
+#define CACHE_REPLICA_MAX 16384
+#define CACHE_REPLICA_HITS 4
+/* Hash buckets per partition */
+#define CACHE_BUCKETS 4096
+/* Bodies up to this size share the entry's allocation */
+#define CACHE_INLINE_MAX 4096
+/* Default lifetimes of cached errors, in seconds; 0 = never cached */
+#define CACHE_NEGATIVE_TTL 30       /* 404 and 410 */
+#define CACHE_ERROR_TTL 5           /* 5xx */
+#define CACHE_TTL_JITTER 0.2        /* up to this fraction taken off */
+
+/*
+ * Entries are immutable once published, apart from the visited bit
+ * and the remote hit count. Readers only follow hnext; next/prev form
+ * the writer-private age list used for CLOCK eviction.
+ *
+ * Everything a lookup touches comes first, within one cache line. The
+ * uri follows the struct in the same allocation, and so does the body
+ * when it is small; cache_new lays this out.
+ */
 typedef struct cache_t cache_t;
 struct cache_t {
-	cache_t *next;
-	char uri[MAXLINE];
-	char visited;
-	size_t size;
+	uint32_t hash;
+	uint32_t uri_len;
+	cache_t *hnext;     /* hash chain, read without locks */
+	char *uri;
 	unsigned char *content;
+	size_t size;
+	time_t expires;     /* 0 = fresh forever, else stale after this */
+	char visited;       /* referenced since the clock hand last passed */
+	char mapped;        /* content points into a snapshot mapping */
+	char inlined;       /* content follows the uri */
+	unsigned int hits;  /* hits from other nodes' workers */
+	/* Writer side */
+	cache_t *next, *prev;
+	uint64_t retired;   /* epoch it was unlinked in */
 };
 
-void cache_init();
-void cache_store(size_t filesize, char *uri, unsigned char *response);
+/* One hash index plus age list; writers serialize on w */
+typedef struct {
+	cache_t *buckets[CACHE_BUCKETS];
+	cache_t *head, *tail;
+	cache_t *retired;   /* unlinked, waiting for readers to move on */
+	size_t size;
+	size_t count;
+	size_t max_size;
+	sem_t w;
+} __attribute__((aligned(64))) cache_part_t;
+
+/* Partition the calling thread prefers, set when it is pinned to a node */
+extern __thread int cache_node;
+
+void cache_init(int nodes);
+int cache_share(char *name, size_t size);
+int cache_shared();
+int cache_shared_stats(uint64_t *hits, uint64_t *misses);
+void cache_resize(size_t max_size);
+void cache_configure_ttl(double negative, double error, double jitter);
+time_t cache_expiry(int status, unsigned char *response, size_t size);
+cache_t *cache_new(char *uri, size_t uri_len, size_t size,
+	unsigned char *mapped);
+void cache_free(cache_t *ptr);
+void cache_store(size_t filesize, char *uri, unsigned char *response,
+	time_t expires);
 void cache_add(cache_t *ptr);
-void cache_delete();
+void cache_delete(cache_part_t *part);
 cache_t *cache_find(char *uri);
-void cache_update();
-void cache_mark_clear();
+cache_t *cache_find_stale(char *uri);
+void cache_release(cache_t *ptr);
+void cache_remove(char *uri);
+void cache_walk(void (*fn)(cache_t *, void *), void *arg);
 
-#endif
\ No newline at end of file
+#endif
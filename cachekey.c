@@ -0,0 +1,295 @@
+/*
+ * cachekey.c - canonical cache keys and Vary-aware variant keys
+ *
+ * Equivalent URIs (host case, an explicit default port, escaped
+ * unreserved characters, dot segments) map to one base key built from
+ * parse_uri's output. Responses carrying Vary are stored under a variant
+ * key: the base key followed by the request's values of the named
+ * headers. The Vary list is learned per base key from the last response
+ * and kept in a small direct-mapped table; losing a slot only costs a
+ * miss, never a wrong variant, because the list is part of what the
+ * variant key is derived from.
+ */
+#include "cachekey.h"
+
+typedef struct {
+	uint64_t hash;              /* base key hash, 0 if unused */
+	char vary[VARY_LEN];        /* "accept-encoding,accept-language" */
+} vary_slot_t;
+
+static vary_slot_t slots[VARY_SLOTS];
+static pthread_mutex_t locks[VARY_LOCKS];
+
+/*
+ * Initialize the striped locks
+ */
+void cachekey_init()
+{
+	int i;
+
+	for (i = 0; i < VARY_LOCKS; i++)
+		pthread_mutex_init(&locks[i], NULL);
+}
+
+static uint64_t hash64(char *s)
+{
+	uint64_t h = 14695981039346656037ull;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 1099511628211ull;
+	return h | 1;
+}
+
+static int unreserved(int c)
+{
+	return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/*
+ * Decode escaped unreserved characters and uppercase the remaining
+ * escapes; stops at a fragment
+ */
+static void normalize_escapes(char *in, char *out)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	int c;
+
+	for (; *in && *in != '#'; in++) {
+		if (*in == '%' && isxdigit((unsigned char)in[1]) &&
+			isxdigit((unsigned char)in[2])) {
+			sscanf(in + 1, "%2x", &c);
+			if (unreserved(c)) {
+				*out++ = c;
+			}
+			else {
+				*out++ = '%';
+				*out++ = hex[c >> 4];
+				*out++ = hex[c & 15];
+			}
+			in += 2;
+		}
+		else {
+			*out++ = *in;
+		}
+	}
+	*out = '\0';
+}
+
+/*
+ * Remove "." and ".." segments from an absolute path (RFC 3986 5.2.4)
+ */
+static char *remove_dots(char *in, char *out)
+{
+	char *seg, *next, *o = out;
+	size_t len;
+
+	for (seg = in; *seg == '/'; seg = next) {
+		next = strchr(seg + 1, '/');
+		len = next ? (size_t)(next - seg - 1) : strlen(seg + 1);
+		if (len == 1 && seg[1] == '.') {
+			if (next == NULL)
+				*o++ = '/';
+		}
+		else if (len == 2 && seg[1] == '.' && seg[2] == '.') {
+			while (o > out && *--o != '/')
+				;
+			if (next == NULL)
+				*o++ = '/';
+		}
+		else {
+			memcpy(o, seg, len + 1);
+			o += len + 1;
+		}
+		if (next == NULL)
+			break;
+	}
+	if (o == out)
+		*o++ = '/';
+	*o = '\0';
+	return o;
+}
+
+/*
+ * cachekey_build - canonical key "host[:port]/path[?query]" from the
+ * 		output of parse_uri; key must hold MAXLINE bytes
+ */
+void cachekey_build(char *hostname, char *port, char *path, char *key)
+{
+	char escaped[MAXLINE], *query, *k = key;
+	size_t len;
+
+	for (len = 0; hostname[len] && len < MAXLINE / 4; len++)
+		*k++ = tolower((unsigned char)hostname[len]);
+	if (k > key && k[-1] == '.')
+		k--;
+	if (*port && atoi(port) != 80)
+		k += sprintf(k, ":%d", atoi(port));
+
+	normalize_escapes(path, escaped);
+	if ((query = strchr(escaped, '?')) != NULL)
+		*query++ = '\0';
+	if (escaped[0] == '/') {
+		k = remove_dots(escaped, k);
+	}
+	else {
+		strcpy(k, escaped);
+		k += strlen(k);
+	}
+	if (query && *query)
+		snprintf(k, MAXLINE - (k - key), "?%s", query);
+}
+
+/*
+ * Value of header name in a request header block, or NULL; len gets
+ * its length without surrounding whitespace
+ */
+static char *request_header(char *request, char *name, size_t *len)
+{
+	size_t n = strlen(name);
+	char *line, *v;
+
+	for (line = strstr(request, "\r\n"); line; line = strstr(line, "\r\n")) {
+		line += 2;
+		if (strncasecmp(line, name, n) || line[n] != ':')
+			continue;
+		for (v = line + n + 1; *v == ' ' || *v == '\t'; v++)
+			;
+		*len = strcspn(v, "\r\n");
+		while (*len > 0 && (v[*len - 1] == ' ' || v[*len - 1] == '\t'))
+			(*len)--;
+		return v;
+	}
+	return NULL;
+}
+
+/*
+ * Append the request's values of every header in vary to the base key
+ */
+static void build_variant(char *key, char *vary, char *request, char *out)
+{
+	char text[MAXBUF], name[VARY_LEN], *v;
+	size_t len, vlen, n = 0, klen = strlen(key);
+	char *p = vary, *comma;
+
+	if (!strcmp(vary, "*")) {
+		/* Never stored, so never matched */
+		sprintf(out, "%s\n*", key);
+		return;
+	}
+	text[0] = '\0';
+	while (*p) {
+		comma = strchr(p, ',');
+		len = comma ? (size_t)(comma - p) : strlen(p);
+		memcpy(name, p, len);
+		name[len] = '\0';
+		p += comma ? len + 1 : len;
+		if (len == 0)
+			continue;
+		if ((v = request_header(request, name, &vlen)) == NULL)
+			vlen = 0;
+		if (n + len + vlen + 3 < sizeof(text))
+			n += sprintf(text + n, "\n%s:%.*s", name, (int)vlen, v ? v : "");
+	}
+	/* Long variants are folded into a hash to fit the entry's key */
+	if (klen + n < MAXLINE)
+		sprintf(out, "%s%s", key, text);
+	else
+		sprintf(out, "%.*s\n#%016llx", MAXLINE - 20, key,
+			(unsigned long long)hash64(text));
+}
+
+/*
+ * cachekey_variant - the key to look key up under for this request:
+ * 		key itself unless its last response carried Vary. Returns 1
+ * 		if a Vary list is known for key.
+ */
+int cachekey_variant(char *key, char *request, char *lookup)
+{
+	uint64_t h = hash64(key);
+	vary_slot_t *s = &slots[h % VARY_SLOTS];
+	pthread_mutex_t *lock = &locks[h % VARY_SLOTS % VARY_LOCKS];
+	char vary[VARY_LEN];
+
+	pthread_mutex_lock(lock);
+	vary[0] = '\0';
+	if (s->hash == h)
+		strcpy(vary, s->vary);
+	pthread_mutex_unlock(lock);
+
+	if (vary[0] == '\0') {
+		strcpy(lookup, key);
+		return 0;
+	}
+	build_variant(key, vary, request, lookup);
+	return 1;
+}
+
+/*
+ * Canonical Vary list of a response ("" if none); 0 if it is too long
+ */
+static int response_vary(unsigned char *response, size_t size, char *vary)
+{
+	char hdr[MAXBUF], *line, *v, *o = vary;
+	size_t len;
+
+	len = size < sizeof(hdr) - 1 ? size : sizeof(hdr) - 1;
+	memcpy(hdr, response, len);
+	hdr[len] = '\0';
+	if ((v = strstr(hdr, "\r\n\r\n")) != NULL)
+		v[2] = '\0';
+
+	*vary = '\0';
+	for (line = strstr(hdr, "\r\n"); line; line = strstr(line, "\r\n")) {
+		line += 2;
+		if (strncasecmp(line, "Vary:", 5))
+			continue;
+		for (v = line + 5; *v && *v != '\r' && *v != '\n'; v++) {
+			if (*v == ' ' || *v == '\t')
+				continue;
+			if (o - vary >= VARY_LEN - 1)
+				return 0;
+			*o++ = tolower((unsigned char)*v);
+		}
+		*o = '\0';
+		break;
+	}
+	return 1;
+}
+
+/*
+ * cachekey_learn - record the Vary list of a response fetched for key
+ * 		and give the key to store it under. Returns 0 if the
+ * 		response must not be cached.
+ */
+int cachekey_learn(char *key, char *request, unsigned char *response,
+	size_t size, char *store)
+{
+	uint64_t h = hash64(key);
+	vary_slot_t *s = &slots[h % VARY_SLOTS];
+	pthread_mutex_t *lock = &locks[h % VARY_SLOTS % VARY_LOCKS];
+	char vary[VARY_LEN];
+
+	if (!response_vary(response, size, vary))
+		return 0;
+	if (strstr(vary, "*"))
+		strcpy(vary, "*");
+
+	pthread_mutex_lock(lock);
+	if (vary[0] != '\0') {
+		s->hash = h;
+		strcpy(s->vary, vary);
+	}
+	else if (s->hash == h) {
+		s->hash = 0;
+	}
+	pthread_mutex_unlock(lock);
+
+	if (vary[0] == '\0') {
+		strcpy(store, key);
+		return 1;
+	}
+	if (!strcmp(vary, "*"))
+		return 0;
+	build_variant(key, vary, request, store);
+	return 1;
+}
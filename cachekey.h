@@ -0,0 +1,17 @@
+#ifndef __CACHEKEY_H__
+#define __CACHEKEY_H__
+
+#include "csapp.h"
+
+/* Learned Vary lists, one per base key, direct mapped */
+#define VARY_SLOTS 4096
+#define VARY_LOCKS 64
+#define VARY_LEN 256             /* longest Vary list remembered */
+
+void cachekey_init();
+void cachekey_build(char *hostname, char *port, char *path, char *key);
+int cachekey_variant(char *key, char *request, char *lookup);
+int cachekey_learn(char *key, char *request, unsigned char *response,
+	size_t size, char *store);
+
+#endif
@@ -0,0 +1,787 @@
+/*
+ * co.c - stackful coroutines for connections
+ *
+ * With -C each connection runs the same blocking-style code as a
+ * thread would (doit and everything under it), but as a task on one
+ * of a few scheduler threads. Sockets are non-blocking; when a read or
+ * write would block, the Rio hook (rio_wait) arms the descriptor in the
+ * scheduler's epoll set and switches back to the scheduler, which runs
+ * other tasks until the descriptor is ready. co_poll and co_sleep do
+ * the same for upstream_connect, the tunnel loop and rate pacing, and
+ * co_park/co_wake let a task wait for another thread without blocking
+ * its scheduler.
+ *
+ * Stacks are mmap'd with MAP_NORESERVE and a guard page, so a task
+ * only commits the pages it touches, and finished tasks hand their
+ * stacks to a per-scheduler pool. A deep frame (a miss's response
+ * buffer) would leave its pages committed there for good, so a stack
+ * that stays in the pool for a while is trimmed back to its top. Tasks never migrate between
+ * schedulers, so everything a scheduler owns is touched by its thread
+ * only, except the spawn and wake lists, which other threads push to
+ * under a lock and signal through an eventfd, and the job deque.
+ *
+ * Work a task hands off with co_submit (the miss path of a request)
+ * goes on its scheduler's Chase-Lev deque instead. The owner takes a
+ * job whenever its run queue empties, and a scheduler with nothing to
+ * run steals one from another before it sleeps. Both take the oldest
+ * job: popping newest-first, as the classic deque's owner does, lets
+ * the oldest requests starve under load. A push that leaves a backlog
+ * kicks one sleeping scheduler, so a burst of misses on one core
+ * spreads over the idle ones without any shared queue lock. A job
+ * only moves before it starts, so the rule above holds for tasks.
+ *
+ * Every wait bumps the task's sequence number, and epoll events carry
+ * (sequence, task id), so an event for an abandoned wait (a timeout
+ * that won, or one of several descriptors) is recognized and dropped.
+ */
+#define _GNU_SOURCE
+#include "co.h"
+#include "ratelimit.h"
+#include "metrics.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#ifndef __x86_64__
+#include <ucontext.h>
+#endif
+
+#define EV_KICK UINT32_MAX  /* event id of a scheduler's eventfd */
+#define DEQUE_MASK (CO_DEQUE - 1)
+
+#ifdef __x86_64__
+/* Saved stack pointer; callee-saved registers are pushed under it */
+typedef struct {
+	void *sp;
+} co_ctx_t;
+
+void co_switch(co_ctx_t *from, co_ctx_t *to);
+__asm__(
+	".text\n"
+	".globl co_switch\n"
+	".hidden co_switch\n"
+	".type co_switch, @function\n"
+	"co_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size co_switch, .-co_switch\n");
+
+/*
+ * Build a frame that co_switch "returns" into entry from
+ */
+static void ctx_make(co_ctx_t *c, void *stack, size_t size, void (*entry)())
+{
+	uintptr_t *top = (uintptr_t *)(((uintptr_t)stack + size) & ~(uintptr_t)15);
+
+	*--top = 0;                 /* entry never returns */
+	*--top = (uintptr_t)entry;
+	top -= 6;                   /* rbp, rbx, r12-r15 */
+	memset(top, 0, 6 * sizeof(*top));
+	c->sp = top;
+}
+#else
+typedef ucontext_t co_ctx_t;
+
+#define co_switch(from, to) swapcontext(from, to)
+
+static void ctx_make(co_ctx_t *c, void *stack, size_t size, void (*entry)())
+{
+	getcontext(c);
+	c->uc_stack.ss_sp = stack;
+	c->uc_stack.ss_size = size;
+	c->uc_link = NULL;
+	makecontext(c, entry, 0);
+}
+#endif
+
+typedef struct sched_t sched_t;
+
+struct co_task {
+	co_ctx_t ctx;
+	void *stack;            /* mapping, guard page at the bottom */
+	void (*fn)(void *);
+	void *arg;
+	sched_t *sched;
+	uint32_t id;            /* index in sched->tasks */
+	uint32_t seq;           /* bumped by every wait */
+	int waiting;
+	int done;
+	uint64_t deadline;
+	int timer;              /* index in sched->heap, -1 if none */
+	int rate_client;        /* thread-local that belongs to the task */
+	co_task_t *next;        /* run queue, wake list or free list */
+};
+
+typedef struct spawn_t spawn_t;
+struct spawn_t {
+	void (*fn)(void *);
+	void *arg;
+	spawn_t *next;
+};
+
+/* Owner pushes at bottom; owner and thieves take from top */
+typedef struct {
+	int64_t top;
+	char pad[56];
+	int64_t bottom;
+	spawn_t *jobs[CO_DEQUE];
+} deque_t;
+
+struct sched_t {
+	deque_t deque;
+	int epfd, evfd;
+	int idle;               /* asleep in epoll_wait with nothing to run */
+	co_ctx_t ctx;
+	co_task_t *current;
+	co_task_t *run_head, *run_tail;
+	co_task_t **tasks;      /* every task made here, by id */
+	uint32_t ntasks, cap;
+	co_task_t *free_tasks;
+	co_task_t **heap;       /* timers, earliest deadline first */
+	int nheap, heap_cap;
+	void *stacks[CO_STACK_POOL];
+	uint64_t pooled[CO_STACK_POOL]; /* when each went in, oldest first */
+	int nstacks;
+	int ntrimmed;           /* stacks[0..ntrimmed) have been trimmed */
+	pthread_mutex_t lock;   /* guards spawns and woken */
+	spawn_t *spawns;
+	co_task_t *woken;
+};
+
+static sched_t *scheds;
+static int nscheds;
+static int nidle;           /* schedulers with idle set */
+static size_t page_size;
+static __thread sched_t *sched_self;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void heap_swap(sched_t *s, int i, int j)
+{
+	co_task_t *t = s->heap[i];
+
+	s->heap[i] = s->heap[j];
+	s->heap[j] = t;
+	s->heap[i]->timer = i;
+	s->heap[j]->timer = j;
+}
+
+static void heap_up(sched_t *s, int i)
+{
+	while (i > 0 && s->heap[(i - 1) / 2]->deadline > s->heap[i]->deadline) {
+		heap_swap(s, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void heap_down(sched_t *s, int i)
+{
+	int l, r, m;
+
+	while (1) {
+		l = 2 * i + 1;
+		r = l + 1;
+		m = i;
+		if (l < s->nheap && s->heap[l]->deadline < s->heap[m]->deadline)
+			m = l;
+		if (r < s->nheap && s->heap[r]->deadline < s->heap[m]->deadline)
+			m = r;
+		if (m == i)
+			return;
+		heap_swap(s, i, m);
+		i = m;
+	}
+}
+
+static void timer_add(sched_t *s, co_task_t *t, uint64_t deadline)
+{
+	if (s->nheap == s->heap_cap) {
+		s->heap_cap = s->heap_cap ? s->heap_cap * 2 : 64;
+		s->heap = (co_task_t **)Realloc(s->heap,
+			s->heap_cap * sizeof(*s->heap));
+	}
+	t->deadline = deadline;
+	t->timer = s->nheap;
+	s->heap[s->nheap++] = t;
+	heap_up(s, t->timer);
+}
+
+static void timer_del(sched_t *s, co_task_t *t)
+{
+	int i = t->timer, last;
+
+	if (i < 0)
+		return;
+	last = --s->nheap;
+	if (i != last) {
+		s->heap[i] = s->heap[last];
+		s->heap[i]->timer = i;
+		heap_down(s, i);
+		heap_up(s, i);
+	}
+	t->timer = -1;
+}
+
+/*
+ * Make t runnable, ending whatever wait it was in
+ */
+static void ready(sched_t *s, co_task_t *t)
+{
+	t->waiting = 0;
+	timer_del(s, t);
+	t->next = NULL;
+	if (s->run_tail)
+		s->run_tail->next = t;
+	else
+		s->run_head = t;
+	s->run_tail = t;
+}
+
+static void *stack_get(sched_t *s)
+{
+	void *p;
+
+	if (s->nstacks > 0) {
+		if (s->ntrimmed == s->nstacks)
+			s->ntrimmed--;
+		return s->stacks[--s->nstacks];
+	}
+	p = mmap(NULL, CO_STACK_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	/* An overflow faults on the guard page instead of corrupting */
+	mprotect(p, page_size, PROT_NONE);
+	return p;
+}
+
+static void stack_put(sched_t *s, void *p)
+{
+	if (s->nstacks < CO_STACK_POOL) {
+		s->pooled[s->nstacks] = now_ns();
+		s->stacks[s->nstacks++] = p;
+	}
+	else
+		munmap(p, CO_STACK_SIZE);
+}
+
+/*
+ * Give back the pages of stacks pooled for CO_STACK_IDLE_MS, all but
+ * their top CO_STACK_KEEP bytes; returns the ms until the next one is
+ * due, or -1 if none is. The pool is a stack, so the stacks idle that
+ * long are the bottom ones, which a steady load never reaches.
+ */
+static int stacks_trim(sched_t *s, uint64_t now)
+{
+	uint64_t due;
+
+	for (; s->ntrimmed < s->nstacks; s->ntrimmed++) {
+		due = s->pooled[s->ntrimmed] + CO_STACK_IDLE_MS * 1000000ull;
+		if (due > now)
+			return (int)((due - now + 999999) / 1000000);
+		madvise((char *)s->stacks[s->ntrimmed] + page_size,
+			CO_STACK_SIZE - page_size - CO_STACK_KEEP, MADV_DONTNEED);
+	}
+	return -1;
+}
+
+/*
+ * First frame of every task; never returns
+ */
+static void co_entry()
+{
+	sched_t *s = sched_self;
+	co_task_t *t = s->current;
+
+	t->fn(t->arg);
+	t->done = 1;
+	co_switch(&t->ctx, &s->ctx);
+}
+
+static co_task_t *task_new(sched_t *s, void (*fn)(void *), void *arg)
+{
+	co_task_t *t;
+	void *stack;
+
+	if ((stack = stack_get(s)) == NULL)
+		return NULL;
+	if ((t = s->free_tasks) != NULL) {
+		s->free_tasks = t->next;
+	}
+	else {
+		t = (co_task_t *)Calloc(1, sizeof(*t));
+		if (s->ntasks == s->cap) {
+			s->cap = s->cap ? s->cap * 2 : 256;
+			s->tasks = (co_task_t **)Realloc(s->tasks,
+				s->cap * sizeof(*s->tasks));
+		}
+		t->id = s->ntasks;
+		s->tasks[s->ntasks++] = t;
+		t->sched = s;
+		t->timer = -1;
+	}
+	t->stack = stack;
+	t->fn = fn;
+	t->arg = arg;
+	t->done = 0;
+	t->rate_client = -1;
+	ctx_make(&t->ctx, (char *)stack + page_size, CO_STACK_SIZE - page_size,
+		co_entry);
+	ready(s, t);
+	return t;
+}
+
+/*
+ * Run t until it waits or finishes
+ */
+static void resume(sched_t *s, co_task_t *t)
+{
+	s->current = t;
+	rate_client = t->rate_client;
+	co_switch(&s->ctx, &t->ctx);
+	t->rate_client = rate_client;
+	s->current = NULL;
+	if (t->done) {
+		stack_put(s, t->stack);
+		t->seq++;
+		t->next = s->free_tasks;
+		s->free_tasks = t;
+	}
+}
+
+/*
+ * Switch to the scheduler until ready() is called on the current task,
+ * by an event, its timer (deadline, 0 for none) or co_wake
+ */
+static void block(co_task_t *t, uint64_t deadline)
+{
+	t->waiting = 1;
+	if (deadline)
+		timer_add(t->sched, t, deadline);
+	co_switch(&t->ctx, &t->sched->ctx);
+}
+
+/*
+ * Arm fd to wake t once for events, reusing its epoll registration
+ */
+static int arm(sched_t *s, co_task_t *t, int fd, short events)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLONESHOT;
+	if (events & POLLIN)
+		ev.events |= EPOLLIN;
+	if (events & POLLOUT)
+		ev.events |= EPOLLOUT;
+	ev.data.u64 = (uint64_t)t->seq << 32 | t->id;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+		return 0;
+	if (errno != ENOENT)
+		return -1;
+	return epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * Rio hook: wait until fd is ready. Off a task (a spawn that fell back
+ * to a thread) the socket is still non-blocking, so just poll it.
+ */
+static int co_wait_fd(int fd, short events)
+{
+	co_task_t *t = co_self();
+	struct pollfd pfd;
+
+	if (t == NULL) {
+		pfd.fd = fd;
+		pfd.events = events;
+		return poll(&pfd, 1, -1) < 0 && errno != EINTR ? -1 : 0;
+	}
+	t->seq++;
+	if (arm(t->sched, t, fd, events) < 0)
+		return -1;
+	block(t, 0);
+	return 0;
+}
+
+static void *spawn_thread(void *vargp)
+{
+	spawn_t *sp = (spawn_t *)vargp;
+
+	Pthread_detach(pthread_self());
+	sp->fn(sp->arg);
+	Free(sp);
+	return NULL;
+}
+
+/*
+ * Start a queued spawn or job as a task on s
+ */
+static void start(sched_t *s, spawn_t *sp)
+{
+	pthread_t tid;
+
+	if (task_new(s, sp->fn, sp->arg) != NULL)
+		Free(sp);
+	else    /* out of address space: serve it the old way */
+		Pthread_create(&tid, NULL, spawn_thread, sp);
+}
+
+/*
+ * deque_push - owner only; jobs now queued, or -1 if the deque is full
+ */
+static int deque_push(deque_t *d, spawn_t *sp)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+	if (b - t >= CO_DEQUE)
+		return -1;
+	__atomic_store_n(&d->jobs[b & DEQUE_MASK], sp, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+	return b + 1 - t;
+}
+
+/*
+ * deque_steal - any thread, owner included; the oldest job, or NULL if
+ * 		empty or lost to another taker
+ */
+static spawn_t *deque_steal(deque_t *d)
+{
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	int64_t b;
+	spawn_t *sp;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+	sp = __atomic_load_n(&d->jobs[t & DEQUE_MASK], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return sp;
+}
+
+/*
+ * Take a job from the first other scheduler that has one
+ */
+static spawn_t *steal(sched_t *s)
+{
+	int self = s - scheds, i;
+	spawn_t *sp;
+
+	for (i = 1; i < nscheds; i++)
+		if ((sp = deque_steal(&scheds[(self + i) % nscheds].deque)) != NULL) {
+			metrics_inc(M_FETCH_STOLEN);
+			return sp;
+		}
+	return NULL;
+}
+
+/*
+ * Clear s's idle flag; nonzero if it was set (and is now counted out)
+ */
+static int unidle(sched_t *s)
+{
+	if (!__atomic_exchange_n(&s->idle, 0, __ATOMIC_SEQ_CST))
+		return 0;
+	__atomic_sub_fetch(&nidle, 1, __ATOMIC_SEQ_CST);
+	return 1;
+}
+
+/*
+ * Take what other threads queued for this scheduler
+ */
+static void drain(sched_t *s)
+{
+	spawn_t *sp, *rev = NULL, *next;
+	co_task_t *t, *tnext;
+
+	pthread_mutex_lock(&s->lock);
+	sp = s->spawns;
+	t = s->woken;
+	s->spawns = NULL;
+	s->woken = NULL;
+	pthread_mutex_unlock(&s->lock);
+
+	for (; t; t = tnext) {
+		tnext = t->next;
+		ready(s, t);
+	}
+	/* Pushed newest first; start them in arrival order */
+	for (; sp; sp = next) {
+		next = sp->next;
+		sp->next = rev;
+		rev = sp;
+	}
+	for (sp = rev; sp; sp = next) {
+		next = sp->next;
+		start(s, sp);
+	}
+}
+
+static void *sched_main(void *vargp)
+{
+	sched_t *s = (sched_t *)vargp;
+	struct epoll_event evs[CO_EVENTS];
+	spawn_t *sp;
+	co_task_t *t;
+	uint64_t now, kicks;
+	uint32_t id;
+	int n, i, timeout, trim;
+
+	Pthread_detach(pthread_self());
+	sched_self = s;
+	while (1) {
+		while ((t = s->run_head) != NULL) {
+			if ((s->run_head = t->next) == NULL)
+				s->run_tail = NULL;
+			resume(s, t);
+		}
+
+		/* One job per round, so ready descriptors are not starved */
+		timeout = -1;
+		if ((sp = deque_steal(&s->deque)) != NULL ||
+			(sp = steal(s)) != NULL) {
+			start(s, sp);
+			timeout = 0;
+		}
+		else if (s->nheap > 0) {
+			now = now_ns();
+			timeout = s->heap[0]->deadline <= now ? 0 :
+				(int)((s->heap[0]->deadline - now + 999999) / 1000000);
+		}
+		if (timeout != 0) {
+			/* Sleep no longer than the next stack is due to be trimmed */
+			if ((trim = stacks_trim(s, now_ns())) >= 0 &&
+				(timeout < 0 || trim < timeout))
+				timeout = trim;
+			/* Advertise before the last look, so a push sees one or the other */
+			__atomic_store_n(&s->idle, 1, __ATOMIC_SEQ_CST);
+			__atomic_add_fetch(&nidle, 1, __ATOMIC_SEQ_CST);
+			if ((sp = steal(s)) != NULL) {
+				unidle(s);
+				start(s, sp);
+				timeout = 0;
+			}
+		}
+		if ((n = epoll_wait(s->epfd, evs, CO_EVENTS, timeout)) < 0 &&
+			errno != EINTR)
+			unix_error("epoll_wait error");
+		unidle(s);
+		for (i = 0; i < n; i++) {
+			id = (uint32_t)evs[i].data.u64;
+			if (id == EV_KICK) {
+				if (read(s->evfd, &kicks, sizeof(kicks)) < 0 && errno != EAGAIN)
+					unix_error("eventfd read error");
+				drain(s);
+				continue;
+			}
+			t = s->tasks[id];
+			if (t->waiting && t->seq == (uint32_t)(evs[i].data.u64 >> 32))
+				ready(s, t);
+		}
+		now = now_ns();
+		while (s->nheap > 0 && s->heap[0]->deadline <= now)
+			ready(s, s->heap[0]);
+	}
+	return NULL;
+}
+
+/*
+ * Wake s out of epoll_wait to look at its spawn and wake lists
+ */
+static void kick(sched_t *s)
+{
+	uint64_t one = 1;
+
+	if (write(s->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		unix_error("eventfd write error");
+}
+
+/*
+ * co_start - start n schedulers; scheduler i is created with
+ * 		attrs[i % nattrs] (for stack size and CPU affinity)
+ */
+void co_start(int n, pthread_attr_t *attrs, int nattrs)
+{
+	struct epoll_event ev;
+	pthread_t tid;
+	sched_t *s;
+	int i;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	nscheds = n < 1 ? 1 : n;
+	scheds = (sched_t *)Calloc(nscheds, sizeof(sched_t));
+	rio_wait = co_wait_fd;
+	for (i = 0; i < nscheds; i++) {
+		s = &scheds[i];
+		if ((s->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+			(s->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+			unix_error("co_start error");
+		pthread_mutex_init(&s->lock, NULL);
+		ev.events = EPOLLIN;
+		ev.data.u64 = EV_KICK;
+		if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->evfd, &ev) < 0)
+			unix_error("co_start error");
+		Pthread_create(&tid, nattrs > 0 ? &attrs[i % nattrs] : NULL,
+			sched_main, s);
+	}
+}
+
+/*
+ * co_spawn - run fn(arg) as a new task on scheduler sched
+ */
+void co_spawn(int sched, void (*fn)(void *), void *arg)
+{
+	sched_t *s = &scheds[sched % nscheds];
+	spawn_t *sp = (spawn_t *)Malloc(sizeof(*sp));
+	int idle;
+
+	sp->fn = fn;
+	sp->arg = arg;
+	pthread_mutex_lock(&s->lock);
+	idle = s->spawns == NULL && s->woken == NULL;
+	sp->next = s->spawns;
+	s->spawns = sp;
+	pthread_mutex_unlock(&s->lock);
+	if (idle)
+		kick(s);
+}
+
+/*
+ * co_submit - run fn(arg) as a new task on the caller's scheduler,
+ * 		unless an idle scheduler steals it first; outside a task
+ * 		it just runs fn(arg) before returning
+ */
+void co_submit(void (*fn)(void *), void *arg)
+{
+	sched_t *s = sched_self;
+	spawn_t *sp;
+	int i, queued;
+
+	if (co_self() == NULL) {
+		fn(arg);
+		return;
+	}
+	sp = (spawn_t *)Malloc(sizeof(*sp));
+	sp->fn = fn;
+	sp->arg = arg;
+	if ((queued = deque_push(&s->deque, sp)) < 0) {
+		start(s, sp);
+		return;
+	}
+	/* A lone job is ours to run next; only a backlog wakes a thief */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (queued < 2 || __atomic_load_n(&nidle, __ATOMIC_SEQ_CST) == 0)
+		return;
+	for (i = 1; i < nscheds; i++)
+		if (unidle(&scheds[(s - scheds + i) % nscheds])) {
+			kick(&scheds[(s - scheds + i) % nscheds]);
+			return;
+		}
+}
+
+/*
+ * co_active - is the caller a task (rather than a plain thread)?
+ */
+int co_active()
+{
+	return sched_self != NULL && sched_self->current != NULL;
+}
+
+co_task_t *co_self()
+{
+	return sched_self != NULL ? sched_self->current : NULL;
+}
+
+/*
+ * co_poll - poll(2) that suspends only the calling task
+ */
+int co_poll(struct pollfd *fds, nfds_t n, int timeout_ms)
+{
+	co_task_t *t = co_self();
+	nfds_t i;
+	int rc;
+
+	if (t == NULL)
+		return poll(fds, n, timeout_ms);
+	if (n > 0 && ((rc = poll(fds, n, 0)) != 0 || timeout_ms == 0))
+		return rc;
+	t->seq++;
+	for (i = 0; i < n; i++)
+		if (fds[i].fd >= 0 && fds[i].events &&
+			arm(t->sched, t, fds[i].fd, fds[i].events) < 0)
+			return -1;
+	block(t, timeout_ms < 0 ? 0 : now_ns() + timeout_ms * 1000000ull);
+	return n > 0 ? poll(fds, n, 0) : 0;
+}
+
+/*
+ * co_sleep - sleep for ns, suspending only the calling task
+ */
+void co_sleep(uint64_t ns)
+{
+	co_task_t *t = co_self();
+	struct timespec ts;
+
+	if (t == NULL) {
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		nanosleep(&ts, NULL);
+		return;
+	}
+	t->seq++;
+	block(t, now_ns() + ns);
+}
+
+/*
+ * co_park - suspend the calling task until co_wake; the waker must be
+ * 		able to find it before it parks (e.g. via a locked queue)
+ */
+void co_park()
+{
+	co_task_t *t = co_self();
+
+	t->seq++;
+	block(t, 0);
+}
+
+/*
+ * co_wake - make a parked task runnable, from any thread
+ */
+void co_wake(co_task_t *t)
+{
+	sched_t *s = t->sched;
+	int idle;
+
+	if (sched_self == s) {
+		ready(s, t);
+		return;
+	}
+	pthread_mutex_lock(&s->lock);
+	idle = s->spawns == NULL && s->woken == NULL;
+	t->next = s->woken;
+	s->woken = t;
+	pthread_mutex_unlock(&s->lock);
+	if (idle)
+		kick(s);
+}
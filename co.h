@@ -0,0 +1,28 @@
+#ifndef __CO_H__
+#define __CO_H__
+
+#include <stdint.h>
+#include <poll.h>
+#include "csapp.h"
+
+/* Coroutine runtime (-C): stackful tasks on one scheduler per core */
+#define CO_STACK_SIZE (512 * 1024)  /* reserved per task, committed on touch */
+#define CO_STACK_POOL 1024          /* idle stacks kept per scheduler */
+#define CO_STACK_IDLE_MS 1000       /* pooled this long, a stack is trimmed */
+#define CO_STACK_KEEP (16 * 1024)   /* of a trimmed stack, left committed */
+#define CO_EVENTS 256               /* epoll events taken per wakeup */
+#define CO_DEQUE 1024               /* queued jobs per scheduler (power of 2) */
+
+typedef struct co_task co_task_t;
+
+void co_start(int n, pthread_attr_t *attrs, int nattrs);
+void co_spawn(int sched, void (*fn)(void *), void *arg);
+void co_submit(void (*fn)(void *), void *arg);
+int co_active();
+co_task_t *co_self();
+int co_poll(struct pollfd *fds, nfds_t n, int timeout_ms);
+void co_sleep(uint64_t ns);
+void co_park();
+void co_wake(co_task_t *t);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * config.c - runtime settings, loaded at startup and on SIGHUP
+ *
+ * The file holds "name = value" lines; blank lines and lines starting
+ * with '#' are ignored. Settings not named in the file keep their
+ * current value, so a reload only changes what the file says. A file
+ * with any bad line is rejected as a whole and nothing is applied.
+ *
+ *   cache_size = 1049000
+ *   rate = 50
+ *   byte_rate = 1000000
+ *   fetch_slots = 128
+ *   connect_timeout_ms = 10000
+ *   prefetch_bytes = 4194304
+ *   negative_ttl = 30
+ *   error_ttl = 5
+ *   ttl_jitter = 0.2
+ *   large_cache_size = 268435456
+ */
+#include "config.h"
+#include "cache.h"
+#include "ratelimit.h"
+#include "upstream.h"
+#include "prefetch.h"
+#include "bigcache.h"
+
+config_t config = {
+	MAX_CACHE_SIZE, 0, 0, RATE_FETCH_SLOTS, CONNECT_TIMEOUT_MS,
+	PREFETCH_BYTES, CACHE_NEGATIVE_TTL, CACHE_ERROR_TTL, CACHE_TTL_JITTER, 0,
+};
+
+/*
+ * Parse one "name = value" into c; 0 if the line is not valid
+ */
+static int parse_line(char *line, config_t *c)
+{
+	char name[MAXLINE], *end;
+	double v;
+
+	if (sscanf(line, " %[a-z_] = %lf", name, &v) != 2 || v < 0)
+		return 0;
+	strtod(strchr(line, '=') + 1, &end);
+	while (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n')
+		end++;
+	if (*end != '\0')
+		return 0;
+	if (!strcmp(name, "cache_size") && v >= 1)
+		c->cache_size = (size_t)v;
+	else if (!strcmp(name, "rate"))
+		c->rate = v;
+	else if (!strcmp(name, "byte_rate"))
+		c->byte_rate = v;
+	else if (!strcmp(name, "fetch_slots") && v >= 1)
+		c->fetch_slots = (int)v;
+	else if (!strcmp(name, "connect_timeout_ms") && v >= 1)
+		c->connect_timeout_ms = (int)v;
+	else if (!strcmp(name, "prefetch_bytes"))
+		c->prefetch_bytes = v;
+	else if (!strcmp(name, "negative_ttl"))
+		c->negative_ttl = v;
+	else if (!strcmp(name, "error_ttl"))
+		c->error_ttl = v;
+	else if (!strcmp(name, "ttl_jitter") && v <= 1)
+		c->ttl_jitter = v;
+	else if (!strcmp(name, "large_cache_size"))
+		c->large_cache_size = (size_t)v;
+	else
+		return 0;
+	return 1;
+}
+
+/*
+ * config_load - read path over the current settings; 0 on success, -1
+ * 		if the file cannot be read or has a bad line (reported on
+ * 		stderr), in which case nothing changes
+ */
+int config_load(char *path)
+{
+	char line[MAXLINE], *p;
+	config_t c = config;
+	FILE *f;
+	int lineno = 0, ok = 1;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+			continue;
+		if (!parse_line(p, &c)) {
+			fprintf(stderr, "%s:%d: bad setting: %s", path, lineno, line);
+			ok = 0;
+		}
+	}
+	fclose(f);
+	if (!ok)
+		return -1;
+	config = c;
+	return 0;
+}
+
+/*
+ * config_apply - push the current settings into the running modules
+ */
+void config_apply()
+{
+	cache_resize(config.cache_size);
+	ratelimit_configure(config.rate, config.byte_rate, config.fetch_slots);
+	upstream_set_timeout(config.connect_timeout_ms);
+	prefetch_configure(config.prefetch_bytes);
+	cache_configure_ttl(config.negative_ttl, config.error_ttl,
+		config.ttl_jitter);
+	bigcache_configure(config.large_cache_size);
+}
@@ -0,0 +1,25 @@
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include "csapp.h"
+
+/* Settings that can change without a restart (SIGHUP) */
+typedef struct {
+	size_t cache_size;          /* total cache budget, bytes */
+	double rate;                /* per-client requests/s, 0 = off */
+	double byte_rate;           /* per-client bytes/s, 0 = off */
+	int fetch_slots;            /* upstream fetches in flight */
+	int connect_timeout_ms;     /* overall upstream connect timeout */
+	double prefetch_bytes;      /* prefetched bytes/s, 0 = no limit */
+	double negative_ttl;        /* seconds 404/410 stay cached, 0 = off */
+	double error_ttl;           /* seconds 5xx stay cached, 0 = off */
+	double ttl_jitter;          /* fraction of those taken off at random */
+	size_t large_cache_size;    /* chunked store for large objects, 0 = off */
+} config_t;
+
+extern config_t config;
+
+int config_load(char *path);
+void config_apply();
+
+#endif
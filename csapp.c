@@ -1,5 +1,6 @@
 /* $begin csapp.c */
 #include "csapp.h"
+#include <poll.h>
 
 /* Updated with a reentrant _clientfd_r function */
 
@@ -528,6 +529,12 @@ void V(sem_t *sem)
 /*********************************************************************
  * The Rio package - robust I/O functions
  **********************************************************************/
+/*
+ * rio_wait - set by a user-level scheduler to wait on a non-blocking
+ * descriptor that returned EAGAIN; NULL fails such reads and writes
+ */
+int (*rio_wait)(int fd, short events);
+
 /*
  * rio_readn - robustly read n bytes (unbuffered)
  */
@@ -542,6 +549,8 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
 	if ((nread = read(fd, bufp, nleft)) < 0) {
 	    if (errno == EINTR || errno == ECONNRESET) /* interrupted by sig handler return */
 		nread = 0;      /* and call read() again */
+	    else if (errno == EAGAIN && rio_wait && rio_wait(fd, POLLIN) == 0)
+		nread = 0;      /* readable now */
 	    else
 		return -1;      /* errno set by read() */ 
 	} 
@@ -568,6 +577,8 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
 	    if (errno == EINTR || errno == EPIPE)  /* interrupted by sig handler return */
 		nwritten = 0;    /* and call write() again */
+	    else if (errno == EAGAIN && rio_wait && rio_wait(fd, POLLOUT) == 0)
+		nwritten = 0;    /* writable now */
 	    else
 		return -1;       /* errorno set by write() */
 	}
@@ -596,6 +607,8 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
 	if (rp->rio_cnt < 0) {
+	    if (errno == EAGAIN && rio_wait && rio_wait(rp->rio_fd, POLLIN) == 0)
+		continue;       /* readable now */
 	    if (errno != EINTR || errno != ECONNRESET) /* interrupted by sig handler return */
 		return -1;
 	}
@@ -666,8 +679,10 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     for (n = 1; n < maxlen; n++) { 
 	if ((rc = rio_read(rp, &c, 1)) == 1) {
 	    *bufp++ = c;
-	    if (c == '\n')
+	    if (c == '\n') {
+		n++;
 		break;
+	    }
 	} else if (rc == 0) {
 	    if (n == 1)
 		return 0; /* EOF, no data read */
@@ -677,7 +692,7 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 	    return -1;	  /* error */
     }
     *bufp = 0;
-    return n;
+    return n-1;
 }
 /* $end rio_readlineb */
 
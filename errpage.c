@@ -0,0 +1,94 @@
+/*
+ * errpage.c - the responses the proxy generates itself for errors
+ *
+ * Every status the proxy can answer with is rendered once, headers and
+ * body, by errpage_init. Sending one is then a single write of an
+ * immutable buffer, with nothing formatted, so that refusing requests
+ * stays cheap when the proxy is overloaded and refuses many of them.
+ * The pages are the same for every request: they do not name the host
+ * or method that caused them.
+ */
+#include "errpage.h"
+#include "metrics.h"
+
+typedef struct {
+	int status;
+	const char *reason;
+	const char *headers;        /* extra header lines */
+	const char *text;
+	char *page;                 /* rendered by errpage_init */
+	size_t len;
+} errpage_t;
+
+static errpage_t pages[] = {
+	{ 400, "Bad Request", "",
+		"The request cannot be fulfilled due to bad syntax" },
+	{ 403, "Forbidden", "",
+		"This resource is only served to the proxy's own host" },
+	{ 429, "Too Many Requests", "Retry-After: 1\r\n",
+		"Too many requests from this client; slow down" },
+	{ 500, "Internal Server Error", "",
+		"The proxy cannot handle this request" },
+	{ 501, "Not Implemented", "",
+		"Tiny does not implement this method" },
+	{ 502, "Bad Gateway", "",
+		"The server you requested cannot be reached" },
+	{ 503, "Service Unavailable", "Retry-After: 1\r\n",
+		"The server you requested is failing; try again shortly" },
+	{ 504, "Gateway Timeout", "",
+		"The server you requested did not answer in time" },
+};
+
+#define NPAGES (sizeof(pages) / sizeof(pages[0]))
+
+/*
+ * errpage_init - render every page; call before any is sent
+ */
+void errpage_init()
+{
+	char body[MAXLINE];
+	size_t i;
+	int n;
+
+	for (i = 0; i < NPAGES; i++) {
+		n = snprintf(body, sizeof(body), "<html><title>Proxylab Error</title>"
+			"<body bgcolor=ffffff>\r\n%d: %s\r\n<p>%s\r\n"
+			"<hr><em>Yiting's Web Proxy</em>\r\n",
+			pages[i].status, pages[i].reason, pages[i].text);
+		pages[i].page = (char *)Malloc(MAXLINE + n);
+		pages[i].len = sprintf(pages[i].page, "HTTP/1.0 %d %s\r\n"
+			"Content-type: text/html\r\n%sContent-length: %d\r\n\r\n%s",
+			pages[i].status, pages[i].reason, pages[i].headers, n, body);
+	}
+}
+
+/*
+ * errpage - the rendered response for status and its length; a status
+ * 		without a page of its own gets the 500 page
+ */
+char *errpage(int status, size_t *len)
+{
+	size_t i;
+
+	for (i = 0; i < NPAGES && pages[i].status != status; i++)
+		;
+	if (i == NPAGES)
+		return errpage(500, len);
+	*len = pages[i].len;
+	return pages[i].page;
+}
+
+/*
+ * errpage_send - answer the client with the page for status. A client
+ * 		that has gone away is not an error worth more than the
+ * 		failed write.
+ */
+void errpage_send(int fd, int status)
+{
+	char *page;
+	size_t len;
+
+	metrics_inc(M_ERRORS);
+	page = errpage(status, &len);
+	rio_writen(fd, page, len);
+}
@@ -0,0 +1,10 @@
+#ifndef __ERRPAGE_H__
+#define __ERRPAGE_H__
+
+#include "csapp.h"
+
+void errpage_init();
+char *errpage(int status, size_t *len);
+void errpage_send(int fd, int status);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+ * metrics.c - per-thread counters and latency histograms
+ *
+ * Every thread lazily claims a cache-line aligned slot and updates it
+ * without locks or atomic read-modify-write instructions. Slots are
+ * never freed: when a thread exits its slot goes on a free list and is
+ * reused (counts intact) by the next thread, so totals stay monotonic.
+ * A scrape walks the registry and sums all slots.
+ */
+#include "metrics.h"
+#include "cache.h"
+#include "uring.h"
+#include "admit.h"
+#include "bigcache.h"
+
+__thread metrics_slot_t *metrics_self;
+
+static metrics_slot_t *registry;
+static metrics_slot_t *free_slots;
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slot_key;
+
+static const char *counter_names[M_NCOUNTERS] = {
+	"proxy_connections_accepted_total",
+	"proxy_connections_closed_total",
+	"proxy_requests_total",
+	"proxy_cache_hits_total",
+	"proxy_cache_misses_total",
+	"proxy_upstream_bytes_total",
+	"proxy_client_bytes_total",
+	"proxy_errors_total",
+	"proxy_breaker_fast_fail_total",
+	"proxy_stale_hits_total",
+	"proxy_tunnels_total",
+	"proxy_cache_remote_hits_total",
+	"proxy_cache_replications_total",
+	"proxy_range_hits_total",
+	"proxy_rate_limited_total",
+	"proxy_fetch_queued_total",
+	"proxy_fetch_stolen_total",
+	"proxy_prefetches_total",
+	"proxy_prefetch_bytes_total",
+	"proxy_prefetch_dropped_total",
+	"proxy_accesslog_overflow_total",
+	"proxy_cache_error_stores_total",
+	"proxy_large_hits_total",
+	"proxy_large_fills_total",
+	"proxy_large_aborted_total",
+};
+
+static const char *hist_names[H_NHISTS] = {
+	"accept", "parse", "cache_lookup", "connect", "ttfb", "transfer",
+};
+
+/*
+ * Return the exiting thread's slot to the free list
+ */
+static void slot_release(void *arg)
+{
+	metrics_slot_t *s = (metrics_slot_t *)arg;
+
+	pthread_mutex_lock(&slot_lock);
+	s->free_next = free_slots;
+	free_slots = s;
+	pthread_mutex_unlock(&slot_lock);
+}
+
+/*
+ * Initialize the slot registry
+ */
+void metrics_init()
+{
+	int rc;
+
+	if ((rc = pthread_key_create(&slot_key, slot_release)) != 0)
+		posix_error(rc, "pthread_key_create error");
+}
+
+/*
+ * Give the calling thread a slot, reusing a released one if possible
+ */
+metrics_slot_t *metrics_claim()
+{
+	metrics_slot_t *s;
+
+	pthread_mutex_lock(&slot_lock);
+	if ((s = free_slots) != NULL) {
+		free_slots = s->free_next;
+	}
+	else {
+		if (posix_memalign((void **)&s, 64, sizeof(*s)) != 0)
+			unix_error("posix_memalign error");
+		memset(s, 0, sizeof(*s));
+		s->next = registry;
+		__atomic_store_n(&registry, s, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&slot_lock);
+	pthread_setspecific(slot_key, s);
+	metrics_self = s;
+	return s;
+}
+
+/*
+ * Sum one counter over every slot
+ */
+static uint64_t sum_counter(int counter)
+{
+	metrics_slot_t *s;
+	uint64_t total = 0;
+
+	for (s = __atomic_load_n(&registry, __ATOMIC_ACQUIRE); s; s = s->next)
+		total += __atomic_load_n(&s->counters[counter], __ATOMIC_RELAXED);
+	return total;
+}
+
+/*
+ * Sum one histogram over every slot
+ */
+static void sum_hist(int hist, uint64_t *buckets, uint64_t *count,
+	uint64_t *sum)
+{
+	metrics_slot_t *s;
+	int i;
+
+	memset(buckets, 0, HIST_BUCKETS * sizeof(*buckets));
+	*count = *sum = 0;
+	for (s = __atomic_load_n(&registry, __ATOMIC_ACQUIRE); s; s = s->next) {
+		for (i = 0; i < HIST_BUCKETS; i++)
+			buckets[i] += __atomic_load_n(&s->hist[hist][i],
+				__ATOMIC_RELAXED);
+		*count += __atomic_load_n(&s->hist_count[hist], __ATOMIC_RELAXED);
+		*sum += __atomic_load_n(&s->hist_sum[hist], __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Upper bound (ns) of the values that land in bucket idx
+ */
+static uint64_t bucket_upper(int idx)
+{
+	int shift;
+
+	if (idx < HIST_SUB)
+		return idx;
+	shift = idx / HIST_SUB - 1;
+	return ((uint64_t)(HIST_SUB + idx % HIST_SUB + 1) << shift) - 1;
+}
+
+/*
+ * Estimate quantile q from bucket counts
+ */
+static uint64_t hist_quantile(uint64_t *buckets, uint64_t count, double q)
+{
+	uint64_t rank = (uint64_t)(q * count), seen = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen > rank)
+			return bucket_upper(i);
+	}
+	return bucket_upper(HIST_BUCKETS - 1);
+}
+
+/*
+ * Render every metric in Prometheus text exposition format
+ */
+static void metrics_render(FILE *out)
+{
+	static const double quantiles[] = { 0.5, 0.99, 0.999 };
+	uint64_t buckets[HIST_BUCKETS], count, sum, cum, hits, misses;
+	int i, p, q, b;
+
+	for (i = 0; i < M_NCOUNTERS; i++) {
+		fprintf(out, "# TYPE %s counter\n", counter_names[i]);
+		fprintf(out, "%s %llu\n", counter_names[i],
+			(unsigned long long)sum_counter(i));
+	}
+	/* Lookups by every process attached to the shared cache */
+	if (cache_shared_stats(&hits, &misses)) {
+		fprintf(out, "# TYPE proxy_shared_cache_hits_total counter\n");
+		fprintf(out, "proxy_shared_cache_hits_total %llu\n",
+			(unsigned long long)hits);
+		fprintf(out, "# TYPE proxy_shared_cache_misses_total counter\n");
+		fprintf(out, "proxy_shared_cache_misses_total %llu\n",
+			(unsigned long long)misses);
+	}
+	if (uring_enabled()) {
+		fprintf(out, "# TYPE proxy_uring_enters_total counter\n");
+		fprintf(out, "proxy_uring_enters_total %llu\n",
+			(unsigned long long)uring_enters());
+	}
+	/* Misses stored, and one-hit wonders kept out, by -A */
+	if (admit_enabled()) {
+		admit_stats(&hits, &misses);
+		fprintf(out, "# TYPE proxy_cache_admitted_total counter\n");
+		fprintf(out, "proxy_cache_admitted_total %llu\n",
+			(unsigned long long)hits);
+		fprintf(out, "# TYPE proxy_cache_rejected_total counter\n");
+		fprintf(out, "proxy_cache_rejected_total %llu\n",
+			(unsigned long long)misses);
+	}
+	if (bigcache_enabled()) {
+		fprintf(out, "# TYPE proxy_large_cache_bytes gauge\n");
+		fprintf(out, "proxy_large_cache_bytes %llu\n",
+			(unsigned long long)bigcache_used());
+	}
+
+	fprintf(out, "# TYPE proxy_phase_seconds histogram\n");
+	for (i = 0; i < H_NHISTS; i++) {
+		sum_hist(i, buckets, &count, &sum);
+		/* Collapse sub-buckets to powers of two from ~1us to ~1100s */
+		cum = 0;
+		b = 0;
+		for (p = 10; p <= HIST_MAX_BITS; p++) {
+			for (; b < (p - HIST_SUB_BITS + 1) * HIST_SUB && b < HIST_BUCKETS; b++)
+				cum += buckets[b];
+			fprintf(out, "proxy_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n",
+				hist_names[i], (double)(1ull << p) / 1e9,
+				(unsigned long long)cum);
+		}
+		fprintf(out, "proxy_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n",
+			hist_names[i], (unsigned long long)count);
+		fprintf(out, "proxy_phase_seconds_sum{phase=\"%s\"} %.9f\n",
+			hist_names[i], (double)sum / 1e9);
+		fprintf(out, "proxy_phase_seconds_count{phase=\"%s\"} %llu\n",
+			hist_names[i], (unsigned long long)count);
+	}
+
+	fprintf(out, "# TYPE proxy_phase_quantile_seconds gauge\n");
+	for (i = 0; i < H_NHISTS; i++) {
+		sum_hist(i, buckets, &count, &sum);
+		for (q = 0; q < 3; q++)
+			fprintf(out, "proxy_phase_quantile_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+				hist_names[i], quantiles[q],
+				(double)hist_quantile(buckets, count, quantiles[q]) / 1e9);
+	}
+}
+
+/*
+ * metrics_serve - answer a scrape on fd with an HTTP/1.0 response
+ */
+void metrics_serve(int fd)
+{
+	char hdr[MAXLINE], *body = NULL;
+	size_t len = 0;
+	FILE *out;
+
+	if ((out = open_memstream(&body, &len)) == NULL)
+		unix_error("open_memstream error");
+	metrics_render(out);
+	fclose(out);
+
+	sprintf(hdr, "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %d\r\n\r\n", (int)len);
+	Rio_writen(fd, hdr, strlen(hdr));
+	Rio_writen(fd, body, len);
+	free(body);
+}
@@ -0,0 +1,150 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include <time.h>
+#include "csapp.h"
+
+/* Reserved origin-form URI answered by the proxy itself */
+#define METRICS_URI "/__proxy/metrics"
+
+/* Monotonic counters */
+enum {
+	M_CONN_ACCEPTED,
+	M_CONN_CLOSED,
+	M_REQUESTS,
+	M_CACHE_HITS,
+	M_CACHE_MISSES,
+	M_BYTES_UPSTREAM,
+	M_BYTES_CLIENT,
+	M_ERRORS,
+	M_BREAKER_REJECTS,
+	M_STALE_HITS,
+	M_TUNNELS,
+	M_CACHE_REMOTE_HITS,
+	M_CACHE_REPLICATIONS,
+	M_RANGE_HITS,
+	M_RATE_LIMITED,
+	M_FETCH_QUEUED,
+	M_FETCH_STOLEN,
+	M_PREFETCHES,
+	M_PREFETCH_BYTES,
+	M_PREFETCH_DROPPED,
+	M_ACCESSLOG_OVERFLOW,
+	M_CACHE_ERROR_STORES,
+	M_LARGE_HITS,
+	M_LARGE_FILLS,
+	M_LARGE_ABORTS,
+	M_NCOUNTERS
+};
+
+/* Latency histograms, recorded in nanoseconds */
+enum {
+	H_ACCEPT,
+	H_PARSE,
+	H_CACHE_LOOKUP,
+	H_CONNECT,
+	H_TTFB,
+	H_TRANSFER,
+	H_NHISTS
+};
+
+/*
+ * Log-linear (HDR-style) buckets: values below HIST_SUB get one bucket
+ * each, every power of two above that is split into HIST_SUB buckets,
+ * which keeps the relative error under 1/HIST_SUB.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/*
+ * Per-thread slot. Only the owning thread writes it, so updates are
+ * plain relaxed load/store pairs; the scraper reads with relaxed loads.
+ * Aligned so two threads never share a cache line.
+ */
+typedef struct metrics_slot_t metrics_slot_t;
+struct metrics_slot_t {
+	uint64_t counters[M_NCOUNTERS];
+	uint64_t hist_count[H_NHISTS];
+	uint64_t hist_sum[H_NHISTS];
+	uint64_t hist[H_NHISTS][HIST_BUCKETS];
+	metrics_slot_t *next;      /* registry of every slot ever created */
+	metrics_slot_t *free_next; /* free list of unowned slots */
+} __attribute__((aligned(64)));
+
+extern __thread metrics_slot_t *metrics_self;
+
+void metrics_init();
+metrics_slot_t *metrics_claim();
+void metrics_serve(int fd);
+
+/*
+ * metrics_now - monotonic clock in nanoseconds
+ */
+static inline uint64_t metrics_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline metrics_slot_t *metrics_slot()
+{
+	metrics_slot_t *s = metrics_self;
+	return s != NULL ? s : metrics_claim();
+}
+
+static inline void metrics_add(int counter, uint64_t n)
+{
+	uint64_t *c = &metrics_slot()->counters[counter];
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n,
+		__ATOMIC_RELAXED);
+}
+
+static inline void metrics_inc(int counter)
+{
+	metrics_add(counter, 1);
+}
+
+static inline int metrics_hist_index(uint64_t v)
+{
+	int shift, idx;
+
+	if (v < HIST_SUB)
+		return (int)v;
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	idx = (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+	return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+/*
+ * metrics_record - add one latency sample (ns) to a histogram
+ */
+static inline void metrics_record(int hist, uint64_t ns)
+{
+	metrics_slot_t *s = metrics_slot();
+	uint64_t *b = &s->hist[hist][metrics_hist_index(ns)];
+
+	__atomic_store_n(b, __atomic_load_n(b, __ATOMIC_RELAXED) + 1,
+		__ATOMIC_RELAXED);
+	__atomic_store_n(&s->hist_count[hist],
+		__atomic_load_n(&s->hist_count[hist], __ATOMIC_RELAXED) + 1,
+		__ATOMIC_RELAXED);
+	__atomic_store_n(&s->hist_sum[hist],
+		__atomic_load_n(&s->hist_sum[hist], __ATOMIC_RELAXED) + ns,
+		__ATOMIC_RELAXED);
+}
+
+/*
+ * metrics_since - record the time elapsed since start, return now
+ */
+static inline uint64_t metrics_since(int hist, uint64_t start)
+{
+	uint64_t now = metrics_now();
+	metrics_record(hist, now - start);
+	return now;
+}
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * numa.c - discover NUMA nodes and their CPUs from sysfs
+ *
+ * No libnuma: memory placement relies on the kernel's first-touch
+ * policy, so a thread pinned to a node gets local pages for whatever
+ * it allocates and writes first.
+ */
+#include "numa.h"
+
+#define NUMA_MAX_NODE_ID 256
+
+/*
+ * Parse a sysfs cpulist such as "0-3,8-11" into set
+ */
+static void parse_cpulist(char *list, cpu_set_t *set)
+{
+	char *p = list, *end;
+	long lo, hi;
+
+	CPU_ZERO(set);
+	while (*p && *p != '\n') {
+		lo = hi = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		if (*end == '-')
+			hi = strtol(end + 1, &end, 10);
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			CPU_SET(lo, set);
+		p = *end == ',' ? end + 1 : end;
+	}
+}
+
+/*
+ * numa_detect - fill cpus[] with the CPUs of each node that has any,
+ * 		return the number of nodes (1 when there is no NUMA info)
+ */
+int numa_detect(cpu_set_t *cpus, int max)
+{
+	char path[MAXLINE], list[MAXLINE];
+	FILE *f;
+	int node, n = 0;
+
+	/* Node ids may be sparse, so probe a fixed range */
+	for (node = 0; n < max && node < NUMA_MAX_NODE_ID; node++) {
+		snprintf(path, sizeof(path),
+			"/sys/devices/system/node/node%d/cpulist", node);
+		if ((f = fopen(path, "r")) == NULL)
+			continue;
+		if (fgets(list, sizeof(list), f) != NULL) {
+			parse_cpulist(list, &cpus[n]);
+			if (CPU_COUNT(&cpus[n]) > 0)
+				n++;
+		}
+		fclose(f);
+	}
+	if (n == 0) {
+		sched_getaffinity(0, sizeof(cpus[0]), &cpus[0]);
+		n = 1;
+	}
+	return n;
+}
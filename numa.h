@@ -0,0 +1,10 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include "csapp.h"
+
+int numa_detect(cpu_set_t *cpus, int max);
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ * prefetch.c - fetch the subresources of HTML pages into the cache
+ *
+ * When the miss path caches a 200 text/html page, prefetch_scan pulls
+ * the same-origin stylesheet, script and image URLs out of its body and
+ * queues the ones not cached yet. Worker threads request them through
+ * the proxy's own port with warm_fetch, so they fill the cache by the
+ * normal miss path, like warm-up URLs. The browser asks for them a few
+ * milliseconds after it gets the page, and by then most are cached or
+ * on their way.
+ *
+ * Prefetching must never cost the pages themselves much. The queue is
+ * bounded and a full queue drops links, the worker count bounds origin
+ * fetches in flight, and the bytes fetched are budgeted per second
+ * (the prefetch_bytes setting): once a second's budget is spent, the
+ * workers wait for the next second.
+ */
+#define _GNU_SOURCE
+#include "prefetch.h"
+#include "warm.h"
+#include "cache.h"
+#include "cachekey.h"
+#include "metrics.h"
+#include <time.h>
+
+static char queue[PREFETCH_QUEUE][PREFETCH_URI_LEN];
+static int head, count;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nonempty = PTHREAD_COND_INITIALIZER;
+static int proxy_port;
+static int enabled;
+
+/* Byte budget, guarded by lock */
+static double budget = PREFETCH_BYTES;
+static time_t window;       /* the second spent belongs to */
+static double spent;
+
+/*
+ * Case-insensitive search for s in [p, end), NULL if absent
+ */
+static char *find(char *p, char *end, char *s)
+{
+	size_t n = strlen(s);
+
+	for (; p + n <= end; p++)
+		if (!strncasecmp(p, s, n))
+			return p;
+	return NULL;
+}
+
+/*
+ * Body of a 200 uncompressed text/html response, NULL for anything else
+ */
+static char *html_body(unsigned char *response, size_t size)
+{
+	char *r = (char *)response, *end = r + size, *hdr_end, *line, *eol;
+	int html = 0;
+
+	if (size < 12 || strncmp(r, "HTTP/1.", 7) || memcmp(r + 8, " 200", 4) ||
+		(hdr_end = memmem(r, size, "\r\n\r\n", 4)) == NULL)
+		return NULL;
+	for (line = r; line < hdr_end; line = eol + 2) {
+		if ((eol = memmem(line, end - line, "\r\n", 2)) == NULL)
+			return NULL;
+		if (!strncasecmp(line, "Content-Type:", 13))
+			html = find(line, eol, "text/html") != NULL;
+		else if (!strncasecmp(line, "Content-Encoding:", 17) &&
+			find(line, eol, "identity") == NULL)
+			return NULL;
+	}
+	return html ? hdr_end + 4 : NULL;
+}
+
+/*
+ * Copy the value of attribute name from tag [p, end) to out, decoding
+ * &amp;; 0 if it is absent or does not fit
+ */
+static int attr(char *p, char *end, char *name, char *out, size_t len)
+{
+	size_t n = strlen(name), i = 0;
+	char quote = 0;
+
+	while ((p = find(p, end, name)) != NULL) {
+		/* Whole attribute names only: not data-src or srcset */
+		if (isspace((unsigned char)p[-1]) && p + n < end &&
+			(p[n] == '=' || isspace((unsigned char)p[n])))
+			break;
+		p += n;
+	}
+	if (p == NULL)
+		return 0;
+	for (p += n; p < end && isspace((unsigned char)*p); p++)
+		;
+	if (p == end || *p++ != '=')
+		return 0;
+	for (; p < end && isspace((unsigned char)*p); p++)
+		;
+	if (p < end && (*p == '"' || *p == '\''))
+		quote = *p++;
+	for (; p < end && i + 1 < len; p++) {
+		if (quote ? *p == quote : (isspace((unsigned char)*p) || *p == '>'))
+			break;
+		out[i++] = *p;
+		if (*p == '&' && end - p > 4 && !strncmp(p, "&amp;", 5))
+			p += 4;
+	}
+	out[i] = '\0';
+	return i > 0 && i + 1 < len;
+}
+
+/*
+ * Turn link into an origin-form path on hostname:port, relative to
+ * dir; 0 for other schemes and other origins
+ */
+static int resolve(char *link, char *hostname, char *port, char *dir,
+	char *path, size_t len)
+{
+	char *p, *host, *slash;
+	size_t n;
+
+	if ((p = strchr(link, '#')) != NULL)
+		*p = '\0';
+	if (!strncasecmp(link, "http://", 7) || !strncmp(link, "//", 2)) {
+		host = link + (link[0] == '/' ? 2 : 7);
+		slash = host + strcspn(host, "/?");
+		n = strcspn(host, ":/?");
+		if (n != strlen(hostname) || strncasecmp(host, hostname, n))
+			return 0;
+		if (host[n] == ':' ? ((size_t)(slash - host - n - 1) != strlen(port) ||
+				strncmp(host + n + 1, port, strlen(port))) :
+			strcmp(port, "80"))
+			return 0;
+		return snprintf(path, len, "%s%s", *slash == '/' ? "" : "/",
+			slash) < (int)len;
+	}
+	/* Any other scheme (https:, data:, javascript:) before a '/' */
+	if (link[0] == '\0' || strcspn(link, ":") < strcspn(link, "/?"))
+		return 0;
+	if (link[0] == '/')
+		return snprintf(path, len, "%s", link) < (int)len;
+	return snprintf(path, len, "%s%s", dir, link) < (int)len;
+}
+
+/*
+ * Queue uri unless it is already waiting; drop it if the queue is full
+ */
+static void enqueue(char *uri)
+{
+	int i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < count; i++)
+		if (!strcmp(queue[(head + i) % PREFETCH_QUEUE], uri))
+			break;
+	if (i < count) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	if (count == PREFETCH_QUEUE) {
+		pthread_mutex_unlock(&lock);
+		metrics_inc(M_PREFETCH_DROPPED);
+		return;
+	}
+	strcpy(queue[(head + count++) % PREFETCH_QUEUE], uri);
+	pthread_cond_signal(&nonempty);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * prefetch_scan - queue the uncached same-origin subresources of a page
+ * 		just fetched from hostname:port/path; ignores anything but
+ * 		a 200 text/html response
+ */
+void prefetch_scan(char *hostname, char *port, char *path,
+	unsigned char *response, size_t size)
+{
+	char *p, *end = (char *)response + size, *tag_end, *name;
+	char dir[MAXLINE], link[PREFETCH_URI_LEN], target[MAXLINE];
+	char uri[PREFETCH_URI_LEN], key[MAXLINE];
+	cache_t *cached;
+	int n = 0;
+
+	if (!enabled || (p = html_body(response, size)) == NULL)
+		return;
+
+	/* Relative links resolve against the page's directory */
+	snprintf(dir, sizeof(dir), "%.*s", (int)strcspn(path, "?"), path);
+	if ((name = strrchr(dir, '/')) != NULL)
+		name[1] = '\0';
+	else
+		strcpy(dir, "/");
+
+	for (; n < PREFETCH_PER_PAGE && (p = memchr(p, '<', end - p)) != NULL; p++) {
+		if ((tag_end = memchr(p, '>', end - p)) == NULL)
+			break;
+		if (!strncasecmp(p + 1, "img", 3) && isspace((unsigned char)p[4]))
+			name = "src";
+		else if (!strncasecmp(p + 1, "script", 6) && isspace((unsigned char)p[7]))
+			name = "src";
+		else if (!strncasecmp(p + 1, "link", 4) && isspace((unsigned char)p[5]) &&
+			attr(p, tag_end, "rel", link, sizeof(link)) &&
+			(strcasestr(link, "stylesheet") || strcasestr(link, "icon") ||
+			 strcasestr(link, "preload")))
+			name = "href";
+		else
+			continue;
+		if (!attr(p, tag_end, name, link, sizeof(link)) ||
+			!resolve(link, hostname, port, dir, target, sizeof(target)) ||
+			snprintf(uri, sizeof(uri), "http://%s:%s%s", hostname, port,
+				target) >= (int)sizeof(uri))
+			continue;
+		n++;
+
+		/* Already cached: nothing to do */
+		cachekey_build(hostname, port, target, key);
+		if ((cached = cache_find(key)) != NULL) {
+			cache_release(cached);
+			continue;
+		}
+		enqueue(uri);
+	}
+}
+
+/*
+ * Wait until this second's byte budget has room
+ */
+static void budget_wait()
+{
+	struct timespec ts;
+	time_t now;
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		if ((now = time(NULL)) != window) {
+			window = now;
+			spent = 0;
+		}
+		if (budget <= 0 || spent < budget)
+			break;
+		pthread_mutex_unlock(&lock);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec = 0;
+		ts.tv_nsec = 1000000000 - ts.tv_nsec;
+		nanosleep(&ts, NULL);
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static void *prefetch_worker(void *vargp)
+{
+	char uri[PREFETCH_URI_LEN];
+	long n;
+
+	Pthread_detach(pthread_self());
+	while (1) {
+		pthread_mutex_lock(&lock);
+		while (count == 0)
+			pthread_cond_wait(&nonempty, &lock);
+		strcpy(uri, queue[head]);
+		head = (head + 1) % PREFETCH_QUEUE;
+		count--;
+		pthread_mutex_unlock(&lock);
+
+		budget_wait();
+		if ((n = warm_fetch(proxy_port, uri, NULL)) > 0) {
+			metrics_inc(M_PREFETCHES);
+			metrics_add(M_PREFETCH_BYTES, n);
+			pthread_mutex_lock(&lock);
+			spent += n;
+			pthread_mutex_unlock(&lock);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * prefetch_start - start parallel workers that fetch through the proxy
+ * 		on port; call once it is listening
+ */
+void prefetch_start(int port, int parallel)
+{
+	pthread_t tid;
+	int i;
+
+	proxy_port = port;
+	for (i = 0; i < parallel; i++)
+		Pthread_create(&tid, NULL, prefetch_worker, NULL);
+	enabled = 1;
+}
+
+/*
+ * prefetch_configure - set the byte budget per second, 0 for none
+ */
+void prefetch_configure(double bytes_per_sec)
+{
+	pthread_mutex_lock(&lock);
+	budget = bytes_per_sec;
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,17 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include "csapp.h"
+
+/* Subresource prefetching from HTML pages as they are cached (-p) */
+#define PREFETCH_QUEUE 256          /* URLs waiting; more are dropped */
+#define PREFETCH_PER_PAGE 32        /* links taken from one page */
+#define PREFETCH_URI_LEN 512        /* longer links are skipped */
+#define PREFETCH_BYTES (4 << 20)    /* default bytes/s budget */
+
+void prefetch_start(int port, int parallel);
+void prefetch_configure(double bytes_per_sec);
+void prefetch_scan(char *hostname, char *port, char *path,
+	unsigned char *response, size_t size);
+
+#endif
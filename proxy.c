@@ -2,17 +2,42 @@
  * proxy.c - A simple, concurrent HTTP/1.0 Web proxy that caches recently
  * 		accessed web content.
  * 
- * Implementing Posix threads with Semaphores using first readers-writers 
- * problem idea, which favors readers over writers. Implement a simple LRU
- * policy, update the cache order only before the last write lock to prevent
- * race conditions.
+ * Implementing Posix threads; cache lookups are lock-free with epoch-based
+ * reclamation, writers serialize on a semaphore per cache partition, and
+ * eviction follows the CLOCK approximation of LRU.
  * 
  *
  * Name: Yiting Zhi
  * yzhi@andrew.cmu.edu
  *
  */
+#include "numa.h"
 #include "cache.h"
+#include "breaker.h"
+#include "metrics.h"
+#include "trace.h"
+#include "upstream.h"
+#include "tunnel.h"
+#include "snapshot.h"
+#include "warm.h"
+#include "range.h"
+#include "cachekey.h"
+#include "ratelimit.h"
+#include "config.h"
+#include "upgrade.h"
+#include "uring.h"
+#include "co.h"
+#include "prefetch.h"
+#include "admit.h"
+#include "accesslog.h"
+#include "bigcache.h"
+#include "errpage.h"
+
+/*
+ * Connection threads get a fixed stack: doit's buffers need ~200 KiB,
+ * and the default 8 MiB would cap how many tunnels one box can hold
+ */
+#define THREAD_STACK_SIZE (512 * 1024)
 
 /* Request helper headers*/
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
@@ -21,97 +46,528 @@ static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
 static const char *connection_hdr = "Connection: close\r\n";
 static const char *proxy_con_hdr = "Proxy-Connection: close\r\n";
 
-void doit(int fd);
+/* Cache snapshot written on SIGTERM, NULL if none */
+static char *snapshot_path;
+
+/* Settings file re-read on SIGHUP, NULL if none */
+static char *config_path;
+
+/* Kept for a binary upgrade, which re-execs argv with the same socket */
+static char **saved_argv;
+static int listenfd;
+static int draining;    /* set once a new process has taken over */
+static int accepting = 1;   /* cleared once the accept loop has exited */
+static int live_conns;  /* connections still being served */
+static pthread_t acceptor;  /* the main thread, blocked in accept */
+
+/* Accepted connection handed to a thread */
+typedef struct {
+	int fd;
+	int node;
+	int client;     /* rate limiter slot */
+	uint64_t accept_ns;
+} conn_t;
+
+/*
+ * The miss path of a request (connect, send, stream the response),
+ * split out of doit so that under -C it runs as its own task, which
+ * an idle scheduler can steal; it owns the connection from then on
+ */
+typedef struct {
+	int fd;
+	int client;     /* rate limiter slot */
+	rio_t rio;      /* client side, for a request body not yet read */
+	trace_rec_t *tr;    /* &trace, or NULL when not tracing */
+	trace_rec_t trace;
+	int cacheable, ranged;
+	int warm;       /* warm-up or prefetch: skip the admission filter */
+	long first, last;
+	char range[MAXLINE];    /* the client's Range lines, for range_reissue */
+	char request[MAXLINE], hostname[MAXLINE], port[MAXLINE];
+	char path[MAXLINE], key[MAXLINE], lookup[MAXLINE];
+} fetch_t;
+
+int doit(int fd);
+void fetch(void *vargp);
+void conn_close(int fd);
+static void miss(fetch_t *f);
+static ssize_t range_reissue(fetch_t *f, int *status);
+void do_tunnel(int fd, rio_t *rp, char *uri, trace_rec_t *tr);
+int forward_body(rio_t *rp, int serverfd, char *request);
+int serve_stale(int fd, char *uri, trace_rec_t *tr);
+static int stale_usable(char *uri);
+static uint32_t peer_addr(int fd);
+static int peer_local(int fd);
+static unsigned char *cache_copyout(cache_t *cache, unsigned char *small,
+	size_t *size);
+static char *header_value(char *headers, char *name);
+static void header_remove(char *headers, char *name);
+static int response_status(unsigned char *response, size_t size);
+static bigcache_t *large_begin(fetch_t *f, unsigned char *response,
+	size_t size);
+void serve(void *vargp);
 void *thread(void *vargp);
+void *signal_thread(void *vargp);
+static void wake_acceptor(int sig);
+static void stop_accepting();
+void usage(char *prog);
 void generate_request(rio_t *rp, char *request);
 void parse_uri(char *uri, char *hostname, char *port, char *path);
 void build_header(char *buf, char *request);
-void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
 
 int main(int argc, char **argv)
 {
-	int listenfd, *connfdp, port;
+	int port, inherited;
+	conn_t *conn;
 	socklen_t clientlen = sizeof(struct sockaddr_in);
 	struct sockaddr_in clientaddr;
 	pthread_t tid;
+	pthread_attr_t attr[CACHE_MAX_NODES];
+	cpu_set_t node_cpus[CACHE_MAX_NODES];
+	sigset_t sigs;
+	struct sigaction wake_action;
+	char *warm_list = NULL, *shm_name = NULL, *log_path = NULL;
+	int opt, tracing = 0, warm_parallel = WARM_PARALLEL, n;
+	int numa = 0, nodes = 1, next_node = 0, uring = 0;
+	int coroutines = 0, nscheds = 0, next_sched = 0, prefetch = 0;
+	int admission = 0;
+	double rps = 0, bps = 0;
+	size_t large = 0;
 
 	/* Check command line args */
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s <port>\n", argv[0]);
-		exit(1);
+	while ((opt = getopt(argc, argv, "NTUCAs:S:w:W:p:r:b:c:l:L:")) != -1) {
+		switch (opt) {
+		case 'N':
+			numa = 1;
+			break;
+		case 'T':
+			tracing = 1;
+			break;
+		case 'U':
+			uring = 1;
+			break;
+		case 'C':
+			coroutines = 1;
+			break;
+		case 'A':
+			admission = 1;
+			break;
+		case 's':
+			snapshot_path = optarg;
+			break;
+		case 'S':
+			shm_name = optarg;
+			break;
+		case 'w':
+			warm_list = optarg;
+			break;
+		case 'W':
+			warm_parallel = atoi(optarg);
+			break;
+		case 'p':
+			prefetch = atoi(optarg);
+			break;
+		case 'r':
+			rps = atof(optarg);
+			break;
+		case 'b':
+			bps = atof(optarg);
+			break;
+		case 'c':
+			config_path = optarg;
+			break;
+		case 'l':
+			log_path = optarg;
+			break;
+		case 'L':
+			large = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
 	}
-	port = atoi(argv[1]);
+	if (optind != argc - 1)
+		usage(argv[0]);
+	port = atoi(argv[optind]);
+	saved_argv = argv;
 
 	/* Handle sigpipe error */
 	Signal(SIGPIPE, SIG_IGN);
 
+	/* Leave these to signal_thread; threads inherit the mask */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	/* One cache partition and one pinned thread pool per NUMA node */
+	if (numa) {
+		nodes = numa_detect(node_cpus, CACHE_MAX_NODES);
+		fprintf(stderr, "NUMA mode: %d node(s)\n", nodes);
+	}
+
 	/* Initialize cache header, cache size, reader/writer mutex */
-	cache_init();
+	cache_init(nodes);
+	metrics_init();
+	/* The access log is fed from the trace records */
+	if (log_path && accesslog_open(log_path) < 0) {
+		fprintf(stderr, "cannot open access log %s: %s\n", log_path,
+			strerror(errno));
+		exit(1);
+	}
+	trace_init(tracing || log_path, tracing);
+	breaker_init();
+	cachekey_init();
+	warm_init();
+	errpage_init();
+	ratelimit_init(rps, bps);
+	admit_init(admission);
+
+	/* The config file, if any, overrides the command line */
+	config.rate = rps;
+	config.byte_rate = bps;
+	config.large_cache_size = large;
+	if (config_path && config_load(config_path) < 0) {
+		fprintf(stderr, "cannot load config %s\n", config_path);
+		exit(1);
+	}
+	config_apply();
+
+	/* Share one cache with every other proxy started with this name */
+	if (shm_name && cache_share(shm_name, config.cache_size) < 0) {
+		fprintf(stderr, "cannot attach shared cache %s: %s\n", shm_name,
+			strerror(errno));
+		exit(1);
+	}
+
+	/* Started by an upgrade: take the old process's socket and cache */
+	if ((inherited = upgrade_inherit(&listenfd, &n)))
+		fprintf(stderr, "upgrade: took over the listening socket, "
+			"restored %d objects\n", n);
+	else if (snapshot_path && (n = snapshot_load(snapshot_path)) >= 0)
+		fprintf(stderr, "restored %d objects from %s\n", n, snapshot_path);
+	/* Exits interrupt accept with UPGRADE_WAKE_SIG; no SA_RESTART */
+	acceptor = pthread_self();
+	memset(&wake_action, 0, sizeof(wake_action));
+	wake_action.sa_handler = wake_acceptor;
+	sigemptyset(&wake_action.sa_mask);
+	sigaction(UPGRADE_WAKE_SIG, &wake_action, NULL);
+	Pthread_create(&tid, NULL, signal_thread, NULL);
+
+	for (n = 0; n < nodes; n++) {
+		pthread_attr_init(&attr[n]);
+		pthread_attr_setstacksize(&attr[n], THREAD_STACK_SIZE);
+		if (numa)
+			pthread_attr_setaffinity_np(&attr[n], sizeof(cpu_set_t),
+				&node_cpus[n]);
+	}
+
+	/* One coroutine scheduler per core, spread over the nodes */
+	if (coroutines) {
+		nscheds = sysconf(_SC_NPROCESSORS_ONLN);
+		co_start(nscheds, attr, nodes);
+	}
 
 	/* Open a socket listener */
-	listenfd = Open_listenfd(port);
+	if (!inherited)
+		listenfd = Open_listenfd(port);
+	if (uring && uring_accept_start(listenfd) < 0)
+		fprintf(stderr, "io_uring unavailable (%s), using blocking I/O\n",
+			strerror(errno));
+	if (warm_list)
+		warm_start(warm_list, port, warm_parallel);
+	if (prefetch > 0)
+		prefetch_start(port, prefetch);
+
+	while (uring_enabled() || !__atomic_load_n(&draining, __ATOMIC_RELAXED)) {
+		conn = (conn_t *) Malloc(sizeof(conn_t));
+		if (!uring_enabled()) {
+			if ((conn->fd = accept(listenfd, (SA *)&clientaddr,
+				&clientlen)) < 0) {
+				Free(conn);
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				unix_error("Accept error");
+			}
+		}
+		else if ((conn->fd = uring_accept(&clientaddr)) < 0) {
+			/* Handed over and every armed accept is finished */
+			Free(conn);
+			break;
+		}
+		conn->accept_ns = metrics_now();
+		/* Spread connections over the nodes (or schedulers) round-robin */
+		if (coroutines) {
+			conn->node = next_sched % nodes;
+			fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+		}
+		else {
+			conn->node = next_node;
+			next_node = (next_node + 1) % nodes;
+		}
+		metrics_inc(M_CONN_ACCEPTED);
+		/*
+		 * Over-limit clients get a 429 before a thread is spent on them;
+		 * our own warm-up and prefetch fetches are not limited
+		 */
+		if (warm_peer(&clientaddr))
+			conn->client = -1;
+		else if ((conn->client = ratelimit_accept(clientaddr.sin_addr)) < 0) {
+			ratelimit_reject(conn->fd);
+			Close(conn->fd);
+			Free(conn);
+			metrics_inc(M_CONN_CLOSED);
+			continue;
+		}
+		__atomic_add_fetch(&live_conns, 1, __ATOMIC_RELAXED);
+		if (coroutines) {
+			co_spawn(next_sched, serve, conn);
+			next_sched = (next_sched + 1) % nscheds;
+		}
+		else
+			Pthread_create(&tid, &attr[conn->node], thread, conn);
+	}
+	/* Stopped: workers finish while signal_thread drains or exits */
+	__atomic_store_n(&accepting, 0, __ATOMIC_RELEASE);
+	pthread_exit(NULL);
+}
+
+/*
+ * wake_acceptor - UPGRADE_WAKE_SIG handler; only there to make the
+ * 		main thread's accept return EINTR
+ */
+static void wake_acceptor(int sig)
+{
+}
+
+/*
+ * stop_accepting - get the main thread out of its accept loop, then
+ * 		tear down the io_uring listener, whose armed accepts and
+ * 		registered socket would otherwise outlive the process
+ */
+static void stop_accepting()
+{
+	__atomic_store_n(&draining, 1, __ATOMIC_RELAXED);
+	uring_accept_stop();
+	/*
+	 * A signal sent just before the loop blocks in accept again is
+	 * missed, so keep sending until it is out
+	 */
+	while (__atomic_load_n(&accepting, __ATOMIC_ACQUIRE)) {
+		if (!uring_enabled())
+			pthread_kill(acceptor, UPGRADE_WAKE_SIG);
+		usleep(1000);
+	}
+	uring_accept_close();
+}
+
+void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-N] [-T] [-U] [-C] [-A] [-s snapshot]\n"
+		"       [-S shmname] [-w urllist] [-W parallel] [-p parallel]\n"
+		"       [-r reqs/s] [-b bytes/s] [-c config] [-l accesslog]\n"
+		"       [-L largebytes] <port>\n",
+		prog);
+	exit(1);
+}
+
+/*
+ * signal_thread - SIGHUP reloads the config, SIGUSR2 hands over to a
+ * 		new binary and drains, SIGTERM/SIGINT save the cache and exit
+ */
+void *signal_thread(void *vargp)
+{
+	sigset_t sigs;
+	uint64_t deadline;
+	int sig;
+
+	Pthread_detach(pthread_self());
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGUSR2);
 	while (1) {
-		connfdp = (int *) Malloc(sizeof(int));
-		*connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-		Pthread_create(&tid, NULL, thread, connfdp);
+		if (sigwait(&sigs, &sig) != 0)
+			continue;
+		if (sig == SIGHUP) {
+			accesslog_reopen();
+			if (config_path == NULL)
+				fprintf(stderr, "SIGHUP: no config file to reload\n");
+			else if (config_load(config_path) < 0)
+				fprintf(stderr, "SIGHUP: cannot load %s, keeping the old "
+					"settings\n", config_path);
+			else {
+				config_apply();
+				fprintf(stderr, "reloaded %s\n", config_path);
+			}
+			continue;
+		}
+		if (sig == SIGUSR2) {
+			if (upgrade_start(listenfd, saved_argv) < 0) {
+				fprintf(stderr, "upgrade failed, still serving\n");
+				continue;
+			}
+			/* The new process owns the socket and the snapshot now */
+			fprintf(stderr, "upgrade: new process is serving, draining\n");
+			/*
+			 * Count what is left only once the accept loop is out:
+			 * a connection it took after the count would be reset
+			 * by exit
+			 */
+			stop_accepting();
+			deadline = metrics_now() + UPGRADE_DRAIN_MS * 1000000ull;
+			while (__atomic_load_n(&live_conns, __ATOMIC_RELAXED) > 0 &&
+				metrics_now() < deadline)
+				usleep(10000);
+			accesslog_flush();
+			exit(0);
+		}
+		break;
 	}
-    return 0;
+	stop_accepting();
+	if (snapshot_path) {
+		if (snapshot_save(snapshot_path) < 0)
+			fprintf(stderr, "snapshot to %s failed: %s\n", snapshot_path,
+				strerror(errno));
+		else
+			fprintf(stderr, "saved cache to %s\n", snapshot_path);
+	}
+	accesslog_flush();
+	exit(0);
 }
 
 /*
  * Thread routine
  */
+/*
+ * serve - handle one accepted connection, on its own thread or as a
+ * 		coroutine
+ */
+void serve(void *vargp)
+{
+	conn_t *conn = (conn_t *)vargp;
+	int connfd = conn->fd;
+	cache_node = conn->node;
+	rate_client = conn->client;
+	/* Time from accept until a thread picks the connection up */
+	metrics_since(H_ACCEPT, conn->accept_ns);
+	Free(vargp);
+	if (!doit(connfd))
+		conn_close(connfd);
+}
+
+/*
+ * conn_close - finish with a connection once its response is sent
+ */
+void conn_close(int fd)
+{
+	Close(fd);
+	ratelimit_close(rate_client);
+	__atomic_sub_fetch(&live_conns, 1, __ATOMIC_RELAXED);
+	metrics_inc(M_CONN_CLOSED);
+}
+
 void *thread(void *vargp)
 {
-	int connfd = *((int *)vargp);
 	Pthread_detach(pthread_self());
-	Free(vargp);
-	doit(connfd);
-	Close(connfd);
+	serve(vargp);
 	return NULL;
 }
 
 /*
- * doit - handle one HTTP request/response transaction
+ * doit - handle one HTTP request/response transaction; returns 1 if a
+ * 		miss fetch took the connection over (and will close it)
  */
-void doit(int fd)
+int doit(int fd)
 {
 	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char request[MAXLINE], hostname[MAXLINE], port[MAXLINE], path[MAXLINE];
-    unsigned char response[MAX_OBJECT_SIZE];
+    char key[MAXLINE], lookup[MAXLINE], range[MAXLINE];
     rio_t rio;
     cache_t *cache;
-    int clientfd;
-    size_t n, filesize;
+    bigcache_t *big;
+    trace_rec_t trace, *tr;
+    fetch_t *f;
+    int cacheable, ranged, warm;
+    long first, last;
+    char *value;
+    unsigned char small[CACHE_INLINE_MAX], *body;
+    size_t n, size;
+    ssize_t sent;
+    uint64_t start;
   
     /* Read request line and headers */
+    start = metrics_now();
+    tr = TRACE_BEGIN(&trace);
     Rio_readinitb(&rio, fd);
     Rio_readlineb(&rio, buf, MAXLINE);
+    TRACE_MARK(tr, TR_READ);
 
     /* Read the first line to get method, uri and version */
     sscanf(buf, "%s %s %s", method, uri, version);
+    start = metrics_since(H_PARSE, start);
+    metrics_inc(M_REQUESTS);
+    if (tr) {
+        strncpy(tr->uri, uri, TRACE_URI_LEN - 1);
+        tr->client = peer_addr(fd);
+        TRACE_MARK(tr, TR_PARSE);
+    }
 
-    /* Handle error when method is not GET */
-    if (strcasecmp(method, "GET")) { 
-       clienterror(fd, method, "501", "Not Implemented",
-                "Tiny does not implement this method");
-        return;
+    /* CONNECT opens a raw tunnel to the origin */
+    if (!strcasecmp(method, "CONNECT")) {
+        do_tunnel(fd, &rio, uri, tr);
+        TRACE_END(tr);
+        return 0;
     }
 
-    /* Find the uri to see if it is in the cache */
-    if ((cache = cache_find(uri)) != NULL) {
-    	Rio_writen(fd, cache->content, cache->size);
-    	return;
+    /* Only GET responses are cacheable; POST and PUT stream through */
+    cacheable = !strcasecmp(method, "GET");
+    if (!cacheable && strcasecmp(method, "POST") && strcasecmp(method, "PUT")) {
+        errpage_send(fd, 501);
+        TRACE_SET(tr, status, 501);
+        TRACE_END(tr);
+        return 0;
+    }
+
+    /* Reserved URIs for the metrics scrape and the trace dump */
+    if (!strcmp(uri, METRICS_URI)) {
+        if (!peer_local(fd)) {
+            errpage_send(fd, 403);
+            TRACE_SET(tr, status, 403);
+            TRACE_END(tr);
+            return 0;
+        }
+        metrics_serve(fd);
+        TRACE_SET(tr, status, 200);
+        TRACE_END(tr);
+        return 0;
+    }
+    if (!strcmp(uri, TRACE_URI)) {
+        /* Other clients' addresses and URIs: never off this host */
+        if (!peer_local(fd)) {
+            errpage_send(fd, 403);
+            TRACE_SET(tr, status, 403);
+            TRACE_END(tr);
+            return 0;
+        }
+        trace_serve(fd);
+        TRACE_SET(tr, status, 200);
+        TRACE_END(tr);
+        return 0;
     }
 
     /* Parse uri to get hostname, port and path */
     parse_uri(uri, hostname, port, path);
 
     /* If hostname doesn't exist throw error */
-    if (hostname == NULL) {
-        clienterror(fd, "hostname", "400", "Bad Request",
-            "The request cannot be fulfilled due to bad syntax");
-        return;
+    if (hostname[0] == '\0') {
+        errpage_send(fd, 400);
+        TRACE_SET(tr, status, 400);
+        TRACE_END(tr);
+        return 0;
     }
 
     /* put method and path to the request */
@@ -120,6 +576,33 @@ void doit(int fd)
     /* generate a http request */
     generate_request(&rio, request);
 
+    /*
+     * A single byte range on a GET is answered from the full object:
+     * the origin is asked for the whole thing so it can be cached once,
+     * and for just the range again if it turns out too big for that.
+     * If-Range makes the range conditional, so such requests just get
+     * the full object.
+     */
+    ranged = 0;
+    range[0] = '\0';
+    if (cacheable && (value = header_value(request, "Range")) != NULL) {
+        ranged = !header_value(request, "If-Range") &&
+            range_parse(value, &first, &last);
+        sprintf(range, "Range: %.*s\r\n", (int)strcspn(value, "\r\n"), value);
+        if ((value = header_value(request, "If-Range")) != NULL)
+            sprintf(range + strlen(range), "If-Range: %.*s\r\n",
+                (int)strcspn(value, "\r\n"), value);
+        header_remove(request, "Range");
+        header_remove(request, "If-Range");
+    }
+
+    /* Our own warm-up and prefetch requests, which clients cannot forge */
+    warm = 0;
+    if ((value = header_value(request, WARM_HDR)) != NULL) {
+        warm = warm_check(value, peer_addr(fd));
+        header_remove(request, WARM_HDR);
+    }
+
     /* Attach host to browser */
     if (!strstr(request, "Host: ")) {
         sprintf(request, "%sHost: %s\r\n", request, hostname);
@@ -128,37 +611,638 @@ void doit(int fd)
     /* Put and ending to the request */
     sprintf(request, "%s\r\n", request);
 
+    /* Equivalent URIs share a key; Vary'd responses get a variant key */
+    cachekey_build(hostname, port, path, key);
+    cachekey_variant(key, request, lookup);
+
+    /* Find the uri to see if it is in the cache */
+    start = metrics_now();
+    cache = cacheable ? cache_find(lookup) : NULL;
+    metrics_since(H_CACHE_LOOKUP, start);
+    TRACE_MARK(tr, TR_CACHE);
+    if (cache != NULL) {
+    	metrics_inc(M_CACHE_HITS);
+    	body = cache_copyout(cache, small, &size);
+    	if (ranged && (sent = range_send(fd, body, size, first, last)) != 0) {
+    		metrics_inc(M_RANGE_HITS);
+    		n = sent > 0 ? sent : 0;
+    		TRACE_SET(tr, status, 206);
+    	}
+    	else {
+    		Rio_writen(fd, body, size);
+    		n = size;
+    		TRACE_SET(tr, status, response_status(body, n));
+    	}
+    	if (body != small)
+    		Free(body);
+    	TRACE_SET(tr, cache, TR_HIT);
+    	TRACE_SET(tr, bytes, n);
+    	metrics_add(M_BYTES_CLIENT, n);
+    	ratelimit_bytes(n);
+    	TRACE_MARK(tr, TR_LAST_BYTE);
+    	TRACE_END(tr);
+    	return 0;
+    }
+
+    /* Large objects are sent from their chunks, following a fill */
+    if (cacheable && (big = bigcache_find(lookup)) != NULL) {
+    	metrics_inc(M_CACHE_HITS);
+    	metrics_inc(M_LARGE_HITS);
+    	if (ranged && (sent = bigcache_send_range(big, fd, first, last)) != 0) {
+    		metrics_inc(M_RANGE_HITS);
+    		TRACE_SET(tr, status, 206);
+    	}
+    	else {
+    		sent = bigcache_send(big, fd);
+    		TRACE_SET(tr, status, 200);
+    	}
+    	bigcache_release(big);
+    	n = sent > 0 ? sent : 0;
+    	metrics_add(M_BYTES_CLIENT, n);
+    	ratelimit_bytes(n);
+    	TRACE_SET(tr, cache, TR_HIT);
+    	TRACE_SET(tr, bytes, n);
+    	TRACE_MARK(tr, TR_LAST_BYTE);
+    	TRACE_END(tr);
+    	return 0;
+    }
+    metrics_inc(M_CACHE_MISSES);
+    TRACE_SET(tr, cache, cacheable ? TR_MISS : TR_NOCACHE);
+
+    /* Fail fast while the origin's breaker is open */
+    if (!breaker_allow(hostname, port)) {
+        metrics_inc(M_BREAKER_REJECTS);
+        if (!cacheable || !serve_stale(fd, lookup, tr)) {
+            errpage_send(fd, 503);
+            TRACE_SET(tr, status, 503);
+        }
+        TRACE_END(tr);
+        return 0;
+    }
+
+    /* Hand the rest to a fetch task; rio's buffer moves with it */
+    f = (fetch_t *)Malloc(sizeof(fetch_t));
+    f->fd = fd;
+    f->client = rate_client;
+    f->rio = rio;
+    f->rio.rio_bufptr = f->rio.rio_buf + (rio.rio_bufptr - rio.rio_buf);
+    /* The record moves with the request, out of this frame */
+    if (tr) {
+        f->trace = *tr;
+        f->tr = &f->trace;
+    }
+    else
+        f->tr = NULL;
+    f->cacheable = cacheable;
+    f->ranged = ranged;
+    f->warm = warm;
+    f->first = first;
+    f->last = last;
+    strcpy(f->range, range);
+    strcpy(f->request, request);
+    strcpy(f->hostname, hostname);
+    strcpy(f->port, port);
+    strcpy(f->path, path);
+    strcpy(f->key, key);
+    strcpy(f->lookup, lookup);
+    co_submit(fetch, f);
+    return 1;
+}
+
+/*
+ * fetch - run a miss handed off by doit, then close its connection
+ */
+void fetch(void *vargp)
+{
+    fetch_t *f = (fetch_t *)vargp;
+
+    rate_client = f->client;
+    miss(f);
+    conn_close(f->fd);
+    Free(f);
+}
+
+/*
+ * miss - fetch from the origin, stream the response to the client and
+ * 		cache it
+ */
+static void miss(fetch_t *f)
+{
+    int fd = f->fd, cacheable = f->cacheable, ranged = f->ranged;
+    char *request = f->request, *hostname = f->hostname, *port = f->port;
+    char *key = f->key, *lookup = f->lookup;
+    long first = f->first, last = f->last;
+    trace_rec_t *tr = f->tr;
+    char buf[MAXLINE];
+    unsigned char response[MAX_OBJECT_SIZE];
+    rio_t rio;
+    struct addrinfo *addrs;
+    bigcache_t *big = NULL;
+    int clientfd, held, reissue, status;
+    size_t n, filesize, hlen;
+    long clen;
+    ssize_t sent;
+    time_t expires;
+    uint64_t start, ttfb;
+
+    /* Wait for this client's turn at an upstream fetch slot */
+    ratelimit_fetch_begin();
+
     /* Write to server*/
-    clientfd = open_clientfd_r(hostname, atoi(port));
+    start = metrics_now();
+    clientfd = -1;
+    status = 502;
+    if (upstream_resolve(hostname, port, &addrs) == 0) {
+        TRACE_MARK(tr, TR_DNS);
+        clientfd = upstream_connect_send(addrs, request, strlen(request));
+        if (clientfd == -1 && errno == ETIMEDOUT)
+            status = 504;
+        freeaddrinfo(addrs);
+        TRACE_MARK(tr, TR_CONNECT);
+    }
+    start = metrics_since(H_CONNECT, start);
     if (clientfd == -1) {
-    	clienterror(fd, hostname, "500", "Internal Server Error",
-    		"The server you requested cannot respond at this time");
+    	breaker_report(hostname, port, 0);
+    	if (!cacheable || !serve_stale(fd, lookup, tr)) {
+    		errpage_send(fd, status);
+    		TRACE_SET(tr, status, status);
+    	}
+    	ratelimit_fetch_end();
+    	TRACE_END(tr);
     	return;
     }
-    Rio_writen(clientfd, request, strlen(request));
+
+    /* Stream any request body straight through to the origin */
+    if (!cacheable && forward_body(&f->rio, clientfd, request) < 0) {
+        breaker_report(hostname, port, 1);
+        errpage_send(fd, 400);
+        TRACE_SET(tr, status, 400);
+        Close(clientfd);
+        ratelimit_fetch_end();
+        TRACE_END(tr);
+        return;
+    }
 
     /* Send response back */
     Rio_readinitb(&rio, clientfd);
 
     filesize = 0;
+    ttfb = 0;
+    held = f->range[0] != '\0';
+    reissue = 0;
+    hlen = 0;
+    clen = 0;
     /* Read the input line by line and count the filezie */
     while ((n = Rio_readlineb(&rio, buf, MAXLINE)) != 0) {
-        Rio_writen(fd, buf, n);       
+        if (!ttfb) {
+            ttfb = metrics_since(H_TTFB, start);
+            TRACE_MARK(tr, TR_FIRST_BYTE);
+        }
+        /*
+         * A ranged miss is held back until we know it fits the cache;
+         * if it does not, the origin is asked for just the range
+         */
+        if (held && !hlen) {
+            if (!strncasecmp(buf, "Content-Length:", 15))
+                clen = atol(buf + 15);
+            else if (!strcmp(buf, "\r\n"))
+                hlen = filesize + n;
+        }
+        if (held && (filesize + n > MAX_OBJECT_SIZE ||
+            (hlen && hlen + clen > MAX_OBJECT_SIZE))) {
+            reissue = 1;
+            break;
+        }
+        if (!held)
+            Rio_writen(fd, buf, n);
         if (filesize + n <= MAX_OBJECT_SIZE) {
-        	size_t i;
-        	for (i = 0; i < n; i++) {
-        		response[i + filesize] = buf[i];
-        	}
+        	memcpy(response + filesize, buf, n);
+        }
+        /* Too big for the cache: fill the large-object store instead */
+        else if (filesize <= MAX_OBJECT_SIZE &&
+        	(big = large_begin(f, response, filesize)) != NULL &&
+        	bigcache_append(big, response, filesize) < 0) {
+        	bigcache_finish(big);
+        	big = NULL;
+        }
+        if (big && filesize + n > MAX_OBJECT_SIZE &&
+        	bigcache_append(big, buf, n) < 0) {
+        	bigcache_finish(big);
+        	big = NULL;
         }
         filesize += n;
+        ratelimit_fetch_bytes(n);
     }
+    /* Complete only if the response ran to its Content-Length */
+    if (big)
+        bigcache_finish(big);
+    if (reissue) {
+        Close(clientfd);
+        metrics_add(M_BYTES_UPSTREAM, filesize);
+        if ((sent = range_reissue(f, &status)) < 0 &&
+            (!cacheable || !serve_stale(fd, lookup, tr))) {
+            errpage_send(fd, status);
+            TRACE_SET(tr, status, status);
+        }
+        else if (sent >= 0) {
+            TRACE_SET(tr, status, status);
+            TRACE_SET(tr, bytes, sent);
+        }
+        TRACE_MARK(tr, TR_LAST_BYTE);
+        breaker_report(hostname, port, sent > 0);
+        ratelimit_fetch_end();
+        TRACE_END(tr);
+        return;
+    }
+    status = response_status(response, filesize);
+    TRACE_SET(tr, status, status);
+    TRACE_SET(tr, bytes, filesize);
+    if (held && ranged &&
+        (sent = range_send(fd, response, filesize, first, last)) != 0) {
+        TRACE_SET(tr, status, 206);
+        TRACE_SET(tr, bytes, sent > 0 ? sent : 0);
+    }
+    else if (held)
+        Rio_writen(fd, response, filesize);
+    if (ttfb)
+        metrics_since(H_TRANSFER, ttfb);
+    TRACE_MARK(tr, TR_LAST_BYTE);
+    breaker_report(hostname, port, filesize > 0);
+    metrics_add(M_BYTES_UPSTREAM, filesize);
+    metrics_add(M_BYTES_CLIENT, filesize);
 
     /* If size doesn't exceed max size, cache it to the memory */
-    if (filesize <= MAX_OBJECT_SIZE) {
-    	cache_store(filesize, uri, response);
+    if (cacheable && filesize <= MAX_OBJECT_SIZE) {
+    	/* Errors only briefly; a 206 must never stand in for the object */
+    	if ((expires = cache_expiry(status, response, filesize)) >= 0 &&
+    		status != 206 &&
+    		cachekey_learn(key, request, response, filesize, lookup)) {
+    		/* With -A, only a second miss within the window is stored */
+    		if ((f->warm || admit_check(lookup)) &&
+    			(status < 500 || !stale_usable(lookup))) {
+    			cache_store(filesize, lookup, response, expires);
+    			if (status >= 400)
+    				metrics_inc(M_CACHE_ERROR_STORES);
+    		}
+    		/* Its subresources are likely the next misses */
+    		prefetch_scan(hostname, port, f->path, response, filesize);
+    	}
     } 
+    /* A successful write makes any cached copy out of date */
+    else if (!cacheable && status >= 200 && status < 400) {
+    	cache_remove(key);
+    	if (strcmp(lookup, key))
+    		cache_remove(lookup);
+    }
 
     Close(clientfd);
+    ratelimit_fetch_end();
+    TRACE_END(tr);
+}
+
+/*
+ * range_reissue - ask the origin again for a ranged miss that is too big
+ * 		to cache, with the client's Range lines this time, and relay
+ * 		its answer; bytes sent, or -1 with the status to fail with
+ */
+static ssize_t range_reissue(fetch_t *f, int *status)
+{
+    char request[2 * MAXLINE], buf[MAXLINE];
+    struct addrinfo *addrs;
+    rio_t rio;
+    int clientfd;
+    size_t n, len;
+    ssize_t sent = 0;
+
+    /* The client's Range lines go before the blank line */
+    len = strlen(f->request) - 2;
+    sprintf(request, "%.*s%s\r\n", (int)len, f->request, f->range);
+
+    *status = 502;
+    if (upstream_resolve(f->hostname, f->port, &addrs) != 0)
+        return -1;
+    clientfd = upstream_connect_send(addrs, request, strlen(request));
+    if (clientfd == -1 && errno == ETIMEDOUT)
+        *status = 504;
+    freeaddrinfo(addrs);
+    if (clientfd == -1)
+        return -1;
+
+    Rio_readinitb(&rio, clientfd);
+    while ((n = Rio_readlineb(&rio, buf, MAXLINE)) != 0) {
+        if (sent == 0)
+            *status = response_status((unsigned char *)buf, n);
+        Rio_writen(f->fd, buf, n);
+        sent += n;
+        ratelimit_fetch_bytes(n);
+    }
+    Close(clientfd);
+    metrics_add(M_BYTES_UPSTREAM, sent);
+    metrics_add(M_BYTES_CLIENT, sent);
+    return sent > 0 ? sent : -1;
+}
+
+/*
+ * header_value - find "name:" at the start of a line in headers,
+ * 		return a pointer to its value or NULL
+ */
+static char *header_value(char *headers, char *name)
+{
+    size_t len = strlen(name);
+    char *line;
+
+    for (line = headers; line && *line; line = strstr(line, "\n")) {
+        if (*line == '\n')
+            line++;
+        if (!strncasecmp(line, name, len) && line[len] == ':') {
+            line += len + 1;
+            while (*line == ' ' || *line == '\t')
+                line++;
+            return line;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * header_remove - delete every "name:" line from headers in place
+ */
+static void header_remove(char *headers, char *name)
+{
+    size_t len = strlen(name);
+    char *line = headers, *eol;
+
+    while (line && *line) {
+        if (!strncasecmp(line, name, len) && line[len] == ':') {
+            eol = strstr(line, "\n");
+            memmove(line, eol ? eol + 1 : line + strlen(line),
+                strlen(eol ? eol + 1 : line + strlen(line)) + 1);
+            continue;
+        }
+        if ((line = strstr(line, "\n")) != NULL)
+            line++;
+    }
+}
+
+/*
+ * large_begin - start a large-object store fill for a miss that just
+ * 		outgrew MAX_OBJECT_SIZE, from its first size bytes; NULL if
+ * 		it is not to be stored
+ */
+static bigcache_t *large_begin(fetch_t *f, unsigned char *response,
+	size_t size)
+{
+    char headers[MAXBUF], *end, *value;
+    size_t len;
+    long body;
+    time_t expires;
+
+    if (!f->cacheable || !bigcache_enabled() ||
+        response_status(response, size) != 200)
+        return NULL;
+    /* Only a Content-Length tells a complete fill from a cut one */
+    if ((end = memmem(response, size, "\r\n\r\n", 4)) == NULL ||
+        (len = end + 4 - (char *)response) >= sizeof(headers))
+        return NULL;
+    memcpy(headers, response, len);
+    headers[len] = '\0';
+    if ((value = header_value(headers, "Content-Length")) == NULL ||
+        (body = atol(value)) <= 0)
+        return NULL;
+    /* Large objects go stale on the same headers as small ones */
+    if ((expires = cache_expiry(200, response, size)) < 0)
+        return NULL;
+    if (!cachekey_learn(f->key, f->request, response, size, f->lookup) ||
+        !(f->warm || admit_check(f->lookup)))
+        return NULL;
+    return bigcache_begin(f->lookup, len + body, expires);
+}
+
+/*
+ * response_status - status code on a response's status line, 0 if it
+ * 		has none
+ */
+static int response_status(unsigned char *response, size_t size)
+{
+    int status;
+
+    if (size > 12 && sscanf((char *)response, "HTTP/%*s %d", &status) == 1)
+        return status;
+    return 0;
+}
+
+
+/*
+ * forward_body - relay the request body framed by Content-Length or
+ * 		chunked encoding, in fixed-size pieces; -1 on error
+ */
+int forward_body(rio_t *rp, int serverfd, char *request)
+{
+    char buf[MAXBUF], *value;
+    long len, chunk;
+    ssize_t n;
+
+    if ((value = header_value(request, "Transfer-Encoding")) != NULL &&
+        !strncasecmp(value, "chunked", 7)) {
+        /* Copy chunk-size lines and data verbatim until the last chunk */
+        while (1) {
+            if ((n = rio_readlineb(rp, buf, MAXBUF)) <= 0 ||
+                rio_writen(serverfd, buf, n) < 0)
+                return -1;
+            if ((chunk = strtol(buf, NULL, 16)) <= 0)
+                break;
+            chunk += 2; /* trailing CRLF */
+            while (chunk > 0) {
+                n = rio_readnb(rp, buf, chunk < MAXBUF ? chunk : MAXBUF);
+                if (n <= 0 || rio_writen(serverfd, buf, n) < 0)
+                    return -1;
+                chunk -= n;
+            }
+        }
+        /* Trailers end with an empty line */
+        do {
+            if ((n = rio_readlineb(rp, buf, MAXBUF)) <= 0 ||
+                rio_writen(serverfd, buf, n) < 0)
+                return -1;
+        } while (strcmp(buf, "\r\n"));
+        return 0;
+    }
+
+    if ((value = header_value(request, "Content-Length")) == NULL)
+        return 0;
+    if ((len = atol(value)) <= 0)
+        return len < 0 ? -1 : 0;
+
+    /* Flush what Rio already buffered, then splice the rest */
+    n = rp->rio_cnt < len ? rp->rio_cnt : len;
+    if (n > 0) {
+        if (rio_writen(serverfd, rp->rio_bufptr, n) < 0)
+            return -1;
+        rp->rio_bufptr += n;
+        rp->rio_cnt -= n;
+        len -= n;
+    }
+    if (len > 0 && tunnel_splice(rp->rio_fd, serverfd, len) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * do_tunnel - handle CONNECT host:port by relaying raw bytes both ways
+ */
+void do_tunnel(int fd, rio_t *rp, char *uri, trace_rec_t *tr)
+{
+    char buf[MAXLINE], hostname[MAXLINE], port[MAXLINE], *colon;
+    static const char *established = "HTTP/1.0 200 Connection established\r\n\r\n";
+    struct addrinfo *addrs;
+    size_t up, down;
+    int serverfd = -1, status = 502;
+    uint64_t start;
+
+    /* Authority form: host:port, with [v6]:port brackets stripped */
+    strncpy(hostname, uri[0] == '[' ? uri + 1 : uri, MAXLINE - 1);
+    hostname[MAXLINE - 1] = '\0';
+    if ((colon = strrchr(hostname, ':')) != NULL && !strchr(colon, ']')) {
+        *colon = '\0';
+        strcpy(port, colon + 1);
+    }
+    else {
+        strcpy(port, "443");
+    }
+    if ((colon = strchr(hostname, ']')) != NULL)
+        *colon = '\0';
+    if (hostname[0] == '\0') {
+        errpage_send(fd, 400);
+        TRACE_SET(tr, status, 400);
+        return;
+    }
+
+    /* Discard the request headers */
+    while (Rio_readlineb(rp, buf, MAXLINE) > 0 && strcmp(buf, "\r\n"))
+        ;
+
+    if (!breaker_allow(hostname, port)) {
+        metrics_inc(M_BREAKER_REJECTS);
+        errpage_send(fd, 503);
+        TRACE_SET(tr, status, 503);
+        return;
+    }
+    start = metrics_now();
+    if (upstream_resolve(hostname, port, &addrs) == 0) {
+        TRACE_MARK(tr, TR_DNS);
+        serverfd = upstream_connect(addrs);
+        if (serverfd < 0 && errno == ETIMEDOUT)
+            status = 504;
+        freeaddrinfo(addrs);
+        TRACE_MARK(tr, TR_CONNECT);
+    }
+    metrics_since(H_CONNECT, start);
+    breaker_report(hostname, port, serverfd >= 0);
+    if (serverfd < 0) {
+        errpage_send(fd, status);
+        TRACE_SET(tr, status, status);
+        return;
+    }
+
+    metrics_inc(M_TUNNELS);
+    Rio_writen(fd, (char *)established, strlen(established));
+    tunnel_relay(fd, serverfd, rp->rio_bufptr, rp->rio_cnt, &up, &down);
+    TRACE_MARK(tr, TR_LAST_BYTE);
+    TRACE_SET(tr, status, 200);
+    TRACE_SET(tr, bytes, down);
+    metrics_add(M_BYTES_UPSTREAM, down);
+    metrics_add(M_BYTES_CLIENT, down);
+    Close(serverfd);
+}
+
+/*
+ * peer_addr - the client's IPv4 address (network order), known from
+ * 		accept unless it shares a rate slot; 0 if unknown
+ */
+static uint32_t peer_addr(int fd)
+{
+    struct sockaddr_in peer;
+    socklen_t peerlen = sizeof(peer);
+    uint32_t addr;
+
+    if ((addr = ratelimit_addr(rate_client)) == 0 &&
+        getpeername(fd, (SA *)&peer, &peerlen) == 0 &&
+        peer.sin_family == AF_INET)
+        addr = peer.sin_addr.s_addr;
+    return addr;
+}
+
+/*
+ * peer_local - whether the client is on this host (127/8), the only
+ * 		clients the proxy's own reserved URIs are served to
+ */
+static int peer_local(int fd)
+{
+    return (ntohl(peer_addr(fd)) >> 24) == 127;
+}
+
+/*
+ * stale_usable - whether uri has a cached copy serve_stale would use;
+ * 		an error from the origin must not replace it
+ */
+static int stale_usable(char *uri)
+{
+    cache_t *cache;
+    int usable;
+
+    if ((cache = cache_find_stale(uri)) == NULL)
+        return 0;
+    usable = response_status(cache->content, cache->size) < 400;
+    cache_release(cache);
+    return usable;
+}
+
+/*
+ * serve_stale - answer from an expired cache entry, 0 if there is none.
+ * 		Cached errors are not worth serving in place of a fresh one.
+ */
+int serve_stale(int fd, char *uri, trace_rec_t *tr)
+{
+    cache_t *cache;
+    unsigned char small[CACHE_INLINE_MAX], *body;
+    size_t size;
+
+    if ((cache = cache_find_stale(uri)) == NULL)
+        return 0;
+    if (response_status(cache->content, cache->size) >= 400) {
+        cache_release(cache);
+        return 0;
+    }
+    metrics_inc(M_STALE_HITS);
+    body = cache_copyout(cache, small, &size);
+    Rio_writen(fd, body, size);
+    metrics_add(M_BYTES_CLIENT, size);
+    TRACE_SET(tr, status, response_status(body, size));
+    TRACE_SET(tr, cache, TR_STALE);
+    TRACE_SET(tr, bytes, size);
+    if (body != small)
+        Free(body);
+    return 1;
+}
+
+/*
+ * cache_copyout - copy a found entry's response out and release it.
+ * 		Client writes happen after, outside the cache's read
+ * 		section, which a slow client would otherwise hold open and
+ * 		with it every unlinked entry. A response that fits in
+ * 		small is copied there; a larger one into a buffer the
+ * 		caller frees.
+ */
+static unsigned char *cache_copyout(cache_t *cache, unsigned char *small,
+	size_t *size)
+{
+    unsigned char *body;
+
+    *size = cache->size;
+    body = *size <= CACHE_INLINE_MAX ? small : (unsigned char *)Malloc(*size);
+    memcpy(body, cache->content, *size);
+    cache_release(cache);
+    return body;
 }
 
 /*
@@ -279,27 +1363,3 @@ void build_header(char *buf, char *request)
         sprintf(request, "%s%s", request, buf);
     }
 }
-
-/*
- * clienterror - returns an error message to the client
- */
-void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
-{
-	char buf[MAXLINE], body[MAXBUF];
-
-    /* Build the HTTP response body */
-    sprintf(body, "<html><title>Proxylab Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>Yiting's Web Proxy</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
-}
\ No newline at end of file
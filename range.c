@@ -0,0 +1,130 @@
+/*
+ * range.c - answer byte-range requests from a complete cached response
+ *
+ * The cache holds whole HTTP responses (status line, headers, body).
+ * A range is served by rewriting the header block into a 206 and
+ * sending a slice of the stored body; nothing is copied. range_header
+ * alone serves stores that keep the body elsewhere (bigcache.c).
+ */
+#define _GNU_SOURCE
+#include "range.h"
+
+/*
+ * range_parse - parse a Range header value holding one byte range
+ * 		("a-b", "a-" or "-n"); last is -1 for open-ended ranges and
+ * 		first is -n for suffix ranges. Returns 1 on success, 0 if
+ * 		the value is not a single byte range.
+ */
+int range_parse(char *value, long *first, long *last)
+{
+	char *p, *end;
+
+	if (strncasecmp(value, "bytes=", 6))
+		return 0;
+	p = value + 6;
+	if (memchr(p, ',', strcspn(p, "\r\n")))
+		return 0; /* multiple ranges: serve the whole object */
+	if (*p == '-') {
+		*first = -strtol(p + 1, &end, 10);
+		*last = -1;
+		return end != p + 1 && *first < 0;
+	}
+	*first = strtol(p, &end, 10);
+	if (end == p || *end != '-')
+		return 0;
+	p = end + 1;
+	if (*p == '\r' || *p == '\n' || *p == '\0') {
+		*last = -1;
+		return 1;
+	}
+	*last = strtol(p, &end, 10);
+	return end != p && *last >= *first;
+}
+
+/*
+ * Is the header line starting at p one of those rewritten for a 206?
+ */
+static int replaced_header(char *p)
+{
+	return !strncasecmp(p, "Content-Length:", 15) ||
+		!strncasecmp(p, "Content-Range:", 14);
+}
+
+/*
+ * range_header - send the header block answering bytes first..last of
+ * 		a 200 response whose headers are its first hlen bytes and
+ * 		whose body is blen bytes: a 206, with the range clamped to
+ * 		the body, or a 416 when unsatisfiable, which leaves first
+ * 		past last. Returns the bytes written, 0 if the response
+ * 		cannot be sliced, or -1 if the write failed.
+ */
+ssize_t range_header(int fd, unsigned char *response, size_t hlen,
+	size_t blen, long *first, long *last)
+{
+	char hdr[MAXBUF], *p, *eol, *end;
+	size_t len = 0, n;
+	int status;
+
+	if (hlen < 4 || hlen >= MAXBUF - 124)
+		return 0;
+	if (sscanf((char *)response, "HTTP/%*s %d", &status) != 1 || status != 200)
+		return 0;
+	end = (char *)response + hlen - 4;
+
+	if (*first < 0) {
+		*first = (long)blen + *first < 0 ? 0 : (long)blen + *first;
+		*last = blen - 1;
+	}
+	if (*last < 0 || *last >= (long)blen)
+		*last = blen - 1;
+	if (*first >= (long)blen) {
+		*first = blen;
+		*last = blen - 1;
+		len = sprintf(hdr, "HTTP/1.0 416 Range Not Satisfiable\r\n"
+			"Content-Range: bytes */%lu\r\nContent-Length: 0\r\n\r\n",
+			(unsigned long)blen);
+		return rio_writen(fd, hdr, len) < 0 ? -1 : (ssize_t)len;
+	}
+
+	/* Status line, then the stored headers minus the ones we replace */
+	len = sprintf(hdr, "HTTP/1.0 206 Partial Content\r\n");
+	p = (char *)memmem(response, end + 2 - (char *)response, "\r\n", 2) + 2;
+	while (p < end + 2) {
+		eol = (char *)memmem(p, end + 2 - p, "\r\n", 2) + 2;
+		n = eol - p;
+		if (!replaced_header(p)) {
+			memcpy(hdr + len, p, n);
+			len += n;
+		}
+		p = eol;
+	}
+	len += sprintf(hdr + len, "Content-Range: bytes %ld-%ld/%lu\r\n"
+		"Content-Length: %ld\r\n\r\n", *first, *last, (unsigned long)blen,
+		*last - *first + 1);
+	return rio_writen(fd, hdr, len) < 0 ? -1 : (ssize_t)len;
+}
+
+/*
+ * range_send - send bytes first..last of the body of a cached 200
+ * 		response as a 206 (or a 416 when unsatisfiable). Returns the
+ * 		bytes written, or 0 if the response cannot be sliced and the
+ * 		caller should send it whole.
+ */
+ssize_t range_send(int fd, unsigned char *response, size_t size,
+	long first, long last)
+{
+	char *end;
+	size_t hlen;
+	ssize_t len;
+
+	/* Find the end of the header block */
+	if ((end = memmem(response, size, "\r\n\r\n", 4)) == NULL)
+		return 0;
+	hlen = end + 4 - (char *)response;
+	len = range_header(fd, response, hlen, size - hlen, &first, &last);
+	if (len <= 0 || first > last)
+		return len;
+	if (rio_writen(fd, response + hlen + first, last - first + 1) < 0)
+		return -1;
+	return len + last - first + 1;
+}
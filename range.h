@@ -0,0 +1,12 @@
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include "csapp.h"
+
+int range_parse(char *value, long *first, long *last);
+ssize_t range_header(int fd, unsigned char *response, size_t hlen,
+	size_t blen, long *first, long *last);
+ssize_t range_send(int fd, unsigned char *response, size_t size,
+	long first, long last);
+
+#endif
@@ -0,0 +1,378 @@
+/*
+ * ratelimit.c - per-client token buckets and fair upstream scheduling
+ *
+ * Clients are identified by source address. Each one has a request
+ * bucket, checked once per accepted connection, and a byte bucket,
+ * charged as response bytes are relayed; a client in byte debt is
+ * paced by sleeping its own thread, without holding a fetch slot while
+ * it does. Both are O(1) under a striped lock.
+ *
+ * Upstream fetches share RATE_FETCH_SLOTS slots. When they run out,
+ * fetches queue per client and a freed slot goes to the next client in
+ * a round-robin ring, so a client with many queued fetches gets one
+ * slot per turn like everyone else. The request rate adapts to that
+ * contention: while fetches are queued, a client holding more than its
+ * fair share of the slots refills at half rate.
+ */
+#include "ratelimit.h"
+#include "errpage.h"
+#include "metrics.h"
+#include "co.h"
+
+/* Shared slot for clients that did not fit the table; never limited */
+#define OVERFLOW RATE_SLOTS
+
+typedef struct waiter_t waiter_t;
+struct waiter_t {
+	pthread_cond_t cond;
+	co_task_t *task;            /* parked coroutine, or NULL for a thread */
+	int granted;
+	waiter_t *next;
+};
+
+typedef struct {
+	uint32_t addr;
+	int used;
+	int conns;                  /* open connections, atomic */
+	uint64_t last_ns;           /* last accept, for slot reuse */
+	double req_tokens, byte_tokens;
+	uint64_t req_ns, byte_ns;   /* last refill */
+	/* Fetch scheduling, under sched_lock */
+	int fetching;
+	waiter_t *head, *tail;
+	int ring_next;
+	int queued;
+} client_t;
+
+__thread int rate_client = -1;
+
+static client_t clients[RATE_SLOTS + 1];
+static pthread_mutex_t locks[RATE_LOCKS];
+static double req_rate, byte_rate;
+static int active;                  /* clients with open connections */
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static int fetch_slots = RATE_FETCH_SLOTS;
+static int fetch_free = RATE_FETCH_SLOTS;  /* negative after a shrink */
+static int ring_head = -1, ring_tail = -1;
+
+/*
+ * ratelimit_init - set the per-client requests and bytes per second;
+ * 		0 disables a limit
+ */
+void ratelimit_init(double rps, double bps)
+{
+	int i;
+
+	ratelimit_configure(rps, bps, RATE_FETCH_SLOTS);
+	for (i = 0; i < RATE_LOCKS; i++)
+		pthread_mutex_init(&locks[i], NULL);
+}
+
+static void grant_next();
+
+/*
+ * ratelimit_configure - change the limits and the number of fetch slots
+ * 		while running; queued fetches get any slots added
+ */
+void ratelimit_configure(double rps, double bps, int slots)
+{
+	__atomic_store(&req_rate, &rps, __ATOMIC_RELAXED);
+	__atomic_store(&byte_rate, &bps, __ATOMIC_RELAXED);
+	if (slots < 1)
+		slots = 1;
+	pthread_mutex_lock(&sched_lock);
+	fetch_free += slots - fetch_slots;
+	__atomic_store_n(&fetch_slots, slots, __ATOMIC_RELAXED);
+	while (fetch_free > 0 && ring_head >= 0) {
+		fetch_free--;
+		grant_next();
+	}
+	pthread_mutex_unlock(&sched_lock);
+}
+
+static pthread_mutex_t *stripe(int idx)
+{
+	return &locks[idx / RATE_PROBE % RATE_LOCKS];
+}
+
+/*
+ * Add tokens for the time since the last refill, up to the burst
+ */
+static void refill(double *tokens, uint64_t *stamp, double rate,
+	uint64_t now)
+{
+	*tokens += (double)(now - *stamp) / 1e9 * rate;
+	if (*tokens > rate * RATE_BURST)
+		*tokens = rate * RATE_BURST;
+	*stamp = now;
+}
+
+/*
+ * Find or claim the slot for addr; called with its stripe held.
+ * Slots with open connections are never reused.
+ */
+static int lookup(uint32_t addr, int base, uint64_t now)
+{
+	int i, victim = -1;
+	client_t *c;
+
+	for (i = 0; i < RATE_PROBE; i++) {
+		c = &clients[base + i];
+		if (c->used && c->addr == addr)
+			return base + i;
+		if (__atomic_load_n(&c->conns, __ATOMIC_RELAXED) == 0 &&
+			(victim < 0 || !c->used ||
+			(clients[victim].used && c->last_ns < clients[victim].last_ns)))
+			victim = base + i;
+	}
+	if (victim < 0)
+		return OVERFLOW;
+	c = &clients[victim];
+	c->addr = addr;
+	c->used = 1;
+	c->req_tokens = req_rate * RATE_BURST;
+	c->byte_tokens = byte_rate * RATE_BURST;
+	c->req_ns = c->byte_ns = now;
+	return victim;
+}
+
+/*
+ * ratelimit_accept - admit a new connection from addr: returns the
+ * 		client slot to pass to ratelimit_close, or -1 if the client
+ * 		is over its limits and should get ratelimit_reject
+ */
+int ratelimit_accept(struct in_addr addr)
+{
+	uint32_t a = addr.s_addr;
+	int base = (a * 2654435761u) % RATE_SLOTS, idx, ok = 1, share;
+	uint64_t now = metrics_now();
+	pthread_mutex_t *l;
+	client_t *c;
+	double rate;
+
+	base -= base % RATE_PROBE;
+	l = stripe(base);
+	pthread_mutex_lock(l);
+	idx = lookup(a, base, now);
+	c = &clients[idx];
+	if (idx != OVERFLOW && req_rate > 0) {
+		c->last_ns = now;
+		rate = req_rate;
+		share = __atomic_load_n(&active, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&ring_head, __ATOMIC_RELAXED) >= 0 &&
+			__atomic_load_n(&c->fetching, __ATOMIC_RELAXED) *
+				(share > 0 ? share : 1) >
+				__atomic_load_n(&fetch_slots, __ATOMIC_RELAXED))
+			rate /= 2;
+		refill(&c->req_tokens, &c->req_ns, rate, now);
+		if (c->req_tokens < 1 ||
+			__atomic_load_n(&c->conns, __ATOMIC_RELAXED) >= RATE_MAX_CONNS)
+			ok = 0;
+		else
+			c->req_tokens -= 1;
+	}
+	if (ok && __atomic_fetch_add(&c->conns, 1, __ATOMIC_RELAXED) == 0)
+		__atomic_add_fetch(&active, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(l);
+
+	if (!ok) {
+		metrics_inc(M_RATE_LIMITED);
+		return -1;
+	}
+	return idx;
+}
+
+/*
+ * ratelimit_reject - answer a refused connection with a prebuilt 429,
+ * 		without ever blocking the accept loop
+ */
+void ratelimit_reject(int fd)
+{
+	size_t len;
+	char *page = errpage(429, &len);
+
+	send(fd, page, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*
+ * ratelimit_close - a connection admitted by ratelimit_accept is done
+ */
+void ratelimit_close(int client)
+{
+	if (client < 0)
+		return;
+	if (__atomic_sub_fetch(&clients[client].conns, 1, __ATOMIC_RELAXED) == 0)
+		__atomic_sub_fetch(&active, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * ratelimit_addr - address of a client with an open connection, 0 if
+ * 		it shares the overflow slot
+ */
+uint32_t ratelimit_addr(int client)
+{
+	if (client < 0 || client == OVERFLOW)
+		return 0;
+	return clients[client].addr;
+}
+
+/*
+ * Charge n relayed bytes to the calling thread's client; returns how
+ * long to sleep to pay off its debt, 0 if none
+ */
+static uint64_t charge(size_t n)
+{
+	int idx = rate_client;
+	client_t *c;
+	double debt;
+	uint64_t ns;
+
+	if (byte_rate <= 0 || idx < 0 || idx == OVERFLOW)
+		return 0;
+	c = &clients[idx];
+	pthread_mutex_lock(stripe(idx));
+	refill(&c->byte_tokens, &c->byte_ns, byte_rate, metrics_now());
+	c->byte_tokens -= n;
+	debt = -c->byte_tokens;
+	pthread_mutex_unlock(stripe(idx));
+
+	if (debt <= 0 || (ns = (uint64_t)(debt / byte_rate * 1e9)) < RATE_MIN_SLEEP_NS)
+		return 0;
+	return ns;
+}
+
+/*
+ * ratelimit_bytes - charge n relayed bytes to the calling thread's
+ * 		client, sleeping while it is in debt
+ */
+void ratelimit_bytes(size_t n)
+{
+	uint64_t ns = charge(n);
+
+	if (ns)
+		co_sleep(ns);
+}
+
+/*
+ * ratelimit_fetch_bytes - ratelimit_bytes for a caller holding a fetch
+ * 		slot. The slot is given up for the sleep and waited for
+ * 		again after it, so paced downloads cannot hold every slot
+ * 		while other clients queue.
+ */
+void ratelimit_fetch_bytes(size_t n)
+{
+	uint64_t ns = charge(n);
+
+	if (ns == 0)
+		return;
+	ratelimit_fetch_end();
+	co_sleep(ns);
+	ratelimit_fetch_begin();
+}
+
+static void ring_push(int idx)
+{
+	clients[idx].ring_next = -1;
+	clients[idx].queued = 1;
+	if (ring_tail >= 0)
+		clients[ring_tail].ring_next = idx;
+	else
+		__atomic_store_n(&ring_head, idx, __ATOMIC_RELAXED);
+	ring_tail = idx;
+}
+
+static int ring_pop()
+{
+	int idx = ring_head;
+
+	__atomic_store_n(&ring_head, clients[idx].ring_next, __ATOMIC_RELAXED);
+	if (ring_head < 0)
+		ring_tail = -1;
+	clients[idx].queued = 0;
+	return idx;
+}
+
+/*
+ * ratelimit_fetch_begin - take an upstream fetch slot, waiting for this
+ * 		client's turn if all are in use
+ */
+void ratelimit_fetch_begin()
+{
+	int idx = rate_client < 0 ? OVERFLOW : rate_client;
+	client_t *c = &clients[idx];
+	waiter_t w;
+
+	pthread_mutex_lock(&sched_lock);
+	/* Free slots imply nobody is queued: ratelimit_fetch_end hands over */
+	if (fetch_free > 0) {
+		fetch_free--;
+		c->fetching++;
+		pthread_mutex_unlock(&sched_lock);
+		return;
+	}
+	metrics_inc(M_FETCH_QUEUED);
+	/* A coroutine must not block its scheduler thread on the cond */
+	if ((w.task = co_self()) == NULL)
+		pthread_cond_init(&w.cond, NULL);
+	w.granted = 0;
+	w.next = NULL;
+	if (c->tail)
+		c->tail->next = &w;
+	else
+		c->head = &w;
+	c->tail = &w;
+	if (!c->queued)
+		ring_push(idx);
+	while (!w.granted) {
+		if (w.task == NULL) {
+			pthread_cond_wait(&w.cond, &sched_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&sched_lock);
+		co_park();
+		pthread_mutex_lock(&sched_lock);
+	}
+	pthread_mutex_unlock(&sched_lock);
+	if (w.task == NULL)
+		pthread_cond_destroy(&w.cond);
+}
+
+/*
+ * Hand a slot to the head waiter of the next client in the ring;
+ * caller holds sched_lock and the ring is not empty
+ */
+static void grant_next()
+{
+	int next = ring_pop();
+	client_t *c = &clients[next];
+	waiter_t *w = c->head;
+
+	if ((c->head = w->next) == NULL)
+		c->tail = NULL;
+	else
+		ring_push(next);
+	c->fetching++;
+	w->granted = 1;
+	if (w->task)
+		co_wake(w->task);
+	else
+		pthread_cond_signal(&w->cond);
+}
+
+/*
+ * ratelimit_fetch_end - release the slot to the next client in the ring
+ */
+void ratelimit_fetch_end()
+{
+	int idx = rate_client < 0 ? OVERFLOW : rate_client;
+
+	pthread_mutex_lock(&sched_lock);
+	clients[idx].fetching--;
+	/* Slots removed by a reload are retired instead of handed on */
+	if (ring_head < 0 || fetch_free < 0)
+		fetch_free++;
+	else
+		grant_next();
+	pthread_mutex_unlock(&sched_lock);
+}
@@ -0,0 +1,30 @@
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include "csapp.h"
+
+/* Per-client (source IPv4 address) limits */
+#define RATE_SLOTS 4096          /* clients tracked at once */
+#define RATE_PROBE 8             /* open-addressing probe length */
+#define RATE_LOCKS 64
+#define RATE_BURST 2             /* bucket depth, in seconds of rate */
+#define RATE_MAX_CONNS 64        /* open connections per limited client */
+#define RATE_MIN_SLEEP_NS 1000000
+
+/* Upstream fetches in flight, shared fairly among clients (default) */
+#define RATE_FETCH_SLOTS 128
+
+extern __thread int rate_client;
+
+void ratelimit_init(double rps, double bps);
+void ratelimit_configure(double rps, double bps, int slots);
+int ratelimit_accept(struct in_addr addr);
+void ratelimit_reject(int fd);
+void ratelimit_close(int client);
+uint32_t ratelimit_addr(int client);
+void ratelimit_bytes(size_t n);
+void ratelimit_fetch_bytes(size_t n);
+void ratelimit_fetch_begin();
+void ratelimit_fetch_end();
+
+#endif
@@ -0,0 +1,440 @@
+/*
+ * shmcache.c - the cache in a POSIX shared-memory segment
+ *
+ * Several proxy processes attach to one named segment and share one
+ * cache and one hit ratio. The segment is a log: records are appended
+ * at head, and room is made by advancing tail over the oldest ones, so
+ * eviction is FIFO and never has to unlink anything. Hash buckets and
+ * chains hold log positions instead of pointers, and a position before
+ * tail simply reads as the end of its chain.
+ *
+ * Writers serialize on a robust process-shared mutex. An append moves
+ * tail first, then writes the record, then publishes head and finally
+ * the bucket, so a writer that dies holding the lock can only leave an
+ * unpublished record behind; the next owner marks the mutex consistent
+ * and carries on.
+ *
+ * Readers take no lock. A hit is copied into a per-thread buffer and
+ * then checked against tail: if tail moved past the record during the
+ * copy it may have been overwritten, and the lookup is a miss. Fences,
+ * not just the ordering of the tail accesses, keep the copy before the
+ * check on the reader's side and tail before the overwrite on the
+ * writer's, as in a seqlock. Under
+ * coroutines several lookups on one thread can be live at once, so
+ * each gets its own buffer back from shmcache_release.
+ */
+#include "shmcache.h"
+#include "co.h"
+#include <sys/mman.h>
+#include <time.h>
+
+#define REC_ALIGN(n) (((n) + SHM_ALIGN - 1) & ~(uint64_t)(SHM_ALIGN - 1))
+
+static shm_hdr_t *shm;
+static unsigned char *ring;
+static uint64_t ring_size;
+
+/* Per-thread buffer a hit is copied into; recycled when threads exit */
+typedef struct copy_t copy_t;
+struct copy_t {
+	cache_t item;
+	char uri[MAXLINE];
+	unsigned char content[MAX_OBJECT_SIZE];
+	int own;            /* lent to one lookup, not to the thread */
+	copy_t *free_next;
+};
+
+static copy_t *free_copies;
+static pthread_mutex_t copy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t copy_key;
+static __thread copy_t *copy_self;
+
+static void copy_release(void *arg)
+{
+	copy_t *c = (copy_t *)arg;
+
+	pthread_mutex_lock(&copy_lock);
+	c->free_next = free_copies;
+	free_copies = c;
+	pthread_mutex_unlock(&copy_lock);
+}
+
+static copy_t *copy_take()
+{
+	copy_t *c;
+
+	pthread_mutex_lock(&copy_lock);
+	if ((c = free_copies) != NULL)
+		free_copies = c->free_next;
+	pthread_mutex_unlock(&copy_lock);
+	if (c == NULL)
+		c = (copy_t *)Malloc(sizeof(*c));
+	c->own = 0;
+	return c;
+}
+
+static copy_t *copy_claim()
+{
+	copy_t *c;
+
+	if (co_active()) {
+		c = copy_take();
+		c->own = 1;
+		return c;
+	}
+	if (copy_self != NULL)
+		return copy_self;
+	c = copy_take();
+	pthread_setspecific(copy_key, c);
+	copy_self = c;
+	return c;
+}
+
+static uint32_t hash_uri(char *uri)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *uri; uri++)
+		h = (h ^ (unsigned char)*uri) * 16777619u;
+	return h;
+}
+
+static shm_rec_t *rec_at(uint64_t pos)
+{
+	return (shm_rec_t *)(ring + pos % ring_size);
+}
+
+static void shm_lock()
+{
+	int rc = pthread_mutex_lock(&shm->lock);
+
+	/* The holder died; appends are ordered so the log is still sound */
+	if (rc == EOWNERDEAD)
+		pthread_mutex_consistent(&shm->lock);
+	else if (rc != 0)
+		posix_error(rc, "shm lock error");
+}
+
+static void shm_unlock()
+{
+	pthread_mutex_unlock(&shm->lock);
+}
+
+/*
+ * Create the segment header and lock; the magic is written last
+ */
+static void shm_format(uint64_t size)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&shm->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	shm->version = SHM_VERSION;
+	shm->ring_size = size;
+	/* Start past 0 so an empty bucket is never a valid position */
+	shm->head = shm->tail = size;
+	__atomic_store_n(&shm->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+/*
+ * shmcache_open - attach to the segment name, creating it with a ring
+ * 		of size bytes if it does not exist yet; 0 on success, -1 on
+ * 		error. An existing segment keeps its own size.
+ */
+int shmcache_open(char *name, size_t size)
+{
+	uint64_t total;
+	struct stat st;
+	int fd, created = 1, waited;
+	void *map;
+
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+		if (errno != EEXIST || (fd = shm_open(name, O_RDWR, 0)) < 0)
+			return -1;
+		created = 0;
+	}
+	if (created) {
+		total = sizeof(shm_hdr_t) + REC_ALIGN(size);
+		if (ftruncate(fd, total) < 0) {
+			close(fd);
+			shm_unlink(name);
+			return -1;
+		}
+	}
+	else {
+		/* The creator may not have sized it yet */
+		for (waited = 0; ; waited += 10) {
+			if (fstat(fd, &st) < 0) {
+				close(fd);
+				return -1;
+			}
+			if (st.st_size > (off_t)sizeof(shm_hdr_t) || waited >= SHM_OPEN_WAIT_MS)
+				break;
+			usleep(10000);
+		}
+		total = st.st_size;
+	}
+	if (total <= sizeof(shm_hdr_t)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	shm = (shm_hdr_t *)map;
+	ring = (unsigned char *)map + sizeof(shm_hdr_t);
+
+	if (created) {
+		shm_format(total - sizeof(shm_hdr_t));
+	}
+	else {
+		for (waited = 0; __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) !=
+			SHM_MAGIC && waited < SHM_OPEN_WAIT_MS; waited += 10)
+			usleep(10000);
+		if (shm->magic != SHM_MAGIC || shm->version != SHM_VERSION ||
+			shm->ring_size != total - sizeof(shm_hdr_t)) {
+			munmap(map, total);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	ring_size = shm->ring_size;
+	if ((errno = pthread_key_create(&copy_key, copy_release)) != 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * Is pos still inside the live part of the log?
+ */
+static int live(uint64_t pos)
+{
+	return pos >= __atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE) &&
+		pos < __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * shmcache_find - look up uri without locking; a hit is a per-thread
+ * 		copy that stays valid until this thread's next lookup
+ */
+cache_t *shmcache_find(char *uri, int stale)
+{
+	uint32_t h = hash_uri(uri);
+	size_t klen = strlen(uri);
+	uint64_t pos, off;
+	shm_rec_t rec;
+	copy_t *c;
+
+	pos = __atomic_load_n(&shm->buckets[h % SHM_BUCKETS], __ATOMIC_ACQUIRE);
+	for (; pos && live(pos); pos = rec.hnext) {
+		off = pos % ring_size;
+		memcpy(&rec, ring + off, sizeof(rec));
+		/* Only trust a header that could be real */
+		if (rec.len < sizeof(rec) || off + rec.len > ring_size ||
+			rec.key_len >= MAXLINE || rec.size > MAX_OBJECT_SIZE ||
+			sizeof(rec) + rec.key_len + rec.size > rec.len)
+			break;
+		if ((rec.flags & SHM_PAD) || rec.hash != h || rec.key_len != klen ||
+			memcmp(ring + off + sizeof(rec), uri, klen)) {
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (!live(pos))
+				break;
+			continue;
+		}
+		if ((rec.flags & SHM_TOMBSTONE) ||
+			(!stale && rec.expires && rec.expires <= time(NULL)))
+			break;
+
+		c = copy_claim();
+		memcpy(c->content, ring + off + sizeof(rec) + klen, rec.size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (!live(pos)) {
+			shmcache_release(&c->item);
+			break;  /* overwritten while we copied */
+		}
+		memcpy(c->uri, uri, klen + 1);
+		c->item.uri = c->uri;
+		c->item.uri_len = klen;
+		c->item.size = rec.size;
+		c->item.expires = rec.expires;
+		c->item.content = c->content;
+		__atomic_add_fetch(&shm->hits, 1, __ATOMIC_RELAXED);
+		return &c->item;
+	}
+	__atomic_add_fetch(&shm->misses, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/*
+ * shmcache_release - done with a hit from shmcache_find
+ */
+void shmcache_release(cache_t *item)
+{
+	copy_t *c = (copy_t *)item;
+
+	if (c->own)
+		copy_release(c);
+}
+
+/*
+ * Advance tail until need more bytes fit after head; caller holds lock.
+ * The fence keeps the record writes that follow from being seen before
+ * the new tail, which a release store alone does not.
+ */
+static void make_room(uint64_t need)
+{
+	uint64_t tail = shm->tail;
+
+	while (shm->head + need - tail > ring_size)
+		tail += rec_at(tail)->len;
+	__atomic_store_n(&shm->tail, tail, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * Append a record; caller holds lock
+ */
+static void append(shm_rec_t *rec, char *key, unsigned char *body)
+{
+	uint64_t off, pos, *bucket;
+	shm_rec_t pad;
+
+	rec->len = REC_ALIGN(sizeof(*rec) + rec->key_len + rec->size);
+	if (rec->len > ring_size / 2)
+		return;
+	/* Records never wrap: fill the rest of the ring with a pad record */
+	off = shm->head % ring_size;
+	if (off + rec->len > ring_size) {
+		memset(&pad, 0, sizeof(pad));
+		pad.flags = SHM_PAD;
+		pad.len = ring_size - off;
+		make_room(pad.len);
+		memcpy(ring + off, &pad, sizeof(pad));
+		__atomic_store_n(&shm->head, shm->head + pad.len, __ATOMIC_RELEASE);
+	}
+	make_room(rec->len);
+	pos = shm->head;
+	bucket = &shm->buckets[rec->hash % SHM_BUCKETS];
+	rec->hnext = *bucket;
+	off = pos % ring_size;
+	memcpy(ring + off, rec, sizeof(*rec));
+	memcpy(ring + off + sizeof(*rec), key, rec->key_len);
+	memcpy(ring + off + sizeof(*rec) + rec->key_len, body, rec->size);
+	__atomic_store_n(&shm->head, pos + rec->len, __ATOMIC_RELEASE);
+	__atomic_store_n(bucket, pos, __ATOMIC_RELEASE);
+}
+
+/*
+ * Position of the newest record (entry or tombstone) for key, or 0;
+ * caller holds lock so nothing moves under us
+ */
+static uint64_t newest(char *key, uint32_t h)
+{
+	size_t klen = strlen(key);
+	uint64_t pos;
+	shm_rec_t *rec;
+
+	for (pos = shm->buckets[h % SHM_BUCKETS]; pos && live(pos);
+		pos = rec->hnext) {
+		rec = rec_at(pos);
+		if (rec->hash == h && rec->key_len == klen &&
+			!memcmp((char *)(rec + 1), key, klen))
+			return pos;
+	}
+	return 0;
+}
+
+/*
+ * shmcache_store - append an entry, superseding any older one for uri
+ */
+void shmcache_store(size_t size, char *uri, unsigned char *content,
+	time_t expires)
+{
+	shm_rec_t rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.hash = hash_uri(uri);
+	rec.key_len = strlen(uri);
+	rec.size = size;
+	rec.expires = expires;
+	shm_lock();
+	append(&rec, uri, content);
+	shm_unlock();
+}
+
+/*
+ * shmcache_remove - hide uri behind a tombstone, if it is cached
+ */
+void shmcache_remove(char *uri)
+{
+	shm_rec_t rec;
+	uint64_t pos;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.hash = hash_uri(uri);
+	rec.key_len = strlen(uri);
+	rec.flags = SHM_TOMBSTONE;
+	shm_lock();
+	if ((pos = newest(uri, rec.hash)) != 0 &&
+		!(rec_at(pos)->flags & SHM_TOMBSTONE))
+		append(&rec, uri, NULL);
+	shm_unlock();
+}
+
+/*
+ * shmcache_walk - call fn on every current entry, newest first, with
+ * 		writers held off
+ */
+void shmcache_walk(void (*fn)(cache_t *, void *), void *arg)
+{
+	cache_t *item = (cache_t *)Calloc(1, sizeof(*item));
+	char *uri = (char *)Malloc(MAXLINE);
+	uint64_t pos, *live_pos = NULL;
+	size_t n = 0, cap = 0;
+	shm_rec_t *rec;
+
+	shm_lock();
+	for (pos = shm->tail; pos < shm->head; pos += rec->len) {
+		rec = rec_at(pos);
+		if (rec->flags & (SHM_PAD | SHM_TOMBSTONE))
+			continue;
+		memcpy(uri, (char *)(rec + 1), rec->key_len);
+		uri[rec->key_len] = '\0';
+		if (newest(uri, rec->hash) != pos)
+			continue;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 256;
+			live_pos = (uint64_t *)Realloc(live_pos, cap * sizeof(*live_pos));
+		}
+		live_pos[n++] = pos;
+	}
+	while (n > 0) {
+		rec = rec_at(live_pos[--n]);
+		memcpy(uri, (char *)(rec + 1), rec->key_len);
+		uri[rec->key_len] = '\0';
+		item->uri = uri;
+		item->uri_len = rec->key_len;
+		item->size = rec->size;
+		item->expires = rec->expires;
+		item->content = (unsigned char *)(rec + 1) + rec->key_len;
+		fn(item, arg);
+	}
+	shm_unlock();
+	Free(live_pos);
+	Free(uri);
+	Free(item);
+}
+
+/*
+ * shmcache_stats - lookups by every attached process
+ */
+void shmcache_stats(uint64_t *hits, uint64_t *misses)
+{
+	*hits = __atomic_load_n(&shm->hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n(&shm->misses, __ATOMIC_RELAXED);
+}
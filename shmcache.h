@@ -0,0 +1,53 @@
+#ifndef __SHMCACHE_H__
+#define __SHMCACHE_H__
+
+#include "cache.h"
+
+#define SHM_MAGIC 0x4d484353 /* "SCHM" */
+#define SHM_VERSION 1
+#define SHM_BUCKETS 16384
+#define SHM_ALIGN 64         /* record alignment; a header always fits */
+#define SHM_OPEN_WAIT_MS 2000 /* wait for another process to initialize */
+
+/*
+ * Segment header. Positions are byte offsets into an endless log;
+ * pos % ring size is where a record lives. Everything before tail has
+ * been (or may be) overwritten, so a position is valid only while
+ * tail <= pos < head. The buckets and each record's hnext hold
+ * positions, never pointers, so every process can map the segment at
+ * a different address.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t ring_size;
+	pthread_mutex_t lock;       /* process-shared, robust; writers only */
+	uint64_t head, tail;
+	uint64_t hits, misses;      /* shared by every attached process */
+	uint64_t buckets[SHM_BUCKETS];
+} __attribute__((aligned(SHM_ALIGN))) shm_hdr_t;
+
+/* Record header, followed by the key, the body, and padding */
+typedef struct {
+	uint64_t hnext;             /* older record in the same bucket */
+	uint32_t hash;
+	uint32_t key_len;
+	uint32_t size;              /* body bytes; 0 with SHM_TOMBSTONE */
+	uint32_t flags;
+	uint64_t len;               /* whole record, aligned */
+	int64_t expires;
+} shm_rec_t;
+
+#define SHM_PAD 1            /* filler up to the end of the ring */
+#define SHM_TOMBSTONE 2      /* key removed */
+
+int shmcache_open(char *name, size_t size);
+cache_t *shmcache_find(char *uri, int stale);
+void shmcache_release(cache_t *item);
+void shmcache_store(size_t size, char *uri, unsigned char *content,
+	time_t expires);
+void shmcache_remove(char *uri);
+void shmcache_walk(void (*fn)(cache_t *, void *), void *arg);
+void shmcache_stats(uint64_t *hits, uint64_t *misses);
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ * snapshot.c - persist the cache across restarts
+ *
+ * snapshot_save writes every entry, most recently used first, to a
+ * temporary file and renames it into place so a crash never leaves a
+ * torn snapshot. snapshot_load maps the file read-only and points the
+ * restored entries' content straight into the mapping, so start-up cost
+ * is one pass over the record headers rather than a copy of every body.
+ * snapshot_save_fd writes the same format to an open descriptor, which
+ * is how a binary upgrade hands its cache to the new process.
+ */
+#include "snapshot.h"
+
+#define SNAP_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct {
+	FILE *out;
+	uint64_t count;
+	int error;
+} save_ctx_t;
+
+static void save_one(cache_t *ptr, void *arg)
+{
+	save_ctx_t *ctx = (save_ctx_t *)arg;
+	static const char zeros[8];
+	snap_rec_t rec;
+	size_t len = strlen(ptr->uri), padded;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.uri_len = len;
+	rec.size = ptr->size;
+	rec.expires = ptr->expires;
+	padded = SNAP_ALIGN(len + ptr->size);
+	if (fwrite(&rec, sizeof(rec), 1, ctx->out) != 1 ||
+		fwrite(ptr->uri, 1, len, ctx->out) != len ||
+		fwrite(ptr->content, 1, ptr->size, ctx->out) != ptr->size ||
+		fwrite(zeros, 1, padded - len - ptr->size, ctx->out) !=
+			padded - len - ptr->size)
+		ctx->error = 1;
+	ctx->count++;
+}
+
+/*
+ * Write the header and every entry to out and flush it; does not close
+ */
+static int save_stream(FILE *out)
+{
+	save_ctx_t ctx;
+	snap_hdr_t hdr;
+
+	ctx.out = out;
+	ctx.count = 0;
+	ctx.error = 0;
+
+	/* Header is rewritten with the real count once the walk is done */
+	memset(&hdr, 0, sizeof(hdr));
+	fwrite(&hdr, sizeof(hdr), 1, ctx.out);
+	cache_walk(save_one, &ctx);
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.count = ctx.count;
+	if (fseek(ctx.out, 0, SEEK_SET) < 0 ||
+		fwrite(&hdr, sizeof(hdr), 1, ctx.out) != 1)
+		ctx.error = 1;
+	if (fflush(ctx.out) != 0)
+		ctx.error = 1;
+	return ctx.error ? -1 : 0;
+}
+
+/*
+ * snapshot_save - write the cache to path, 0 on success, -1 on error
+ */
+int snapshot_save(char *path)
+{
+	char tmp[MAXLINE];
+	FILE *out;
+	int error;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((out = fopen(tmp, "wb")) == NULL)
+		return -1;
+	error = save_stream(out) < 0 || fsync(fileno(out)) < 0;
+	if (fclose(out) != 0 || error || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * snapshot_save_fd - write the cache to the start of an open file,
+ * 		0 on success, -1 on error; fd stays open
+ */
+int snapshot_save_fd(int fd)
+{
+	FILE *out;
+	int dupfd, rc;
+
+	if ((dupfd = dup(fd)) < 0)
+		return -1;
+	if ((out = fdopen(dupfd, "wb")) == NULL) {
+		close(dupfd);
+		return -1;
+	}
+	rc = save_stream(out);
+	if (fclose(out) != 0)
+		rc = -1;
+	return rc;
+}
+
+/*
+ * snapshot_load - restore entries from path into the cache, return the
+ * 		number restored or -1. Runs before any worker thread starts.
+ */
+int snapshot_load(char *path)
+{
+	struct stat st;
+	snap_hdr_t *hdr;
+	snap_rec_t *rec;
+	cache_t **items, *ptr;
+	unsigned char *base, *p, *end;
+	uint64_t i, n = 0, count;
+	size_t left, len;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(snap_hdr_t)) {
+		close(fd);
+		return -1;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+	hdr = (snap_hdr_t *)base;
+	if (hdr->magic != SNAPSHOT_MAGIC || hdr->version != SNAPSHOT_VERSION) {
+		munmap(base, st.st_size);
+		return -1;
+	}
+	madvise(base, st.st_size, MADV_WILLNEED);
+
+	/* A corrupt count cannot claim more records than the file holds */
+	count = (st.st_size - sizeof(*hdr)) / sizeof(snap_rec_t);
+	if (hdr->count < count)
+		count = hdr->count;
+
+	/* Index the records, stopping at the first truncated one */
+	items = (cache_t **)Calloc(count ? count : 1, sizeof(*items));
+	end = base + st.st_size;
+	p = base + sizeof(*hdr);
+	for (i = 0; i < count; i++) {
+		rec = (snap_rec_t *)p;
+		/* Lengths are checked against what is left, so none can wrap */
+		left = end - p;
+		if (left < sizeof(*rec) || rec->uri_len >= MAXLINE ||
+			rec->uri_len > left - sizeof(*rec) ||
+			rec->size > left - sizeof(*rec) - rec->uri_len)
+			break;
+		p += sizeof(*rec);
+		left -= sizeof(*rec);
+		if (rec->size <= MAX_OBJECT_SIZE) {
+			ptr = cache_new((char *)p, rec->uri_len, rec->size,
+				p + rec->uri_len);
+			ptr->expires = rec->expires;
+			items[n++] = ptr;
+		}
+		len = SNAP_ALIGN(rec->uri_len + rec->size);
+		p += len < left ? len : left;
+	}
+
+	/* Insert least recently used first so the list order is preserved */
+	for (i = n; i > 0; i--)
+		cache_add(items[i - 1]);
+	Free(items);
+	return (int)n;
+}
@@ -0,0 +1,29 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+#include "cache.h"
+
+#define SNAPSHOT_MAGIC 0x50414e53 /* "SNAP" */
+#define SNAPSHOT_VERSION 1
+
+/* File header, followed by count records */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t count;
+} snap_hdr_t;
+
+/* Record header, followed by the URI, the body, and padding to 8 bytes */
+typedef struct {
+	uint32_t uri_len;
+	uint32_t pad;
+	uint64_t size;
+	int64_t expires;
+} snap_rec_t;
+
+int snapshot_save(char *path);
+int snapshot_save_fd(int fd);
+int snapshot_load(char *path);
+
+#endif
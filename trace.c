@@ -0,0 +1,167 @@
+/*
+ * trace.c - per-request phase timestamps in per-thread ring buffers
+ *
+ * A record in progress belongs to its request: the caller keeps it (on
+ * the stack, or in the fetch that takes the request over) and fills it
+ * in. trace_end copies the finished record into the ring of the thread
+ * that ends it, which is that ring's only writer, at ring[head %
+ * TRACE_RING], and publishes it by bumping head with a release store.
+ * A dump never sees a half-written record: it copies the published
+ * window and drops whatever the writer lapped meanwhile. So however
+ * many requests coroutines (-C) interleave on a thread, and wherever a
+ * stolen fetch finishes, no ring slot is held by a live request.
+ * Rings are recycled between threads the same way metrics slots are.
+ *
+ * The access log (-l) is fed from here too: each finished record is
+ * also handed to accesslog_add. When only the log is on, records go
+ * straight there and no thread gets a ring.
+ */
+#include "trace.h"
+#include "accesslog.h"
+
+typedef struct trace_ring_t trace_ring_t;
+struct trace_ring_t {
+	uint64_t head;              /* records published so far */
+	uint32_t id;
+	trace_ring_t *next;         /* registry of every ring */
+	trace_ring_t *free_next;
+	trace_rec_t recs[TRACE_RING];
+} __attribute__((aligned(64)));
+
+int trace_enabled;
+static int trace_ringed;    /* records are kept for TRACE_URI */
+
+static __thread trace_ring_t *trace_self;
+static trace_ring_t *registry;
+static trace_ring_t *free_rings;
+static uint32_t nrings;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+
+static void ring_release(void *arg)
+{
+	trace_ring_t *r = (trace_ring_t *)arg;
+
+	pthread_mutex_lock(&ring_lock);
+	r->free_next = free_rings;
+	free_rings = r;
+	pthread_mutex_unlock(&ring_lock);
+}
+
+/*
+ * Initialize tracing; rings are only allocated when ringed
+ */
+void trace_init(int enabled, int ringed)
+{
+	int rc;
+
+	if ((rc = pthread_key_create(&ring_key, ring_release)) != 0)
+		posix_error(rc, "pthread_key_create error");
+	trace_enabled = enabled;
+	trace_ringed = ringed;
+}
+
+static trace_ring_t *ring_claim()
+{
+	trace_ring_t *r;
+
+	pthread_mutex_lock(&ring_lock);
+	if ((r = free_rings) != NULL) {
+		free_rings = r->free_next;
+	}
+	else {
+		if (posix_memalign((void **)&r, 64, sizeof(*r)) != 0)
+			unix_error("posix_memalign error");
+		memset(r, 0, sizeof(*r));
+		r->id = ++nrings;
+		r->next = registry;
+		__atomic_store_n(&registry, r, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&ring_lock);
+	pthread_setspecific(ring_key, r);
+	trace_self = r;
+	return r;
+}
+
+/*
+ * trace_begin - start the record rec, stamped TR_START; returns rec
+ */
+trace_rec_t *trace_begin(trace_rec_t *rec)
+{
+	memset(rec, 0, sizeof(*rec));
+	if (trace_ringed)
+		rec->thread = (trace_self ? trace_self : ring_claim())->id;
+	rec->t[TR_START] = metrics_now();
+	return rec;
+}
+
+/*
+ * trace_end - publish a finished record in this thread's ring
+ */
+void trace_end(trace_rec_t *rec)
+{
+	trace_ring_t *r;
+
+	if (trace_ringed) {
+		r = trace_self ? trace_self : ring_claim();
+		r->recs[r->head % TRACE_RING] = *rec;
+		__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+	}
+	if (accesslog_enabled)
+		accesslog_add(rec);
+}
+
+/*
+ * Copy the stable part of one ring into out, return records copied
+ */
+static uint32_t ring_copy(trace_ring_t *r, trace_rec_t *out)
+{
+	uint64_t head, tail, i, lapped;
+	uint32_t n = 0;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	/* The slot at head is being written, so skip the oldest one */
+	tail = head >= TRACE_RING ? head - TRACE_RING + 1 : 0;
+	for (i = tail; i < head; i++)
+		out[n++] = r->recs[i % TRACE_RING];
+	/* Drop records the writer overwrote while we copied */
+	lapped = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	lapped = lapped >= TRACE_RING ? lapped - TRACE_RING + 1 : 0;
+	if (lapped > tail) {
+		i = lapped - tail < n ? lapped - tail : n;
+		memmove(out, out + i, (n - i) * sizeof(*out));
+		n -= i;
+	}
+	return n;
+}
+
+/*
+ * trace_serve - send every ring as one binary dump
+ */
+void trace_serve(int fd)
+{
+	char hdr[MAXLINE];
+	trace_hdr_t th;
+	trace_rec_t *recs;
+	trace_ring_t *r;
+	uint32_t count = 0, n = 0;
+
+	for (r = __atomic_load_n(&registry, __ATOMIC_ACQUIRE); r; r = r->next)
+		n++;
+	recs = (trace_rec_t *)Malloc((n ? n : 1) * TRACE_RING * sizeof(*recs));
+	for (r = __atomic_load_n(&registry, __ATOMIC_ACQUIRE); r && n; r = r->next, n--)
+		count += ring_copy(r, recs + count);
+
+	th.magic = TRACE_MAGIC;
+	th.nphases = TR_NPHASES;
+	th.rec_size = sizeof(trace_rec_t);
+	th.count = count;
+	sprintf(hdr, "HTTP/1.0 200 OK\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"Content-Length: %lu\r\n\r\n",
+		(unsigned long)(sizeof(th) + count * sizeof(*recs)));
+	Rio_writen(fd, hdr, strlen(hdr));
+	Rio_writen(fd, &th, sizeof(th));
+	Rio_writen(fd, recs, count * sizeof(*recs));
+	Free(recs);
+}
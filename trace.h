@@ -0,0 +1,75 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include "csapp.h"
+#include "metrics.h"
+
+/* Reserved origin-form URI that dumps every ring buffer */
+#define TRACE_URI "/__proxy/trace"
+
+/* Records kept per thread before the oldest is overwritten */
+#define TRACE_RING 1024
+#define TRACE_URI_LEN 80
+#define TRACE_MAGIC 0x43525450 /* "PTRC" */
+
+/* Phase timestamps recorded for each request, in order */
+enum {
+	TR_START,
+	TR_READ,
+	TR_PARSE,
+	TR_CACHE,
+	TR_DNS,
+	TR_CONNECT,
+	TR_FIRST_BYTE,
+	TR_LAST_BYTE,
+	TR_NPHASES
+};
+
+/* Where the response came from */
+enum {
+	TR_NOCACHE,     /* answered by the proxy or not cacheable */
+	TR_HIT,
+	TR_MISS,
+	TR_STALE
+};
+
+/* One request; a zero timestamp means the phase was not reached */
+typedef struct {
+	uint64_t t[TR_NPHASES];
+	uint64_t bytes;     /* sent to the client */
+	uint32_t thread;
+	uint32_t client;    /* IPv4 address, network order */
+	uint16_t status;    /* 0 if no response was sent */
+	uint8_t cache;      /* TR_HIT etc. */
+	uint8_t pad[5];
+	char uri[TRACE_URI_LEN];
+} trace_rec_t;
+
+/* Header of the binary dump served at TRACE_URI */
+typedef struct {
+	uint32_t magic;
+	uint32_t nphases;
+	uint32_t rec_size;
+	uint32_t count;
+} trace_hdr_t;
+
+extern int trace_enabled;
+
+void trace_init(int enabled, int ringed);
+trace_rec_t *trace_begin(trace_rec_t *rec);
+void trace_end(trace_rec_t *rec);
+void trace_serve(int fd);
+
+/*
+ * Tracing costs one predictable branch per site while it is disabled
+ */
+#define TRACE_BEGIN(rec) (trace_enabled ? trace_begin(rec) : NULL)
+#define TRACE_MARK(rec, phase) \
+	do { if (rec) (rec)->t[phase] = metrics_now(); } while (0)
+#define TRACE_SET(rec, field, value) \
+	do { if (rec) (rec)->field = (value); } while (0)
+#define TRACE_END(rec) \
+	do { if (rec) trace_end(rec); } while (0)
+
+#endif
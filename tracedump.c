@@ -0,0 +1,106 @@
+/*
+ * tracedump.c - convert a proxy trace dump into Chrome trace JSON
+ *
+ *   curl -s http://localhost:<port>/__proxy/trace > trace.bin
+ *   ./tracedump trace.bin > trace.json
+ *
+ * or straight from the proxy:
+ *
+ *   curl -s http://localhost:<port>/__proxy/trace | ./tracedump > trace.json
+ *
+ * Load trace.json in chrome://tracing or Perfetto. Each request is one
+ * span on its thread's row, with one nested span per phase.
+ */
+#include "trace.h"
+
+static const char *phase_names[TR_NPHASES] = {
+	"start", "read", "parse", "cache_lookup", "dns", "connect",
+	"first_byte", "last_byte",
+};
+
+/*
+ * Print s as a JSON string body
+ */
+static void json_escape(const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+}
+
+static void emit(int *first, const char *name, const char *uri,
+	uint32_t tid, uint64_t from, uint64_t to, uint64_t base)
+{
+	printf("%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+		"\"ts\":%.3f,\"dur\":%.3f", *first ? "" : ",", name, tid,
+		(from - base) / 1e3, (to - from) / 1e3);
+	if (uri) {
+		printf(",\"args\":{\"uri\":\"");
+		json_escape(uri);
+		printf("\"}");
+	}
+	printf("}");
+	*first = 0;
+}
+
+int main(int argc, char **argv)
+{
+	trace_hdr_t th;
+	trace_rec_t *recs = NULL, *rec;
+	uint64_t base = UINT64_MAX, prev, last;
+	FILE *in = stdin;
+	size_t n = 0, cap = 0;
+	int p, first = 1;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [dumpfile]\n", argv[0]);
+		exit(1);
+	}
+	if (argc == 2)
+		in = Fopen(argv[1], "rb");
+	if (fread(&th, sizeof(th), 1, in) != 1 || th.magic != TRACE_MAGIC ||
+		th.nphases != TR_NPHASES || th.rec_size != sizeof(trace_rec_t))
+		app_error("tracedump: not a trace dump from this proxy version");
+
+	/* Read it all in one pass: the input may be a pipe, not a file */
+	while (n < th.count) {
+		if (n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			recs = (trace_rec_t *)Realloc(recs, cap * sizeof(*recs));
+		}
+		if (fread(&recs[n], sizeof(*recs), 1, in) != 1)
+			break;
+		n++;
+	}
+
+	/* Timestamps are relative to the earliest request */
+	for (rec = recs; rec < recs + n; rec++)
+		if (rec->t[TR_START] < base)
+			base = rec->t[TR_START];
+
+	printf("{\"traceEvents\":[");
+	for (rec = recs; rec < recs + n; rec++) {
+		rec->uri[TRACE_URI_LEN - 1] = '\0';
+		last = rec->t[TR_START];
+		for (p = 0; p < TR_NPHASES; p++)
+			if (rec->t[p] > last)
+				last = rec->t[p];
+		emit(&first, "request", rec->uri, rec->thread, rec->t[TR_START],
+			last, base);
+		prev = rec->t[TR_START];
+		for (p = TR_START + 1; p < TR_NPHASES; p++) {
+			if (rec->t[p] == 0)
+				continue;
+			emit(&first, phase_names[p], NULL, rec->thread, prev,
+				rec->t[p], base);
+			prev = rec->t[p];
+		}
+	}
+	printf("\n]}\n");
+	return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * tunnel.c - bidirectional byte relay for CONNECT tunnels
+ *
+ * Bytes move socket -> pipe -> socket with splice(), so payload never
+ * enters user space and one thread serves both directions from a
+ * single poll loop. Each direction owns one pipe of TUNNEL_PIPE_SIZE,
+ * which is the only buffering per tunnel.
+ */
+#define _GNU_SOURCE
+#include "tunnel.h"
+#include "co.h"
+
+typedef struct {
+	int src, dst;
+	int pipe[2];
+	size_t inpipe;      /* bytes sitting in the pipe */
+	int eof;            /* src reached EOF */
+	int shut;           /* dst write side shut down */
+	size_t total;
+} dir_t;
+
+static int dir_open(dir_t *d, int src, int dst)
+{
+	memset(d, 0, sizeof(*d));
+	d->src = src;
+	d->dst = dst;
+	if (pipe2(d->pipe, O_NONBLOCK) < 0)
+		return -1;
+	fcntl(d->pipe[0], F_SETPIPE_SZ, TUNNEL_PIPE_SIZE);
+	return 0;
+}
+
+static void dir_close(dir_t *d)
+{
+	close(d->pipe[0]);
+	close(d->pipe[1]);
+}
+
+/*
+ * Move what is ready for one direction; -1 on a fatal error
+ */
+static int dir_pump(dir_t *d, short src_ev, short dst_ev)
+{
+	ssize_t n;
+
+	if (!d->eof && (src_ev & (POLLIN | POLLHUP | POLLERR))) {
+		n = splice(d->src, NULL, d->pipe[1], NULL, TUNNEL_PIPE_SIZE,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n == 0)
+			d->eof = 1;
+		else if (n > 0)
+			d->inpipe += n;
+		else if (errno != EAGAIN && errno != EINTR)
+			return -1;
+	}
+	if (d->inpipe > 0 && (dst_ev & (POLLOUT | POLLERR | POLLHUP))) {
+		n = splice(d->pipe[0], NULL, d->dst, NULL, d->inpipe,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			d->inpipe -= n;
+			d->total += n;
+		}
+		else if (n < 0 && errno != EAGAIN && errno != EINTR)
+			return -1;
+	}
+	/* Propagate a half-close once everything has been delivered */
+	if (d->eof && d->inpipe == 0 && !d->shut) {
+		shutdown(d->dst, SHUT_WR);
+		d->shut = 1;
+	}
+	return 0;
+}
+
+static short want(dir_t *d, int fd)
+{
+	short ev = 0;
+
+	if (fd == d->src && !d->eof && d->inpipe < TUNNEL_PIPE_SIZE)
+		ev |= POLLIN;
+	if (fd == d->dst && d->inpipe > 0)
+		ev |= POLLOUT;
+	return ev;
+}
+
+/*
+ * tunnel_splice - move exactly len bytes from src to dst through a
+ * 		pipe; returns bytes moved, or -1 on error or early EOF
+ */
+ssize_t tunnel_splice(int src, int dst, size_t len)
+{
+	int p[2];
+	size_t left = len;
+	ssize_t in, out;
+
+	if (pipe(p) < 0)
+		return -1;
+	fcntl(p[0], F_SETPIPE_SZ, TUNNEL_PIPE_SIZE);
+	while (left > 0) {
+		in = splice(src, NULL, p[1], NULL,
+			left < TUNNEL_PIPE_SIZE ? left : TUNNEL_PIPE_SIZE, SPLICE_F_MOVE);
+		if (in < 0 && (errno == EINTR || (errno == EAGAIN && rio_wait &&
+			rio_wait(src, POLLIN) == 0)))
+			continue;
+		if (in <= 0)
+			break;
+		left -= in;
+		while (in > 0) {
+			out = splice(p[0], NULL, dst, NULL, in, SPLICE_F_MOVE);
+			if (out < 0 && (errno == EINTR || (errno == EAGAIN && rio_wait &&
+				rio_wait(dst, POLLOUT) == 0)))
+				continue;
+			if (out <= 0) {
+				close(p[0]);
+				close(p[1]);
+				return -1;
+			}
+			in -= out;
+		}
+	}
+	close(p[0]);
+	close(p[1]);
+	return left == 0 ? (ssize_t)len : -1;
+}
+
+/*
+ * tunnel_relay - relay between clientfd and serverfd until both sides
+ * 		close, an error occurs, or the tunnel sits idle too long.
+ * 		pending holds client bytes already read past the CONNECT header.
+ */
+void tunnel_relay(int clientfd, int serverfd, char *pending, size_t npending,
+	size_t *up_bytes, size_t *down_bytes)
+{
+	dir_t up, down;
+	struct pollfd pfd[2];
+	int n;
+
+	*up_bytes = *down_bytes = 0;
+	if (npending > 0 && rio_writen(serverfd, pending, npending) < 0)
+		return;
+	if (dir_open(&up, clientfd, serverfd) < 0)
+		return;
+	if (dir_open(&down, serverfd, clientfd) < 0) {
+		dir_close(&up);
+		return;
+	}
+	fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) | O_NONBLOCK);
+	fcntl(serverfd, F_SETFL, fcntl(serverfd, F_GETFL) | O_NONBLOCK);
+
+	while (!(up.shut && down.shut)) {
+		pfd[0].fd = clientfd;
+		pfd[0].events = want(&up, clientfd) | want(&down, clientfd);
+		pfd[1].fd = serverfd;
+		pfd[1].events = want(&up, serverfd) | want(&down, serverfd);
+		pfd[0].revents = pfd[1].revents = 0;
+
+		if ((n = co_poll(pfd, 2, TUNNEL_IDLE_MS)) == 0)
+			break;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (dir_pump(&up, pfd[0].revents, pfd[1].revents) < 0 ||
+			dir_pump(&down, pfd[1].revents, pfd[0].revents) < 0)
+			break;
+	}
+
+	*up_bytes = up.total + npending;
+	*down_bytes = down.total;
+	dir_close(&up);
+	dir_close(&down);
+}
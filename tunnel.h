@@ -0,0 +1,15 @@
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#include "csapp.h"
+
+/* Per-direction kernel pipe capacity; bounds memory per tunnel */
+#define TUNNEL_PIPE_SIZE 65536
+/* Close the tunnel after this long with no traffic either way */
+#define TUNNEL_IDLE_MS 120000
+
+ssize_t tunnel_splice(int src, int dst, size_t len);
+void tunnel_relay(int clientfd, int serverfd, char *pending, size_t npending,
+	size_t *up_bytes, size_t *down_bytes);
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * upgrade.c - hand the listening socket and the cache to a new binary
+ *
+ * On SIGUSR2 the running proxy snapshots its cache into a memfd, forks
+ * and execs its own argv[0] (the upgraded binary) with one end of a
+ * socketpair named in UPGRADE_ENV, and sends the listening socket and
+ * the memfd over it as SCM_RIGHTS. The new process maps the snapshot,
+ * so it starts warm, and acks; the old one then stops accepting and
+ * drains. The socket is never closed, so no connection is refused.
+ */
+#define _GNU_SOURCE
+#include "upgrade.h"
+#include "snapshot.h"
+#include "cache.h"
+#include <poll.h>
+#include <sys/syscall.h>
+
+/*
+ * Send up to two descriptors with one byte of payload
+ */
+static int send_fds(int sock, int *fds, int n)
+{
+	char byte = 'F', cbuf[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+	return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+/*
+ * Receive the descriptors sent by send_fds; returns how many arrived
+ */
+static int recv_fds(int sock, int *fds, int max)
+{
+	char byte, cbuf[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+		return 0;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+		cmsg->cmsg_type != SCM_RIGHTS)
+		return 0;
+	n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	if (n > max)
+		n = max;
+	memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+	return n;
+}
+
+extern char **environ;
+
+/*
+ * In the forked child: keep only stdio and the handoff socket (as fd 3)
+ * so client connections are not leaked into the new process, then exec.
+ * Only async-signal-safe calls: envp was built before the fork.
+ */
+static void exec_child(int sock, char **argv, char **envp)
+{
+	int fd;
+
+	if (sock != 3) {
+		dup2(sock, 3);
+		close(sock);
+	}
+	else {
+		fcntl(3, F_SETFD, 0);
+	}
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, 4, ~0U, 0) < 0)
+#endif
+		for (fd = 4; fd < 65536; fd++)
+			close(fd);
+	execve(argv[0], argv, envp);
+	_exit(127);
+}
+
+/*
+ * Copy of the environment with UPGRADE_ENV=3 in front
+ */
+static char **upgrade_env()
+{
+	char **envp;
+	int n, i;
+
+	for (n = 0; environ[n]; n++)
+		;
+	envp = (char **)Malloc((n + 2) * sizeof(char *));
+	envp[0] = UPGRADE_ENV "=3";
+	for (i = 0; i < n; i++)
+		envp[i + 1] = environ[i];
+	envp[n + 1] = NULL;
+	return envp;
+}
+
+/*
+ * upgrade_start - start argv as the new proxy and hand it listenfd and
+ * 		the cache; 0 once it has taken over, -1 if the old process
+ * 		must keep serving
+ */
+int upgrade_start(int listenfd, char **argv)
+{
+	struct pollfd pfd;
+	int sv[2], fds[2], nfds = 1, memfd;
+	char ack, **envp;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+		return -1;
+	/*
+	 * A failed snapshot only means the new process starts cold. A
+	 * shared cache needs none: the new process attaches to it by name.
+	 */
+	fds[0] = listenfd;
+	memfd = -1;
+	if (!cache_shared() &&
+		(memfd = memfd_create("proxy-cache", MFD_CLOEXEC)) >= 0 &&
+		snapshot_save_fd(memfd) == 0)
+		fds[nfds++] = memfd;
+
+	envp = upgrade_env();
+	if ((pid = fork()) < 0) {
+		Free(envp);
+		close(sv[0]);
+		close(sv[1]);
+		if (memfd >= 0)
+			close(memfd);
+		return -1;
+	}
+	if (pid == 0)
+		exec_child(sv[1], argv, envp);
+	Free(envp);
+	close(sv[1]);
+
+	pfd.fd = sv[0];
+	pfd.events = POLLIN;
+	if (send_fds(sv[0], fds, nfds) < 0 ||
+		poll(&pfd, 1, UPGRADE_ACK_MS) != 1 || read(sv[0], &ack, 1) != 1) {
+		/* Never became ready: it must not share the socket with us */
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		pid = -1;
+	}
+	close(sv[0]);
+	if (memfd >= 0)
+		close(memfd);
+	return pid < 0 ? -1 : 0;
+}
+
+/*
+ * upgrade_inherit - if started by upgrade_start, take over its listening
+ * 		socket and cache snapshot and ack. Returns 1 with *listenfd
+ * 		set (and *restored to the objects restored, or -1), 0 for a
+ * 		normal start. Call after cache_init.
+ */
+int upgrade_inherit(int *listenfd, int *restored)
+{
+	char *env, path[64];
+	int sock, fds[2], n;
+
+	if ((env = getenv(UPGRADE_ENV)) == NULL)
+		return 0;
+	sock = atoi(env);
+	unsetenv(UPGRADE_ENV);
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+	if ((n = recv_fds(sock, fds, 2)) < 1) {
+		close(sock);
+		return 0;
+	}
+	*listenfd = fds[0];
+	*restored = -1;
+	if (n > 1) {
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", fds[1]);
+		*restored = snapshot_load(path);
+		close(fds[1]);
+	}
+	if (write(sock, "R", 1) != 1) {
+		close(sock);
+		unix_error("upgrade ack error");
+	}
+	close(sock);
+	return 1;
+}
@@ -0,0 +1,15 @@
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+#include "csapp.h"
+
+/* Binary upgrade handoff (SIGUSR2) */
+#define UPGRADE_ENV "PROXY_UPGRADE_FD" /* socket to the old process */
+#define UPGRADE_ACK_MS 10000    /* wait for the new process to be ready */
+#define UPGRADE_DRAIN_MS 30000  /* then let open connections finish */
+#define UPGRADE_WAKE_SIG SIGUSR1 /* interrupts accept to stop the loop */
+
+int upgrade_start(int listenfd, char **argv);
+int upgrade_inherit(int *listenfd, int *restored);
+
+#endif
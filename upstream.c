@@ -0,0 +1,254 @@
+/*
+ * upstream.c - name resolution and connection setup to origin servers
+ *
+ * Split out of open_clientfd_r so the two steps can be timed separately.
+ * Addresses of both families are raced RFC 8305 style: a new
+ * non-blocking attempt starts every CONNECT_ATTEMPT_DELAY_MS (or as soon
+ * as one fails), the first to complete wins and the rest are closed.
+ * A dead address therefore costs at most one stagger delay instead of
+ * the kernel's SYN retry timeout.
+ */
+#include "upstream.h"
+#include "uring.h"
+#include "co.h"
+#include <time.h>
+
+#define MAX_ADDRS 32
+
+typedef struct {
+	int fd;
+	long deadline;
+} attempt_t;
+
+/* Overall connect budget; changed by a config reload */
+static int connect_timeout_ms = CONNECT_TIMEOUT_MS;
+
+static long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * upstream_set_timeout - set the overall connect timeout
+ */
+void upstream_set_timeout(int ms)
+{
+	__atomic_store_n(&connect_timeout_ms, ms, __ATOMIC_RELAXED);
+}
+
+/*
+ * upstream_resolve - look up hostname:port, 0 on success, -1 on error
+ */
+int upstream_resolve(char *hostname, char *port, struct addrinfo **res)
+{
+	struct addrinfo hints;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	if (getaddrinfo(hostname, port, &hints, res) != 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * Order addresses by alternating family, starting with the family
+ * getaddrinfo preferred, as RFC 8305 section 4 recommends
+ */
+static int interleave(struct addrinfo *addrs, struct addrinfo **out)
+{
+	struct addrinfo *first[MAX_ADDRS], *other[MAX_ADDRS], *p;
+	int nf = 0, no = 0, i = 0, j = 0, n = 0;
+
+	for (p = addrs; p; p = p->ai_next) {
+		if (p->ai_family != AF_INET && p->ai_family != AF_INET6)
+			continue;
+		if (p->ai_family == addrs->ai_family) {
+			if (nf < MAX_ADDRS)
+				first[nf++] = p;
+		}
+		else if (no < MAX_ADDRS) {
+			other[no++] = p;
+		}
+	}
+	while ((i < nf || j < no) && n < MAX_ADDRS) {
+		if (i < nf)
+			out[n++] = first[i++];
+		if (j < no && n < MAX_ADDRS)
+			out[n++] = other[j++];
+	}
+	return n;
+}
+
+/*
+ * Start a non-blocking connect; returns 1 if it completed at once,
+ * 0 if in progress, -1 if it failed immediately
+ */
+static int attempt_start(struct addrinfo *ai, attempt_t *a)
+{
+	int fd;
+
+	fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+		ai->ai_protocol);
+	if (fd < 0)
+		return -1;
+	a->fd = fd;
+	a->deadline = now_ms() + CONNECT_ATTEMPT_TIMEOUT_MS;
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+		return 1;
+	if (errno == EINPROGRESS)
+		return 0;
+	close(fd);
+	return -1;
+}
+
+/*
+ * Hand the winning socket back in blocking mode for the Rio routines;
+ * coroutines keep it non-blocking and wait through rio_wait instead
+ */
+static int attempt_win(int fd)
+{
+	int flags;
+
+	if (co_active())
+		return fd;
+	flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+	return fd;
+}
+
+/*
+ * upstream_connect - race connects to addrs, return the first socket
+ * 		to connect or -1 if every address failed or timed out,
+ * 		with errno ETIMEDOUT if any attempt timed out
+ */
+int upstream_connect(struct addrinfo *addrs)
+{
+	struct addrinfo *order[MAX_ADDRS];
+	struct pollfd pfds[CONNECT_MAX_ATTEMPTS];
+	attempt_t live[CONNECT_MAX_ATTEMPTS];
+	long now, deadline, next_start, wait;
+	int naddrs, next = 0, nlive = 0, i, rc, err, winner = -1;
+	int timed_out = 0;
+	socklen_t len;
+
+	naddrs = interleave(addrs, order);
+	deadline = now_ms() + __atomic_load_n(&connect_timeout_ms, __ATOMIC_RELAXED);
+	next_start = now_ms();
+
+	while (winner < 0) {
+		now = now_ms();
+		if (now >= deadline) {
+			timed_out = 1;
+			break;
+		}
+
+		/* Launch the next attempt when the stagger delay has passed */
+		while (next < naddrs && nlive < CONNECT_MAX_ATTEMPTS &&
+			(now >= next_start || nlive == 0)) {
+			rc = attempt_start(order[next++], &live[nlive]);
+			if (rc == 1) {
+				winner = live[nlive].fd;
+				break;
+			}
+			if (rc == 0) {
+				nlive++;
+				next_start = now + CONNECT_ATTEMPT_DELAY_MS;
+				break;
+			}
+		}
+		if (winner >= 0)
+			break;
+		if (nlive == 0)
+			break; /* nothing in flight and nothing left to try */
+
+		/* Sleep until a socket completes or the next timer fires */
+		wait = deadline - now;
+		if (next < naddrs && nlive < CONNECT_MAX_ATTEMPTS &&
+			next_start - now < wait)
+			wait = next_start - now;
+		for (i = 0; i < nlive; i++) {
+			if (live[i].deadline - now < wait)
+				wait = live[i].deadline - now;
+			pfds[i].fd = live[i].fd;
+			pfds[i].events = POLLOUT;
+			pfds[i].revents = 0;
+		}
+		if (wait < 0)
+			wait = 0;
+		if (co_poll(pfds, nlive, (int)wait) < 0 && errno != EINTR)
+			break;
+
+		now = now_ms();
+		for (i = 0; i < nlive; ) {
+			if (pfds[i].revents) {
+				err = 0;
+				len = sizeof(err);
+				getsockopt(live[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err == 0 && !(pfds[i].revents & (POLLERR | POLLHUP))) {
+					winner = live[i].fd;
+					live[i] = live[--nlive];
+					pfds[i] = pfds[nlive];
+					break;
+				}
+			}
+			else if (now < live[i].deadline) {
+				i++;
+				continue;
+			}
+			else {
+				timed_out = 1;
+			}
+			/* Failed or timed out: drop it and start the next one now */
+			close(live[i].fd);
+			live[i] = live[--nlive];
+			pfds[i] = pfds[nlive];
+			next_start = now;
+		}
+	}
+
+	for (i = 0; i < nlive; i++)
+		close(live[i].fd);
+	if (winner < 0) {
+		/* A blackholed address is a timeout even if others refused */
+		errno = timed_out ? ETIMEDOUT : ECONNREFUSED;
+		return -1;
+	}
+	return attempt_win(winner);
+}
+
+/*
+ * upstream_connect_send - connect to addrs and send request; returns
+ * 		the socket, or -1 as upstream_connect does
+ */
+int upstream_connect_send(struct addrinfo *addrs, char *request, size_t len)
+{
+	int fd, timeout;
+
+	/*
+	 * With io_uring, try the first address with connect and send in
+	 * one submission. With others to race it gets the stagger delay,
+	 * as it would in the race; if it is slower, race every address as
+	 * usual, and if it failed outright, race the rest. A lone address
+	 * has nothing to race, so it gets the whole attempt timeout rather
+	 * than being cancelled and started over. Not on a coroutine, whose
+	 * wait in the ring would stall its whole scheduler.
+	 */
+	if (uring_enabled() && !co_active()) {
+		timeout = __atomic_load_n(&connect_timeout_ms, __ATOMIC_RELAXED);
+		if (timeout > CONNECT_ATTEMPT_TIMEOUT_MS)
+			timeout = CONNECT_ATTEMPT_TIMEOUT_MS;
+		fd = uring_connect_send(addrs, request, len,
+			addrs->ai_next ? CONNECT_ATTEMPT_DELAY_MS : timeout);
+		if (fd >= 0 || addrs->ai_next == NULL)
+			return fd;
+		if (errno != ETIMEDOUT)
+			addrs = addrs->ai_next;
+	}
+	if ((fd = upstream_connect(addrs)) >= 0)
+		Rio_writen(fd, request, len);
+	return fd;
+}
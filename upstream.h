@@ -0,0 +1,17 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "csapp.h"
+
+/* Happy-eyeballs (RFC 8305) connection racing parameters */
+#define CONNECT_ATTEMPT_DELAY_MS 250   /* stagger between attempts */
+#define CONNECT_ATTEMPT_TIMEOUT_MS 3000 /* give up on one address */
+#define CONNECT_TIMEOUT_MS 10000       /* default: give up on the origin */
+#define CONNECT_MAX_ATTEMPTS 8         /* attempts in flight at once */
+
+int upstream_resolve(char *hostname, char *port, struct addrinfo **res);
+int upstream_connect(struct addrinfo *addrs);
+int upstream_connect_send(struct addrinfo *addrs, char *request, size_t len);
+void upstream_set_timeout(int ms);
+
+#endif
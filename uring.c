@@ -0,0 +1,418 @@
+/*
+ * uring.c - io_uring I/O engine, driven by raw system calls
+ *
+ * The accept loop keeps URING_ACCEPTS accepts armed on the listening
+ * socket, which is registered with the ring so the kernel skips the
+ * fd table lookup on every one. Completed accepts are reaped in
+ * batches: under load one io_uring_enter hands back many connections
+ * and re-arms as many accepts, where the thread path makes one accept
+ * call per connection. Each armed accept has its own address slot, so
+ * the rate limiter still gets the peer address without a getpeername.
+ *
+ * On the miss path a connection thread submits connect, a linked
+ * timeout and the request send as one chain with one system call.
+ * Per-thread rings are created lazily and recycled through a free
+ * list when threads exit, so a connection does not pay for ring setup.
+ */
+#include "uring.h"
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+typedef struct uring_t uring_t;
+struct uring_t {
+	int fd;
+	unsigned entries;
+	unsigned sq_local;      /* our tail; published on enter */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_len, cq_len, sqes_len;
+	uring_t *free_next;
+};
+
+static uint64_t enters;     /* io_uring_enter calls, all rings */
+static int enabled;
+
+/* Listener ring, only touched by the accept loop (and the canceller) */
+static uring_t acc;
+static struct sockaddr_in acc_addr[URING_ACCEPTS];
+static socklen_t acc_len[URING_ACCEPTS];
+static int acc_armed;
+static int acc_stopped;
+
+static uring_t *free_rings;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread uring_t *ring_self;
+
+static void ring_free(uring_t *r)
+{
+	munmap(r->sqes, r->sqes_len);
+	if (r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_len);
+	munmap(r->sq_map, r->sq_len);
+	close(r->fd);
+}
+
+/*
+ * Create a ring with room for entries submissions; -1 if the kernel
+ * has no io_uring or it is disabled
+ */
+static int ring_setup(uring_t *r, unsigned entries)
+{
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(*r));
+	if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return -1;
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && r->cq_len > r->sq_len)
+		r->sq_len = r->cq_len;
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED) {
+		close(r->fd);
+		return -1;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_map = r->sq_map;
+	else
+		r->cq_map = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+		if (r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+			munmap(r->cq_map, r->cq_len);
+		if (r->sqes != MAP_FAILED)
+			munmap(r->sqes, r->sqes_len);
+		munmap(r->sq_map, r->sq_len);
+		close(r->fd);
+		return -1;
+	}
+
+	sq = (unsigned char *)r->sq_map;
+	cq = (unsigned char *)r->cq_map;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->entries = p.sq_entries;
+	r->sq_local = *r->sq_tail;
+	return 0;
+}
+
+/*
+ * Next free submission entry, cleared; NULL if the queue is full
+ */
+static struct io_uring_sqe *ring_sqe(uring_t *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+		r->entries)
+		return NULL;
+	idx = r->sq_local & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	r->sq_local++;
+	return sqe;
+}
+
+/*
+ * Submit everything queued and wait for at least wait completions
+ */
+static int ring_enter(uring_t *r, unsigned wait)
+{
+	unsigned submit;
+	int rc;
+
+	__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+	submit = r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if (submit == 0 && wait == 0)
+		return 0;
+	__atomic_add_fetch(&enters, 1, __ATOMIC_RELAXED);
+	rc = syscall(__NR_io_uring_enter, r->fd, submit, wait,
+		wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	return rc;
+}
+
+/*
+ * Oldest unseen completion, or NULL
+ */
+static struct io_uring_cqe *ring_cqe(uring_t *r)
+{
+	unsigned head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &r->cqes[head & *r->cq_mask];
+}
+
+static void ring_seen(uring_t *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static void ring_release(void *arg)
+{
+	uring_t *r = (uring_t *)arg;
+
+	pthread_mutex_lock(&ring_lock);
+	r->free_next = free_rings;
+	free_rings = r;
+	pthread_mutex_unlock(&ring_lock);
+}
+
+/*
+ * The calling thread's ring, from the free list or made now
+ */
+static uring_t *ring_claim()
+{
+	uring_t *r;
+
+	if (ring_self != NULL)
+		return ring_self;
+	pthread_mutex_lock(&ring_lock);
+	if ((r = free_rings) != NULL)
+		free_rings = r->free_next;
+	pthread_mutex_unlock(&ring_lock);
+	if (r == NULL) {
+		r = (uring_t *)Malloc(sizeof(*r));
+		if (ring_setup(r, URING_THREAD_ENTRIES) < 0) {
+			Free(r);
+			return NULL;
+		}
+	}
+	pthread_setspecific(ring_key, r);
+	ring_self = r;
+	return r;
+}
+
+/*
+ * Cancel every armed accept and wait until the kernel has done so
+ */
+static int accept_cancel()
+{
+	struct io_uring_sync_cancel_reg reg;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+	reg.timeout.tv_sec = -1;
+	reg.timeout.tv_nsec = -1;
+	return syscall(__NR_io_uring_register, acc.fd,
+		IORING_REGISTER_SYNC_CANCEL, &reg, 1);
+}
+
+static void accept_arm(int slot)
+{
+	struct io_uring_sqe *sqe = ring_sqe(&acc);
+
+	acc_len[slot] = sizeof(acc_addr[slot]);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = 0;    /* the registered listener */
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->addr = (uintptr_t)&acc_addr[slot];
+	sqe->addr2 = (uintptr_t)&acc_len[slot];
+	sqe->user_data = slot;
+	acc_armed++;
+}
+
+/*
+ * uring_accept_start - switch the accept loop and the miss path to
+ * 		io_uring; -1 (and nothing changes) if the kernel cannot
+ */
+int uring_accept_start(int listenfd)
+{
+	int i;
+
+	if (ring_setup(&acc, URING_ACCEPTS * 2) < 0)
+		return -1;
+	if (syscall(__NR_io_uring_register, acc.fd, IORING_REGISTER_FILES,
+		&listenfd, 1) < 0)
+		goto fail;
+	/* Upgrades need synchronous cancel (Linux 6.0); nothing matches yet */
+	if (accept_cancel() < 0 && errno != ENOENT)
+		goto fail;
+	if ((errno = pthread_key_create(&ring_key, ring_release)) != 0)
+		goto fail;
+	for (i = 0; i < URING_ACCEPTS; i++)
+		accept_arm(i);
+	if (ring_enter(&acc, 0) < 0)
+		goto fail;
+	enabled = 1;
+	return 0;
+
+fail:
+	ring_free(&acc);
+	return -1;
+}
+
+/*
+ * uring_accept - next accepted connection, with its peer in addr; -1
+ * 		once uring_accept_stop has run and every accept is done
+ */
+int uring_accept(struct sockaddr_in *addr)
+{
+	struct io_uring_cqe *cqe;
+	int slot, res;
+
+	while (1) {
+		if ((cqe = ring_cqe(&acc)) == NULL) {
+			if (acc_armed == 0)
+				return -1;
+			/* Catch a re-arm that raced with uring_accept_stop */
+			if (__atomic_load_n(&acc_stopped, __ATOMIC_ACQUIRE))
+				accept_cancel();
+			if (ring_enter(&acc, 1) < 0 && errno != EINTR && errno != EBUSY)
+				unix_error("io_uring_enter error");
+			continue;
+		}
+		slot = (int)cqe->user_data;
+		res = cqe->res;
+		ring_seen(&acc);
+		acc_armed--;
+		if (!__atomic_load_n(&acc_stopped, __ATOMIC_ACQUIRE))
+			accept_arm(slot);
+		if (res >= 0) {
+			*addr = acc_addr[slot];
+			return res;
+		}
+		if (res != -ECANCELED && res != -ECONNABORTED && res != -EINTR &&
+			res != -EAGAIN) {
+			errno = -res;
+			unix_error("Accept error");
+		}
+	}
+}
+
+/*
+ * uring_accept_stop - stop accepting, from any thread; connections
+ * 		already accepted are still returned by uring_accept
+ */
+void uring_accept_stop()
+{
+	if (!enabled)
+		return;
+	__atomic_store_n(&acc_stopped, 1, __ATOMIC_RELEASE);
+	accept_cancel();
+}
+
+/*
+ * uring_accept_close - free the listener ring once uring_accept has
+ * 		returned -1. Its registered socket goes with it, so the
+ * 		port is not held open after the process exits.
+ */
+void uring_accept_close()
+{
+	if (!enabled)
+		return;
+	syscall(__NR_io_uring_register, acc.fd, IORING_UNREGISTER_FILES, NULL, 0);
+	ring_free(&acc);
+}
+
+int uring_enabled()
+{
+	return enabled;
+}
+
+/*
+ * uring_enters - io_uring_enter calls so far, for the metrics
+ */
+uint64_t uring_enters()
+{
+	return __atomic_load_n(&enters, __ATOMIC_RELAXED);
+}
+
+/*
+ * uring_connect_send - connect to ai and send buf in one submission,
+ * 		giving up on the connect after timeout_ms; the blocking
+ * 		socket, or -1 with errno ETIMEDOUT if the connect timed out
+ */
+int uring_connect_send(struct addrinfo *ai, char *buf, size_t len,
+	int timeout_ms)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	uring_t *r;
+	int fd, done = 0, err = ETIMEDOUT;
+	ssize_t sent = -1;
+
+	if ((r = ring_claim()) == NULL)
+		return -1;
+	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+		return -1;
+
+	sqe = ring_sqe(r);
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)ai->ai_addr;
+	sqe->off = ai->ai_addrlen;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = 0;
+
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	sqe = ring_sqe(r);
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->addr = (uintptr_t)&ts;
+	sqe->len = 1;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = 1;
+
+	sqe = ring_sqe(r);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = 2;
+
+	/* Every entry in the chain completes, even when cancelled */
+	while (done < 3) {
+		if ((cqe = ring_cqe(r)) == NULL) {
+			if (ring_enter(r, 3 - done) < 0 && errno != EINTR &&
+				errno != EBUSY)
+				break;
+			continue;
+		}
+		if (cqe->user_data == 0 && cqe->res != -ECANCELED)
+			err = -cqe->res;
+		else if (cqe->user_data == 2)
+			sent = cqe->res;
+		ring_seen(r);
+		done++;
+	}
+	if (done < 3) {
+		/* The ring is in an unknown state: retire it */
+		pthread_setspecific(ring_key, NULL);
+		ring_self = NULL;
+		ring_free(r);
+		Free(r);
+		close(fd);
+		return -1;
+	}
+	if (err != 0 || sent < 0 ||
+		((size_t)sent < len && rio_writen(fd, buf + sent, len - sent) < 0)) {
+		close(fd);
+		errno = err ? err : EIO;
+		return -1;
+	}
+	return fd;
+}
@@ -0,0 +1,19 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "csapp.h"
+
+/* io_uring I/O engine (-U) */
+#define URING_ACCEPTS 32         /* accepts kept armed on the listener */
+#define URING_THREAD_ENTRIES 4   /* per-thread ring: connect, timeout, send */
+
+int uring_accept_start(int listenfd);
+int uring_accept(struct sockaddr_in *addr);
+void uring_accept_stop();
+void uring_accept_close();
+int uring_enabled();
+uint64_t uring_enters();
+int uring_connect_send(struct addrinfo *ai, char *buf, size_t len,
+	int timeout_ms);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * warm.c - pre-warm the cache from a list of URLs
+ *
+ * Each worker requests URLs from the proxy's own listening port, so
+ * fetched objects go through the normal miss path (breaker, size limit,
+ * cache_store) with no second code path to keep in sync. The number of
+ * workers bounds how many origin fetches warm-up adds at once. Each
+ * request carries WARM_HDR, which the proxy strips, so the admission
+ * filter (-A) does not wait for a second sighting. Its value is a
+ * secret drawn at startup, and the proxy only honours it from a
+ * loopback peer, so clients cannot use it to skip admission.
+ *
+ * The rate limiter (-r) sees connections before any header, so for it
+ * each fetch binds its socket first and marks the local port; the
+ * accept loop lets a 127.0.0.1 peer on a marked port through with
+ * warm_peer. No other socket can hold that address and port meanwhile.
+ */
+#include "warm.h"
+#include <sys/random.h>
+
+static char secret[WARM_SECRET_LEN * 2 + 1];
+
+/* Local ports of our own open connections to the proxy, one bit each */
+static uint64_t own_ports[65536 / 64];
+
+/*
+ * warm_init - draw the secret that marks this process's own fetches
+ */
+void warm_init()
+{
+	unsigned char bytes[WARM_SECRET_LEN];
+	int i;
+
+	if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes))
+		unix_error("getrandom error");
+	for (i = 0; i < WARM_SECRET_LEN; i++)
+		sprintf(secret + 2 * i, "%02x", bytes[i]);
+}
+
+/*
+ * warm_check - whether a WARM_HDR value from peer (network order)
+ * 		came from our own warm-up or prefetch workers
+ */
+int warm_check(char *value, uint32_t peer)
+{
+	size_t len = strlen(secret);
+
+	if ((ntohl(peer) >> 24) != 127)
+		return 0;
+	return !strncmp(value, secret, len) &&
+		(value[len] == '\r' || value[len] == '\n' || value[len] == '\0');
+}
+
+/*
+ * warm_peer - whether addr is the far end of one of our own fetches
+ */
+int warm_peer(struct sockaddr_in *addr)
+{
+	unsigned port = ntohs(addr->sin_port);
+
+	return addr->sin_addr.s_addr == htonl(INADDR_LOOPBACK) &&
+		(__atomic_load_n(&own_ports[port / 64], __ATOMIC_ACQUIRE) >>
+			(port % 64) & 1);
+}
+
+/*
+ * Connect to the proxy on port from 127.0.0.1, the local port marked
+ * for warm_peer before the proxy can accept; -1 on error
+ */
+static int own_connect(int port, unsigned *lport)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int fd;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (SA *)&sa, sizeof(sa)) < 0 ||
+		getsockname(fd, (SA *)&sa, &len) < 0) {
+		close(fd);
+		return -1;
+	}
+	*lport = ntohs(sa.sin_port);
+	__atomic_fetch_or(&own_ports[*lport / 64], 1ull << (*lport % 64),
+		__ATOMIC_RELEASE);
+	sa.sin_port = htons(port);
+	if (connect(fd, (SA *)&sa, sizeof(sa)) < 0) {
+		__atomic_fetch_and(&own_ports[*lport / 64],
+			~(1ull << (*lport % 64)), __ATOMIC_RELEASE);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Close a connection from own_connect, unmarking its port first so
+ * the port is never marked while another socket could hold it
+ */
+static void own_close(int fd, unsigned lport)
+{
+	__atomic_fetch_and(&own_ports[lport / 64], ~(1ull << (lport % 64)),
+		__ATOMIC_RELEASE);
+	close(fd);
+}
+
+typedef struct {
+	FILE *list;
+	int port;
+	pthread_mutex_t lock;
+	int running;
+	long fetched;
+} warm_t;
+
+/*
+ * warm_fetch - GET uri through the proxy on port, discarding the body;
+ * 		return the response size or -1, and its status in *status
+ * 		unless that is NULL
+ */
+long warm_fetch(int port, char *uri, int *status)
+{
+	char buf[MAXBUF], head[16];
+	long total = 0;
+	ssize_t n;
+	unsigned lport;
+	int fd;
+
+	if ((fd = own_connect(port, &lport)) < 0)
+		return -1;
+	snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\n" WARM_HDR ": %s\r\n\r\n",
+		uri, secret);
+	if (rio_writen(fd, buf, strlen(buf)) < 0) {
+		own_close(fd, lport);
+		return -1;
+	}
+	/* Keep the start of the status line, however the reads split it */
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		if (total < sizeof(head) - 1)
+			memcpy(head + total, buf, n < sizeof(head) - 1 - total ?
+				n : sizeof(head) - 1 - total);
+		total += n;
+	}
+	own_close(fd, lport);
+	head[total < sizeof(head) - 1 ? total : sizeof(head) - 1] = '\0';
+	if (status && sscanf(head, "HTTP/%*s %d", status) != 1)
+		*status = 0;
+	return n < 0 ? -1 : total;
+}
+
+static void *warm_worker(void *vargp)
+{
+	warm_t *w = (warm_t *)vargp;
+	char line[MAXLINE], *end;
+	int last, status;
+
+	Pthread_detach(pthread_self());
+	while (1) {
+		pthread_mutex_lock(&w->lock);
+		if (fgets(line, sizeof(line), w->list) == NULL) {
+			last = --w->running == 0;
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		pthread_mutex_unlock(&w->lock);
+
+		/* One URL per line; blank lines and # comments are skipped */
+		if ((end = strpbrk(line, "\r\n")) != NULL)
+			*end = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		/* Error pages (429, 502, ...) did not warm anything */
+		if (warm_fetch(w->port, line, &status) > 0 &&
+			status >= 200 && status <= 299)
+			__atomic_fetch_add(&w->fetched, 1, __ATOMIC_RELAXED);
+	}
+	if (last) {
+		fprintf(stderr, "warm-up: fetched %ld URLs\n", w->fetched);
+		fclose(w->list);
+		pthread_mutex_destroy(&w->lock);
+		Free(w);
+	}
+	return NULL;
+}
+
+/*
+ * warm_start - fetch every URL in listfile in the background using
+ * 		parallel workers; call once the proxy is listening on port
+ */
+void warm_start(char *listfile, int port, int parallel)
+{
+	pthread_t tid;
+	warm_t *w;
+	int i, n = parallel > 0 ? parallel : 1;
+
+	w = (warm_t *)Calloc(1, sizeof(*w));
+	if ((w->list = fopen(listfile, "r")) == NULL) {
+		fprintf(stderr, "warm-up: cannot open %s: %s\n", listfile,
+			strerror(errno));
+		Free(w);
+		return;
+	}
+	w->port = port;
+	w->running = n;
+	pthread_mutex_init(&w->lock, NULL);
+	for (i = 0; i < n; i++)
+		Pthread_create(&tid, NULL, warm_worker, w);
+}
@@ -0,0 +1,16 @@
+#ifndef __WARM_H__
+#define __WARM_H__
+
+#include "csapp.h"
+
+#define WARM_PARALLEL 4   /* default concurrent warm-up fetches */
+#define WARM_HDR "X-Proxy-Warm"  /* marks our own fetches, always cached */
+#define WARM_SECRET_LEN 16        /* random bytes in its value */
+
+void warm_init();
+int warm_check(char *value, uint32_t peer);
+int warm_peer(struct sockaddr_in *addr);
+void warm_start(char *listfile, int port, int parallel);
+long warm_fetch(int port, char *uri, int *status);
+
+#endif